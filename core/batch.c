@@ -0,0 +1,121 @@
+// vim:tabstop=4 shiftwidth=4
+/* Batch solving
+ * ----------------
+ * The batch mode of the solvers (-b) reads a stream of puzzles with
+ * kd_reader_next, in either format of reader.c, and solves each one
+ * serially, the parallelism is across puzzles instead of inside one.
+ *
+ * Solutions are printed one per line in the line format, with numbers
+ * separated by spaces when n is above 35, and "No solution" or "Invalid
+ * puzzle" in place of the ones that could not be found, so line k of the
+ * output always answers puzzle k. With -c or -u each line is the count
+ * verdict of kd_print_count instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+#define LINE_MAX_N 35
+
+static char value_char(int v) {
+    return v < 10 ? (char)('0' + v) : (char)('A' + v - 10);
+}
+
+/* Solves puzzle with the engine of opts, the solution goes to cells (n * n
+ * values). nodes, if not NULL, gets the nodes searched. */
+bool kd_solve(const kd_puzzle_t *puzzle, const kd_options_t *opts, int *cells,
+              long *nodes) {
+    kd_search_t *search = NULL;
+    kd_dlx_t *dlx = NULL;
+    kd_board_t *board;
+    bool solved;
+
+    if (opts->engine == KD_ENGINE_DLX) {
+        dlx = kd_new_dlx(puzzle);
+        solved = dlx != NULL && kd_dlx_run(dlx, 0) == KD_SOLVED;
+        board = dlx != NULL ? dlx->board : NULL;
+    } else {
+        search = kd_new_search(puzzle, opts);
+        solved = search != NULL && kd_search_run(search, 0) == KD_SOLVED;
+        board = search != NULL ? search->board : NULL;
+    }
+
+    if (solved) {
+        for (int i = 0; i < puzzle->n * puzzle->n; i++) {
+            cells[i] = board->grid[i];
+        }
+    }
+    if (nodes != NULL) {
+        *nodes = dlx != NULL ? dlx->nodes : search != NULL ? search->nodes : 0;
+    }
+    kd_free_dlx(dlx);
+    kd_free_search(search);
+    return solved;
+}
+
+/* Counts the solutions of puzzle up to opts->count, with the engine of
+ * opts. nodes, if not NULL, gets the nodes searched. */
+long kd_count(const kd_puzzle_t *puzzle, const kd_options_t *opts,
+              long *nodes) {
+    kd_search_t *search = NULL;
+    kd_dlx_t *dlx = NULL;
+    long count = 0;
+
+    if (opts->engine == KD_ENGINE_DLX) {
+        dlx = kd_new_dlx(puzzle);
+        /* Running again backtracks from the last solution */
+        while (dlx != NULL && count < opts->count &&
+                kd_dlx_run(dlx, 0) == KD_SOLVED) {
+            count++;
+        }
+    } else {
+        search = kd_new_search(puzzle, opts);
+        while (search != NULL && count < opts->count &&
+                kd_search_run(search, 0) == KD_SOLVED) {
+            count++;
+        }
+    }
+
+    if (nodes != NULL) {
+        *nodes = dlx != NULL ? dlx->nodes : search != NULL ? search->nodes : 0;
+    }
+    kd_free_dlx(dlx);
+    kd_free_search(search);
+    return count;
+}
+
+/* Prints the n * n cells as one line */
+void kd_print_line(int n, const int *cells) {
+    if (n <= LINE_MAX_N) {
+        char *line = (char *)malloc(n * n + 1);
+        if (line == NULL) {
+            return;
+        }
+        for (int i = 0; i < n * n; i++) {
+            line[i] = value_char(cells[i]);
+        }
+        line[n * n] = '\0';
+        puts(line);
+        free(line);
+        return;
+    }
+    for (int i = 0; i < n * n; i++) {
+        printf(i + 1 < n * n ? "%d " : "%d\n", cells[i]);
+    }
+}
+
+/* Throughput and nodes of a batch run, on stderr so that stdout only holds
+ * the solutions */
+void kd_print_batch(const kd_options_t *opts, long puzzles, long solved,
+                    long nodes, double seconds) {
+    fprintf(stderr, "Batch: %ld puzzles, %ld solved in %.3fs, %.1f puzzles/s, ",
+            puzzles, solved, seconds, seconds > 0 ? puzzles / seconds : 0.0);
+    if (opts->engine == KD_ENGINE_DLX) {
+        fprintf(stderr, "%ld nodes (dlx)\n", nodes);
+    } else {
+        fprintf(stderr, "%ld nodes (%s, propagation %s)\n", nodes,
+                kd_order_name(opts->order), opts->propagate ? "on" : "off");
+    }
+}
@@ -0,0 +1,96 @@
+// vim:tabstop=4 shiftwidth=4
+/* Candidate kernel benchmark
+ * ----------------
+ * Times every candidate kernel the CPU supports over the empty cells of a
+ * puzzle, as MRV would scan them, and prints cells per second.
+ *
+ * Usage: kuduro-bench [-c cells] filename
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kuduro.h"
+
+#define DEFAULT_CELLS 50000000L
+#define ROUNDS 5
+
+static const char *kernels[] = {"scalar", "avx2", "avx512"};
+
+int main(int argc, char *argv[]) {
+    kd_options_t opts;
+    kd_puzzle_t *puzzle;
+    kd_search_t *search;
+    long cells = DEFAULT_CELLS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        if (opt == 'c') {
+            cells = atol(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-c cells] filename\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-c cells] filename\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    puzzle = kd_read_file(argv[optind]);
+    if (puzzle == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (puzzle->n_empty == 0) {
+        fprintf(stderr, "No empty cells to scan\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The raw puzzle, so every empty cell is scanned */
+    kd_default_options(&opts);
+    opts.propagate = false;
+    search = kd_new_search(puzzle, &opts);
+    if (search == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%dx%d, %d empty cells, %d mask words\n", puzzle->n, puzzle->n,
+           puzzle->n_empty, KD_MASK_WORDS);
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        long reps = cells / search->n_free + 1, check = 0;
+        int count;
+        clock_t begin, end;
+        double secs;
+
+        if (!kd_simd_select(kernels[k])) {
+            printf("%-8s not supported\n", kernels[k]);
+            continue;
+        }
+
+        /* Best of a few rounds, the first ones warm the caches up */
+        secs = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            check = 0;
+            begin = clock();
+            for (long r = 0; r < reps; r++) {
+                /* A stop below 0 scans the whole list */
+                check += kd_min_candidates(search->board, search->cells,
+                                           search->free, search->n_free, -1,
+                                           &count);
+                check += count;
+            }
+            end = clock();
+            if (round == 0 || (double)(end - begin) / CLOCKS_PER_SEC < secs) {
+                secs = (double)(end - begin) / CLOCKS_PER_SEC;
+            }
+        }
+
+        printf("%-8s %8.1f Mcells/s  %f s  (check %ld)\n", kernels[k],
+               reps * search->n_free / secs / 1e6, secs, check / reps);
+    }
+
+    kd_free_search(search);
+    kd_free_puzzle(puzzle);
+    return 0;
+}
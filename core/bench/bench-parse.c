@@ -0,0 +1,176 @@
+// vim:tabstop=4 shiftwidth=4
+/* Parse benchmark
+ * ----------------
+ * Times the puzzle reader over a file, in either format of reader.c, and
+ * prints MB/s and puzzles/s next to the fscanf loop it replaced. A binary
+ * corpus is only timed through the reader.
+ *
+ * Usage: kuduro-parse-bench [-r rounds] filename
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kuduro.h"
+
+#define DEFAULT_ROUNDS 5
+#define TOKEN_MAX 1300
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Puzzles and cell sum of one pass of the reader, the file mapped anew */
+static long reader_pass(const char *filename, long *check) {
+    kd_reader_t *r = kd_open_reader(filename);
+    kd_puzzle_t *puzzle;
+    long puzzles = 0;
+    int got;
+
+    if (r == NULL) {
+        return -1;
+    }
+    while ((got = kd_reader_next(r, &puzzle)) != 0) {
+        if (got < 0) {
+            continue;
+        }
+        for (int i = 0; i < puzzle->n * puzzle->n; i++) {
+            *check += puzzle->known[i];
+        }
+        kd_free_puzzle(puzzle);
+        puzzles++;
+    }
+    kd_close_reader(r);
+    return puzzles;
+}
+
+static int token_value(char c) {
+    if (c >= '1' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'A' && c <= 'Z') {
+        return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 10;
+    }
+    return 0;
+}
+
+/* The same pass with one fscanf per cell, lines as one fscanf each */
+static long fscanf_pass(const char *filename, long *check) {
+    static char token[TOKEN_MAX + 1];
+    FILE *file = fopen(filename, "r");
+    kd_puzzle_t *puzzle;
+    long puzzles = 0;
+    int *known = NULL, box_size;
+
+    if (file == NULL) {
+        return -1;
+    }
+    while (fscanf(file, " %1300s", token) == 1) {
+        size_t len = strlen(token);
+        if (token[0] == '#') {
+            fscanf(file, "%*[^\n]");
+            continue;
+        }
+        if (len <= 3) {
+            box_size = atoi(token);
+            len = (size_t)box_size * box_size * box_size * box_size;
+            known = (int *)realloc(known, len * sizeof(int));
+            for (size_t i = 0; i < len; i++) {
+                if (fscanf(file, "%d", &known[i]) != 1) {
+                    len = 0;
+                }
+            }
+        } else {
+            box_size = 2;
+            while ((size_t)(box_size * box_size * box_size * box_size) < len) {
+                box_size++;
+            }
+            known = (int *)realloc(known, len * sizeof(int));
+            for (size_t i = 0; i < len; i++) {
+                known[i] = token_value(token[i]);
+            }
+        }
+        puzzle = len > 0 ? kd_new_puzzle(box_size, known) : NULL;
+        if (puzzle == NULL) {
+            continue;
+        }
+        for (int i = 0; i < puzzle->n * puzzle->n; i++) {
+            *check += puzzle->known[i];
+        }
+        kd_free_puzzle(puzzle);
+        puzzles++;
+    }
+    free(known);
+    fclose(file);
+    return puzzles;
+}
+
+static bool is_corpus_file(const char *filename) {
+    char magic[4];
+    FILE *file = fopen(filename, "r");
+    bool corpus = file != NULL && fread(magic, 4, 1, file) == 1 &&
+                  kd_is_corpus(magic, 4);
+
+    if (file != NULL) {
+        fclose(file);
+    }
+    return corpus;
+}
+
+/* Best of rounds passes */
+static void run(const char *name, long (*pass)(const char *, long *),
+                const char *filename, int rounds, double bytes) {
+    double best = 0;
+    long puzzles = 0, check = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        double begin = now(), secs;
+        check = 0;
+        puzzles = pass(filename, &check);
+        if (puzzles < 0) {
+            fprintf(stderr, "Could not read %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        secs = now() - begin;
+        if (round == 0 || secs < best) {
+            best = secs;
+        }
+    }
+    printf("%-8s %8.1f MB/s %12.0f puzzles/s  %f s  (check %ld)\n", name,
+           bytes / best / 1e6, puzzles / best, best, check);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = DEFAULT_ROUNDS, opt;
+    struct stat st;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r') {
+            rounds = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-r rounds] filename\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || rounds < 1) {
+        fprintf(stderr, "Usage: %s [-r rounds] filename\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (stat(argv[optind], &st) != 0) {
+        fprintf(stderr, "Could not open file\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%s, %ld bytes\n", argv[optind], (long)st.st_size);
+    run("reader", reader_pass, argv[optind], rounds, (double)st.st_size);
+    if (!is_corpus_file(argv[optind])) {
+        run("fscanf", fscanf_pass, argv[optind], rounds, (double)st.st_size);
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+// vim:tabstop=4 shiftwidth=4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+/* Masks first, then the grid, in one block padded to whole cache lines */
+static kd_board_t *alloc_board(int box_size) {
+    kd_board_t *board = (kd_board_t *)malloc(sizeof(kd_board_t));
+    size_t masks;
+    if (board == NULL) {
+        return NULL;
+    }
+
+    board->box_size = box_size;
+    board->n = box_size * box_size;
+    board->full = kd_full_mask(board->n);
+    masks = 3 * board->n * sizeof(kd_mask_t);
+    board->bytes = masks + board->n * board->n * sizeof(kd_value_t);
+    board->bytes = (board->bytes + KD_CACHE_LINE - 1) / KD_CACHE_LINE *
+                   KD_CACHE_LINE;
+    board->data = aligned_alloc(KD_CACHE_LINE, board->bytes);
+    if (board->data == NULL) {
+        free(board);
+        return NULL;
+    }
+    memset(board->data, 0, board->bytes);
+
+    board->rows = (kd_mask_t *)board->data;
+    board->cols = board->rows + board->n;
+    board->squares = board->cols + board->n;
+    board->grid = (kd_value_t *)((char *)board->data + masks);
+    return board;
+}
+
+/* New board holding the known values of the puzzle */
+kd_board_t *kd_new_board(const kd_puzzle_t *puzzle) {
+    kd_board_t *board = alloc_board(puzzle->box_size);
+    if (board == NULL) {
+        fprintf(stderr, "Unable to init board\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < board->n; i++) {
+        for (int j = 0; j < board->n; j++) {
+            if (puzzle->known[i * board->n + j] != KD_EMPTY) {
+                kd_set_cell(board, i, j, puzzle->known[i * board->n + j]);
+            }
+        }
+    }
+
+    return board;
+}
+
+kd_board_t *kd_copy_board(const kd_board_t *board) {
+    kd_board_t *copy = alloc_board(board->box_size);
+    if (copy == NULL) {
+        fprintf(stderr, "Unable to copy board\n");
+        return NULL;
+    }
+
+    kd_copy_into(copy, board);
+    return copy;
+}
+
+/* Both boards must have the same size */
+void kd_copy_into(kd_board_t *dst, const kd_board_t *src) {
+    memcpy(dst->data, src->data, src->bytes);
+}
+
+void kd_free_board(kd_board_t *board) {
+    if (board == NULL) {
+        return;
+    }
+    free(board->data);
+    free(board);
+}
+
+void kd_print_board(const kd_board_t *board) {
+    int width = board->n > 99 ? 3 : 2;
+    for (int i = 0; i < board->n; i++) {
+        for (int j = 0; j < board->n; j++) {
+            printf("%*d ", width, kd_get_cell(board, i, j));
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
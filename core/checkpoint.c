@@ -0,0 +1,212 @@
+// vim:tabstop=4 shiftwidth=4
+/* Checkpoints
+ * ----------------
+ * A checkpoint file holds the subtrees a parallel search still had to
+ * explore, each as the list of fixed moves leading to it, so a run that
+ * was killed can replay them with kd_search_play instead of starting over.
+ *
+ * The header names the puzzle, box size plus a hash of the givens, and a
+ * checkpoint is never resumed against another one. Each subtree is its
+ * move count followed by the moves, positions in 2 bytes (4 if the board
+ * has more than 65536 cells) and values in 1 byte (2 above 255), in host
+ * byte order: checkpoints are meant for the machine that wrote them.
+ *
+ * Writers fill path.tmp and rename it over path once it is complete, so a
+ * run killed in the middle of a checkpoint leaves the previous one intact.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+#define MAGIC "KDCK"
+#define VERSION 1
+
+typedef struct header {
+    char magic[4];
+    uint32_t version;
+    uint32_t box_size;
+    uint32_t pad;
+    uint64_t hash;
+    uint64_t count;
+} header;
+
+/* FNV-1a over the givens */
+static uint64_t puzzle_hash(const kd_puzzle_t *puzzle) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < puzzle->n * puzzle->n; i++) {
+        h = (h ^ (uint64_t)puzzle->known[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static kd_checkpoint_t *new_checkpoint(const char *path,
+                                       const kd_puzzle_t *puzzle) {
+    kd_checkpoint_t *c = (kd_checkpoint_t *)malloc(sizeof(kd_checkpoint_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->path = (char *)malloc(strlen(path) + 5);
+    if (c->path == NULL) {
+        free(c);
+        return NULL;
+    }
+    sprintf(c->path, "%s.tmp", path);
+    c->file = NULL;
+    c->count = 0;
+    c->pos_bytes = puzzle->n * puzzle->n > 65536 ? 4 : 2;
+    c->value_bytes = puzzle->n > 255 ? 2 : 1;
+    c->ok = true;
+    return c;
+}
+
+static void free_checkpoint(kd_checkpoint_t *c) {
+    free(c->path);
+    free(c);
+}
+
+/* Starts a new checkpoint of puzzle, it only replaces path on commit */
+kd_checkpoint_t *kd_checkpoint_create(const char *path,
+                                      const kd_puzzle_t *puzzle) {
+    kd_checkpoint_t *c = new_checkpoint(path, puzzle);
+    header h = {MAGIC, VERSION, (uint32_t)puzzle->box_size, 0,
+                puzzle_hash(puzzle), 0
+               };
+
+    if (c == NULL) {
+        fprintf(stderr, "Unable to init checkpoint\n");
+        return NULL;
+    }
+    c->file = fopen(c->path, "we");
+    if (c->file == NULL || fwrite(&h, sizeof(h), 1, c->file) != 1) {
+        fprintf(stderr, "Could not write checkpoint %s\n", c->path);
+        if (c->file != NULL) {
+            fclose(c->file);
+            remove(c->path);
+        }
+        free_checkpoint(c);
+        return NULL;
+    }
+    return c;
+}
+
+void kd_checkpoint_add(kd_checkpoint_t *c, const kd_move_t *moves, int len) {
+    uint32_t n_moves = (uint32_t)len;
+
+    c->ok = c->ok && fwrite(&n_moves, sizeof(n_moves), 1, c->file) == 1;
+    for (int i = 0; i < len && c->ok; i++) {
+        uint32_t pos = (uint32_t)moves[i].pos;
+        uint16_t pos16 = (uint16_t)moves[i].pos, value16 = (uint16_t)moves[i].value;
+        uint8_t value8 = (uint8_t)moves[i].value;
+
+        c->ok = (c->pos_bytes == 4 ? fwrite(&pos, 4, 1, c->file) :
+                 fwrite(&pos16, 2, 1, c->file)) == 1 &&
+                (c->value_bytes == 2 ? fwrite(&value16, 2, 1, c->file) :
+                 fwrite(&value8, 1, 1, c->file)) == 1;
+    }
+    c->count++;
+}
+
+/* Writes the subtree count and moves the checkpoint over its path, false
+ * (and the previous checkpoint left alone) if anything failed */
+bool kd_checkpoint_commit(kd_checkpoint_t *c) {
+    uint64_t count = (uint64_t)c->count;
+    bool ok = c->ok &&
+              fseek(c->file, offsetof(header, count), SEEK_SET) == 0 &&
+              fwrite(&count, sizeof(count), 1, c->file) == 1;
+
+    ok = fclose(c->file) == 0 && ok;
+    if (ok) {
+        char *path = strndup(c->path, strlen(c->path) - 4);
+        ok = path != NULL && rename(c->path, path) == 0;
+        free(path);
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not write checkpoint %s\n", c->path);
+        remove(c->path);
+    }
+    free_checkpoint(c);
+    return ok;
+}
+
+/* Opens a checkpoint of puzzle for reading, NULL if there is none or it
+ * belongs to another puzzle. count holds the number of subtrees. */
+kd_checkpoint_t *kd_checkpoint_open(const char *path,
+                                    const kd_puzzle_t *puzzle) {
+    kd_checkpoint_t *c = new_checkpoint(path, puzzle);
+    header h;
+
+    if (c == NULL) {
+        fprintf(stderr, "Unable to init checkpoint\n");
+        return NULL;
+    }
+    c->file = fopen(path, "re");
+    if (c->file == NULL) {
+        fprintf(stderr, "Could not open checkpoint %s\n", path);
+        free_checkpoint(c);
+        return NULL;
+    }
+    if (fread(&h, sizeof(h), 1, c->file) != 1 ||
+            memcmp(h.magic, MAGIC, 4) != 0 || h.version != VERSION) {
+        fprintf(stderr, "%s is not a checkpoint\n", path);
+        kd_checkpoint_close(c);
+        return NULL;
+    }
+    if (h.box_size != (uint32_t)puzzle->box_size ||
+            h.hash != puzzle_hash(puzzle)) {
+        fprintf(stderr, "Checkpoint %s is of another puzzle\n", path);
+        kd_checkpoint_close(c);
+        return NULL;
+    }
+    c->count = (long)h.count;
+    return c;
+}
+
+/* Next subtree into moves (puzzle->n_empty entries), returns its length or
+ * -1 at the end or on a damaged file */
+int kd_checkpoint_next(kd_checkpoint_t *c, const kd_puzzle_t *puzzle,
+                       kd_move_t *moves) {
+    uint32_t n_moves, pos;
+    uint16_t pos16, value16;
+    uint8_t value8;
+
+    if (fread(&n_moves, sizeof(n_moves), 1, c->file) != 1) {
+        return -1;
+    }
+    if (n_moves > (uint32_t)puzzle->n_empty) {
+        fprintf(stderr, "Damaged checkpoint\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < n_moves; i++) {
+        bool ok = c->pos_bytes == 4 ? fread(&pos, 4, 1, c->file) == 1 :
+                  fread(&pos16, 2, 1, c->file) == 1;
+        ok = ok && (c->value_bytes == 2 ? fread(&value16, 2, 1, c->file) == 1 :
+                    fread(&value8, 1, 1, c->file) == 1);
+        if (!ok) {
+            fprintf(stderr, "Damaged checkpoint\n");
+            return -1;
+        }
+        if (c->pos_bytes == 2) {
+            pos = pos16;
+        }
+        value16 = c->value_bytes == 2 ? value16 : value8;
+        if (pos >= (uint32_t)(puzzle->n * puzzle->n) || value16 == 0 ||
+                value16 > puzzle->n) {
+            fprintf(stderr, "Damaged checkpoint\n");
+            return -1;
+        }
+        moves[i].pos = (int)pos;
+        moves[i].value = value16;
+    }
+    return (int)n_moves;
+}
+
+void kd_checkpoint_close(kd_checkpoint_t *c) {
+    if (c == NULL) {
+        return;
+    }
+    fclose(c->file);
+    free_checkpoint(c);
+}
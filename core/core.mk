@@ -0,0 +1,52 @@
+# libkuduro, the solver core shared by the openmp and openmpi builds.
+# Included from their makefiles, paths are relative to those directories.
+KUDURO_DIR = ../core
+# Largest board side the masks hold, run kuduro-clean after changing it
+KD_MAX_N ?= 128
+KUDURO_LIB = $(KUDURO_DIR)/libkuduro.a
+KUDURO_SRC = $(wildcard $(KUDURO_DIR)/*.c)
+KUDURO_OBJ = $(KUDURO_SRC:.c=.o)
+KUDURO_HDR = $(wildcard $(KUDURO_DIR)/*.h)
+KUDURO_CFLAGS = -march=native -std=gnu11 -O2 -g -Wall -Wextra -Werror -Wpedantic -Wshadow -fno-strict-aliasing -DKD_MAX_N=$(KD_MAX_N)
+KUDURO = -I$(KUDURO_DIR) -DKD_MAX_N=$(KD_MAX_N) $(KUDURO_LIB)
+
+$(KUDURO_LIB): $(KUDURO_OBJ)
+	ar rcs $@ $^
+
+$(KUDURO_DIR)/%.o: $(KUDURO_DIR)/%.c $(KUDURO_HDR)
+	$(CC) $(KUDURO_CFLAGS) -c $< -o $@
+
+KUDURO_BENCH = $(KUDURO_DIR)/bench/kuduro-bench
+KUDURO_PARSE_BENCH = $(KUDURO_DIR)/bench/kuduro-parse-bench
+KUDURO_PACK = $(KUDURO_DIR)/tools/kuduro-pack
+KUDURO_GEN = $(KUDURO_DIR)/tools/kuduro-gen
+
+# Cells/second of every candidate kernel: $(KUDURO_BENCH) filename
+kuduro-bench: $(KUDURO_BENCH)
+
+$(KUDURO_BENCH): $(KUDURO_DIR)/bench/bench-candidates.c $(KUDURO_LIB)
+	$(CC) $< $(KUDURO_CFLAGS) $(KUDURO) -o $@
+
+# MB/s and puzzles/s of the puzzle reader: $(KUDURO_PARSE_BENCH) filename
+kuduro-parse-bench: $(KUDURO_PARSE_BENCH)
+
+$(KUDURO_PARSE_BENCH): $(KUDURO_DIR)/bench/bench-parse.c $(KUDURO_LIB)
+	$(CC) $< $(KUDURO_CFLAGS) $(KUDURO) -o $@
+
+# Text puzzles to a binary corpus: $(KUDURO_PACK) input output
+kuduro-pack: $(KUDURO_PACK)
+
+$(KUDURO_PACK): $(KUDURO_DIR)/tools/pack-corpus.c $(KUDURO_LIB)
+	$(CC) $< $(KUDURO_CFLAGS) $(KUDURO) -o $@
+
+# Unique puzzles, 4x4 to 25x25: $(KUDURO_GEN) [-n count] box_size output
+kuduro-gen: $(KUDURO_GEN)
+
+$(KUDURO_GEN): $(KUDURO_DIR)/tools/generate.c $(KUDURO_LIB)
+	$(CC) $< -fopenmp $(KUDURO_CFLAGS) $(KUDURO) -o $@
+
+kuduro-clean:
+	-@rm -f $(KUDURO_OBJ) $(KUDURO_LIB) $(KUDURO_BENCH) $(KUDURO_PARSE_BENCH) \
+		$(KUDURO_PACK) $(KUDURO_GEN)
+
+.PHONY: kuduro-bench kuduro-parse-bench kuduro-pack kuduro-gen kuduro-clean
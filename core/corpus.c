@@ -0,0 +1,254 @@
+// vim:tabstop=4 shiftwidth=4
+/* Binary corpus
+ * ----------------
+ * A corpus stores many puzzles of one box size without any text to parse.
+ * After the header each puzzle is one fixed-size record, its n * n cells
+ * packed in the fewest bits that hold 0 to n (4 for 9x9, 5 for 16x16 and
+ * 25x25, 7 for 81x81 and 100x100), least significant bit first, padded to
+ * a whole byte. Records being the same size, puzzle k is at
+ *
+ *     sizeof(header) + k * record
+ *
+ * so the index is implicit and any puzzle is one multiply away, which is
+ * what lets MPI ranks pick their own puzzles out of a shared file.
+ *
+ * The header is in host byte order, like checkpoints. Writers fill
+ * path.tmp and rename it over path once it is complete.
+ */
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kuduro.h"
+
+#define MAGIC "KDCP"
+#define VERSION 1
+#define MAX_BITS 16
+
+typedef struct header {
+    char magic[4];
+    uint32_t version;
+    uint32_t box_size;
+    uint32_t bits;
+    uint64_t count;
+} header;
+
+/* Fewest bits that hold 0 to n */
+static int cell_bits(int n) {
+    int bits = 1;
+    while ((1 << bits) <= n) {
+        bits++;
+    }
+    return bits;
+}
+
+static kd_corpus_t *new_corpus(int box_size) {
+    kd_corpus_t *c = (kd_corpus_t *)calloc(1, sizeof(kd_corpus_t));
+    int n = box_size * box_size;
+
+    if (c == NULL) {
+        return NULL;
+    }
+    c->box_size = box_size;
+    c->bits = cell_bits(n);
+    c->record = ((size_t)n * n * c->bits + 7) / 8;
+    c->known = (int *)malloc((size_t)n * n * sizeof(int));
+    c->ok = true;
+    if (c->known == NULL) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Starts a corpus of box_size puzzles, it only replaces path on commit */
+kd_corpus_t *kd_corpus_create(const char *path, int box_size) {
+    kd_corpus_t *c;
+    header h = {MAGIC, VERSION, (uint32_t)box_size, 0, 0};
+
+    if (box_size < 1 || cell_bits(box_size * box_size) > MAX_BITS) {
+        fprintf(stderr, "Unsupported box size %d\n", box_size);
+        return NULL;
+    }
+    c = new_corpus(box_size);
+    if (c == NULL || (c->path = (char *)malloc(strlen(path) + 5)) == NULL) {
+        fprintf(stderr, "Unable to init corpus\n");
+        kd_close_corpus(c);
+        return NULL;
+    }
+    sprintf(c->path, "%s.tmp", path);
+    h.bits = (uint32_t)c->bits;
+    c->file = fopen(c->path, "we");
+    if (c->file == NULL || fwrite(&h, sizeof(h), 1, c->file) != 1) {
+        fprintf(stderr, "Could not write corpus %s\n", c->path);
+        if (c->file != NULL) {
+            fclose(c->file);
+            c->file = NULL;
+            remove(c->path);
+        }
+        kd_close_corpus(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Appends puzzle, false if it is of another box size */
+bool kd_corpus_add(kd_corpus_t *c, const kd_puzzle_t *puzzle) {
+    unsigned char *out = (unsigned char *)c->known;
+    uint32_t acc = 0;
+    int have = 0;
+    size_t at = 0;
+
+    if (puzzle->box_size != c->box_size) {
+        return false;
+    }
+    /* Packs into the known buffer, a record is never larger than it */
+    for (int i = 0; i < puzzle->n * puzzle->n; i++) {
+        acc |= (uint32_t)puzzle->known[i] << have;
+        have += c->bits;
+        while (have >= 8) {
+            out[at++] = (unsigned char)acc;
+            acc >>= 8;
+            have -= 8;
+        }
+    }
+    if (have > 0) {
+        out[at++] = (unsigned char)acc;
+    }
+    c->ok = c->ok && fwrite(out, 1, c->record, c->file) == c->record;
+    c->count++;
+    return true;
+}
+
+/* Writes the puzzle count and moves the corpus over its path, false (and
+ * nothing left behind) if anything failed */
+bool kd_corpus_commit(kd_corpus_t *c) {
+    uint64_t count = (uint64_t)c->count;
+    bool ok = c->ok &&
+              fseek(c->file, offsetof(header, count), SEEK_SET) == 0 &&
+              fwrite(&count, sizeof(count), 1, c->file) == 1;
+
+    ok = fclose(c->file) == 0 && ok;
+    c->file = NULL;
+    if (ok) {
+        char *path = strndup(c->path, strlen(c->path) - 4);
+        ok = path != NULL && rename(c->path, path) == 0;
+        free(path);
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not write corpus %s\n", c->path);
+        remove(c->path);
+    }
+    kd_close_corpus(c);
+    return ok;
+}
+
+/* Whether text starts like a corpus */
+bool kd_is_corpus(const void *text, size_t len) {
+    return len >= 4 && memcmp(text, MAGIC, 4) == 0;
+}
+
+/* Corpus over the len bytes at text, which must outlive it */
+kd_corpus_t *kd_corpus_view(const void *text, size_t len) {
+    kd_corpus_t *c;
+    header h;
+
+    if (len < sizeof(h) || !kd_is_corpus(text, len)) {
+        fprintf(stderr, "Not a corpus\n");
+        return NULL;
+    }
+    memcpy(&h, text, sizeof(h));
+    if (h.version != VERSION || h.box_size < 1 || h.box_size > KD_MAX_N ||
+            h.box_size * h.box_size > KD_MAX_N) {
+        fprintf(stderr, "Unsupported corpus of box size %u, version %u\n",
+                h.box_size, h.version);
+        return NULL;
+    }
+    c = new_corpus((int)h.box_size);
+    if (c == NULL) {
+        fprintf(stderr, "Unable to init corpus\n");
+        return NULL;
+    }
+    if ((uint32_t)c->bits != h.bits ||
+            h.count > (len - sizeof(h)) / c->record) {
+        fprintf(stderr, "Damaged corpus\n");
+        kd_close_corpus(c);
+        return NULL;
+    }
+    c->records = (const unsigned char *)text + sizeof(h);
+    c->count = (long)h.count;
+    return c;
+}
+
+/* Maps the corpus at path */
+kd_corpus_t *kd_open_corpus(const char *path) {
+    kd_corpus_t *c;
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not open corpus %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+            MAP_FAILED) {
+        fprintf(stderr, "Could not read corpus %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    c = kd_corpus_view(map, st.st_size);
+    if (c == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    c->map = map;
+    c->map_len = st.st_size;
+    return c;
+}
+
+/* Puzzle k of the corpus. Decodes through the buffer of c, so one thread
+ * at a time per corpus. */
+kd_puzzle_t *kd_corpus_puzzle(kd_corpus_t *c, long k) {
+    const unsigned char *in;
+    uint32_t acc = 0, mask = (1u << c->bits) - 1;
+    int have = 0, n = c->box_size * c->box_size;
+
+    if (k < 0 || k >= c->count) {
+        return NULL;
+    }
+    in = c->records + (size_t)k * c->record;
+    for (int i = 0; i < n * n; i++) {
+        while (have < c->bits) {
+            acc |= (uint32_t)*in++ << have;
+            have += 8;
+        }
+        c->known[i] = (int)(acc & mask);
+        acc >>= c->bits;
+        have -= c->bits;
+    }
+    return kd_new_puzzle(c->box_size, c->known);
+}
+
+void kd_close_corpus(kd_corpus_t *c) {
+    if (c == NULL) {
+        return;
+    }
+    if (c->file != NULL) {
+        fclose(c->file);
+    }
+    if (c->map != NULL) {
+        munmap(c->map, c->map_len);
+    }
+    free(c->path);
+    free(c->known);
+    free(c);
+}
@@ -0,0 +1,122 @@
+// vim:tabstop=4 shiftwidth=4
+/* Work-stealing deque
+ * ----------------
+ * Chase-Lev deque over a fixed ring of pointers (C11 atomics version of Lê,
+ * Pop, Cohen and Zappa Nardelli). The owner pushes and pops at the bottom
+ * without contention; other threads steal from the top, and only a steal
+ * racing the owner for the last item costs a compare-and-swap.
+ *
+ * The ring does not grow: a push on a full deque fails and the owner keeps
+ * the work for itself.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kuduro.h"
+
+/* capacity is rounded up to a power of two */
+kd_deque_t *kd_new_deque(long capacity) {
+    kd_deque_t *d = (kd_deque_t *)aligned_alloc(KD_CACHE_LINE,
+                    sizeof(kd_deque_t));
+    long size = 1;
+
+    if (d == NULL) {
+        fprintf(stderr, "Unable to init deque\n");
+        return NULL;
+    }
+    while (size < capacity) {
+        size *= 2;
+    }
+    d->items = (_Atomic(void *) *)calloc(size, sizeof(*d->items));
+    if (d->items == NULL) {
+        fprintf(stderr, "Unable to init deque\n");
+        free(d);
+        return NULL;
+    }
+    d->mask = size - 1;
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    return d;
+}
+
+void kd_free_deque(kd_deque_t *d) {
+    if (d == NULL) {
+        return;
+    }
+    free(d->items);
+    free(d);
+}
+
+/* Owner only. False if the deque is full. */
+bool kd_deque_push(kd_deque_t *d, void *item) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+
+    if (b - t > d->mask) {
+        return false;
+    }
+    atomic_store_explicit(&d->items[b & d->mask], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+/* Owner only. Newest item, NULL if empty. */
+void *kd_deque_pop(kd_deque_t *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    long t;
+    void *item = NULL;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t <= b) {
+        item = atomic_load_explicit(&d->items[b & d->mask], memory_order_relaxed);
+        if (t == b) {
+            /* Last item, race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                item = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/* Any thread. Oldest item, NULL if empty or lost to another thread. */
+void *kd_deque_steal(kd_deque_t *d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    long b;
+    void *item;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    item = atomic_load_explicit(&d->items[t & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return item;
+}
+
+/* Items left, exact for the owner and a hint for everyone else */
+long kd_deque_size(kd_deque_t *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+/* Item i counted from the top, for snapshots taken while no thread pushes,
+ * pops or steals */
+void *kd_deque_peek(kd_deque_t *d, long i) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    return atomic_load_explicit(&d->items[(t + i) & d->mask],
+                                memory_order_relaxed);
+}
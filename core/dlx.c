@@ -0,0 +1,280 @@
+// vim:tabstop=4 shiftwidth=4
+/* Dancing links
+ * ----------------
+ * Algorithm X over the exact-cover form of the puzzle: one column per
+ * constraint (cell filled, value in row, value in column, value in square)
+ * and one row per (cell, value) placement, each row covering 4 columns.
+ *
+ * Only what the givens leave open is built: columns already satisfied by a
+ * given are dropped, and so are placements that clash with one, so a 9x9
+ * needs a few hundred rows instead of n^3. Nodes live in one array and link
+ * to each other by index. Each step branches on the column with fewest
+ * rows left, so a constraint nothing can satisfy ends the branch at once.
+ *
+ * The search is iterative and resumable like kd_search: after KD_SOLVED,
+ * running again looks for the next solution.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+#define ROOT 0
+
+/* Constraints of placing v in (i, j), as indices into 4 * n * n */
+static void constraints(int n, int box_size, int i, int j, int v, int *k) {
+    int box = (i / box_size) * box_size + j / box_size;
+    k[0] = i * n + j;
+    k[1] = n * n + i * n + v - 1;
+    k[2] = 2 * n * n + j * n + v - 1;
+    k[3] = 3 * n * n + box * n + v - 1;
+}
+
+/* Appends a column header at the left of the root */
+static void add_column(kd_dlx_t *d, int c) {
+    kd_dlx_node_t *h = &d->links[c];
+    h->left = d->links[ROOT].left;
+    h->right = ROOT;
+    d->links[h->left].right = c;
+    d->links[ROOT].left = c;
+    h->up = h->down = h->col = c;
+    h->row = -1;
+    d->size[c] = 0;
+}
+
+/* Appends node x of row r at the bottom of column c */
+static void add_node(kd_dlx_t *d, int x, int c, int r) {
+    kd_dlx_node_t *node = &d->links[x];
+    node->col = c;
+    node->row = r;
+    node->down = c;
+    node->up = d->links[c].up;
+    d->links[node->up].down = x;
+    d->links[c].up = x;
+    d->size[c]++;
+}
+
+kd_dlx_t *kd_new_dlx(const kd_puzzle_t *puzzle) {
+    kd_dlx_t *d = (kd_dlx_t *)calloc(1, sizeof(kd_dlx_t));
+    int n = puzzle->n, box_size = puzzle->box_size;
+    int n_cols = 0, n_rows = 0, r = 0, x, k[4];
+    int *column;
+
+    if (d == NULL) {
+        fprintf(stderr, "Unable to init dlx\n");
+        return NULL;
+    }
+    d->puzzle = puzzle;
+
+    /* Constraint k becomes header column[k], -1 once a given satisfies it */
+    column = (int *)calloc(4 * n * n, sizeof(int));
+    if (column == NULL) {
+        fprintf(stderr, "Unable to init dlx\n");
+        free(d);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            int v = puzzle->known[i * n + j];
+            if (v == KD_EMPTY) {
+                continue;
+            }
+            constraints(n, box_size, i, j, v, k);
+            for (int c = 0; c < 4; c++) {
+                /* Two givens on one constraint, no solution at all */
+                d->dead |= column[k[c]] < 0;
+                column[k[c]] = -1;
+            }
+        }
+    }
+    for (int c = 0; c < 4 * n * n; c++) {
+        if (column[c] == 0) {
+            column[c] = ++n_cols;
+        }
+    }
+    for (int e = 0; e < puzzle->n_empty; e++) {
+        for (int v = 1; v <= n; v++) {
+            constraints(n, box_size, puzzle->empty[e].row, puzzle->empty[e].col,
+                        v, k);
+            n_rows += column[k[1]] > 0 && column[k[2]] > 0 && column[k[3]] > 0;
+        }
+    }
+
+    d->board = kd_new_board(puzzle);
+    d->links = (kd_dlx_node_t *)malloc((1 + n_cols + 4 * n_rows) *
+                                       sizeof(kd_dlx_node_t));
+    d->size = (int *)malloc((1 + n_cols) * sizeof(int));
+    d->rows = (kd_move_t *)malloc((n_rows + 1) * sizeof(kd_move_t));
+    d->choice = (int *)malloc((puzzle->n_empty + 1) * sizeof(int));
+    if (d->board == NULL || d->links == NULL || d->size == NULL ||
+            d->rows == NULL || d->choice == NULL) {
+        fprintf(stderr, "Unable to init dlx\n");
+        free(column);
+        kd_free_dlx(d);
+        return NULL;
+    }
+
+    d->links[ROOT].left = d->links[ROOT].right = ROOT;
+    d->links[ROOT].row = -1;
+    for (int c = 1; c <= n_cols; c++) {
+        add_column(d, c);
+    }
+
+    /* Rows in row-major cell order, values ascending */
+    x = 1 + n_cols;
+    for (int e = 0; e < puzzle->n_empty; e++) {
+        int i = puzzle->empty[e].row, j = puzzle->empty[e].col;
+        for (int v = 1; v <= n; v++) {
+            constraints(n, box_size, i, j, v, k);
+            if (column[k[1]] <= 0 || column[k[2]] <= 0 || column[k[3]] <= 0) {
+                continue;
+            }
+            for (int c = 0; c < 4; c++) {
+                add_node(d, x + c, column[k[c]], r);
+                d->links[x + c].left = x + (c + 3) % 4;
+                d->links[x + c].right = x + (c + 1) % 4;
+            }
+            d->rows[r].pos = i * n + j;
+            d->rows[r].value = v;
+            x += 4;
+            r++;
+        }
+    }
+    free(column);
+
+    d->forward = !d->dead;
+    return d;
+}
+
+void kd_free_dlx(kd_dlx_t *d) {
+    if (d == NULL) {
+        return;
+    }
+    kd_free_board(d->board);
+    free(d->links);
+    free(d->size);
+    free(d->rows);
+    free(d->choice);
+    free(d);
+}
+
+static void cover(kd_dlx_t *d, int c) {
+    kd_dlx_node_t *l = d->links;
+    l[l[c].right].left = l[c].left;
+    l[l[c].left].right = l[c].right;
+    for (int i = l[c].down; i != c; i = l[i].down) {
+        for (int j = l[i].right; j != i; j = l[j].right) {
+            l[l[j].down].up = l[j].up;
+            l[l[j].up].down = l[j].down;
+            d->size[l[j].col]--;
+        }
+    }
+}
+
+static void uncover(kd_dlx_t *d, int c) {
+    kd_dlx_node_t *l = d->links;
+    for (int i = l[c].up; i != c; i = l[i].up) {
+        for (int j = l[i].left; j != i; j = l[j].left) {
+            d->size[l[j].col]++;
+            l[l[j].down].up = j;
+            l[l[j].up].down = j;
+        }
+    }
+    l[l[c].right].left = c;
+    l[l[c].left].right = c;
+}
+
+/* Column with fewest rows left, first found on ties */
+static int select_column(const kd_dlx_t *d) {
+    int best = d->links[ROOT].right, best_size = d->size[best];
+    for (int c = d->links[best].right; c != ROOT && best_size > 1;
+            c = d->links[c].right) {
+        if (d->size[c] < best_size) {
+            best = c;
+            best_size = d->size[c];
+        }
+    }
+    return best;
+}
+
+/* Writes the placements of the current path on the board, or takes them
+ * back off */
+static void show_solution(kd_dlx_t *d, bool show) {
+    int n = d->puzzle->n;
+    for (int level = 0; level < d->level; level++) {
+        kd_move_t *m = &d->rows[d->links[d->choice[level]].row];
+        if (show) {
+            kd_set_cell(d->board, m->pos / n, m->pos % n, m->value);
+        } else {
+            kd_clear_cell(d->board, m->pos / n, m->pos % n);
+        }
+    }
+    d->solved = show;
+}
+
+/* Runs until a solution, the end of the tree or about budget rows tried
+ * (<= 0 for no limit). The board holds the solution after KD_SOLVED. */
+int kd_dlx_run(kd_dlx_t *d, long budget) {
+    kd_dlx_node_t *l = d->links;
+    long stop = d->nodes + budget;
+    int c, r;
+
+    if (d->solved) {
+        show_solution(d, false);
+    }
+
+    while (1) {
+        if (d->forward) {
+            d->forward = false;
+            if (l[ROOT].right == ROOT) {
+                show_solution(d, true);
+                return KD_SOLVED;
+            }
+            c = select_column(d);
+            if (d->size[c] > 0) {
+                cover(d, c);
+                d->choice[d->level++] = c;
+            } else if (d->level == 0) {
+                return KD_EXHAUSTED;
+            } else {
+                /* Dead end, on to the next row of this level */
+                r = d->choice[d->level - 1];
+                for (int j = l[r].left; j != r; j = l[j].left) {
+                    uncover(d, l[j].col);
+                }
+            }
+        } else {
+            if (d->level == 0) {
+                return KD_EXHAUSTED;
+            }
+            r = d->choice[d->level - 1];
+            if (l[r].row >= 0) {
+                for (int j = l[r].left; j != r; j = l[j].left) {
+                    uncover(d, l[j].col);
+                }
+            }
+        }
+
+        /* Next row of the deepest level */
+        r = d->choice[d->level - 1];
+        c = l[r].col;
+        if (l[r].down == c) {
+            /* Backtrack */
+            uncover(d, c);
+            d->level--;
+            continue;
+        }
+
+        r = l[r].down;
+        d->choice[d->level - 1] = r;
+        for (int j = l[r].right; j != r; j = l[j].right) {
+            cover(d, l[j].col);
+        }
+        d->forward = true;
+
+        if (++d->nodes == stop) {
+            return KD_RUNNING;
+        }
+    }
+}
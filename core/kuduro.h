@@ -0,0 +1,499 @@
+// vim:tabstop=4 shiftwidth=4
+/* libkuduro
+ * ----------------
+ * Solver core shared by the serial, OpenMP and MPI front-ends.
+ *
+ * A board keeps, besides the grid, one bit mask per row, column and square
+ * with bit v set when value v is already placed there. Checking if a value
+ * fits in a cell is then three ANDs instead of scanning the row, column and
+ * square, and the set of candidates of a cell is a single OR.
+ *
+ * Grids are stored row-major in one array, cell (i, j) is at i * n + j,
+ * with cells of kd_value_t, one byte unless KD_MAX_N needs two. A board's
+ * masks and grid share a single cache-aligned block, so copying a board is
+ * one memcpy.
+ *
+ * Masks are fixed-width bitsets of KD_MASK_WORDS 64-bit words, with value v
+ * at bit v - 1. The width is picked at compile time from KD_MAX_N, the
+ * largest side supported (128 by default, so 81x81 and 100x100 fit in two
+ * words); the word loops have a constant count and unroll away.
+ */
+#ifndef KUDURO_H
+#define KUDURO_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define KD_EMPTY 0
+#define KD_CACHE_LINE 64
+
+#ifndef KD_MAX_N
+#define KD_MAX_N 128
+#endif
+#define KD_MASK_WORDS ((KD_MAX_N + 63) / 64)
+
+typedef struct kd_mask {
+    uint64_t w[KD_MASK_WORDS];
+} kd_mask_t;
+
+/* Value held by a cell */
+#if KD_MAX_N <= UINT8_MAX
+typedef uint8_t kd_value_t;
+#else
+typedef uint16_t kd_value_t;
+#endif
+
+/* Cell of the puzzle left empty in the input file */
+typedef struct kd_cell {
+    int row;
+    int col;
+    int box;
+} kd_cell_t;
+
+/* Puzzle as read from the input, read-only once built */
+typedef struct kd_puzzle {
+    int n;
+    int box_size;
+    int n_empty;
+    int *known;
+    kd_cell_t *empty;
+} kd_puzzle_t;
+
+/* Search state: grid plus the row/column/square masks, all pointing into
+ * data */
+typedef struct kd_board {
+    int n;
+    int box_size;
+    kd_value_t *grid;
+    kd_mask_t full; /* every value, 1 to n */
+    kd_mask_t *rows;
+    kd_mask_t *cols;
+    kd_mask_t *squares;
+    void *data;
+    size_t bytes;
+} kd_board_t;
+
+/* Value placed in a cell, pos is the row-major index i * n + j */
+typedef struct kd_move {
+    int pos;
+    int value;
+} kd_move_t;
+
+/* Cell the search branched on */
+typedef struct kd_frame {
+    int pos;
+    int value; /* last value tried, 0 before the first try */
+    int max;   /* values above max were given away */
+    int mark;  /* trail length before this cell was played */
+    int scan;  /* static order scan position before this frame */
+} kd_frame_t;
+
+/* Order in which the search picks the next empty cell */
+enum kd_order { KD_ORDER_STATIC = 0, KD_ORDER_MRV };
+
+/* Search engine: mask backtracking (kd_search) or dancing links (kd_dlx) */
+enum kd_engine { KD_ENGINE_MASK = 0, KD_ENGINE_DLX };
+
+/* Options every solver understands, parsed with getopt(KD_OPTS) */
+typedef struct kd_options {
+    int engine;
+    int order;
+    bool propagate;
+    bool batch; /* solve a stream of puzzles, see batch.c */
+    long count; /* count solutions up to it instead of solving, 0 to solve */
+    bool unique; /* -u: counts up to 2 to tell if the solution is unique */
+} kd_options_t;
+
+#define KD_OPTS "bc:e:o:p:u"
+#define KD_OPTS_USAGE "[-b] [-c K|all | -u] [-e mask|dlx] [-o static|mrv] " \
+                      "[-p on|off]"
+
+enum kd_status { KD_RUNNING = 0, KD_SOLVED, KD_EXHAUSTED, KD_CUTOFF };
+
+/* Iterative backtracking over a board, resumable after any status.
+ * Frames below root are fixed moves handed over with the work, the search
+ * never backtracks into them. */
+typedef struct kd_search {
+    const kd_puzzle_t *puzzle;
+    kd_board_t *board;
+    kd_board_t *given; /* board with only the puzzle givens */
+    kd_cell_t *cells; /* row, col and square of every position */
+    int *units; /* cells of every row, column and square */
+    int order;
+    bool propagate;
+    bool dead; /* the givens alone contradict each other */
+    int base; /* trail length after propagating the givens */
+    int *free; /* cells still empty, the first n_free */
+    int *where; /* index of each cell in free */
+    int n_free;
+    int *trail; /* cells filled on top of the givens, in order */
+    int trail_len;
+    kd_frame_t *stack;
+    int depth;
+    int root;
+    int max_depth; /* stop with KD_CUTOFF at this depth, 0 for no limit */
+    int scan;
+    bool forward;
+    long nodes;
+} kd_search_t;
+
+/* Node of the dancing links matrix, links are indices into the node array.
+ * Node 0 is the root, then come the column headers, then the rows. */
+typedef struct kd_dlx_node {
+    int left;
+    int right;
+    int up;
+    int down;
+    int col;
+    int row; /* -1 for the root and the headers */
+} kd_dlx_node_t;
+
+/* Exact-cover search over the constraints the givens leave open */
+typedef struct kd_dlx {
+    const kd_puzzle_t *puzzle;
+    kd_board_t *board; /* givens, plus the solution after KD_SOLVED */
+    kd_dlx_node_t *links;
+    int *size; /* rows left in each column */
+    kd_move_t *rows; /* cell and value each row places */
+    int *choice; /* node of the row picked at each level */
+    int level;
+    bool dead; /* the givens alone contradict each other */
+    bool forward;
+    bool solved;
+    long nodes;
+} kd_dlx_t;
+
+/* Chase-Lev work-stealing deque of opaque items. The owner thread pushes
+ * and pops at the bottom, any thread steals from the top. top and bottom
+ * sit on their own cache lines. */
+typedef struct kd_deque {
+    _Alignas(KD_CACHE_LINE) atomic_long top;
+    _Alignas(KD_CACHE_LINE) atomic_long bottom;
+    _Atomic(void *) *items;
+    long mask;
+} kd_deque_t;
+
+/* Binary corpus being written or read, see corpus.c */
+typedef struct kd_corpus {
+    const unsigned char *records; /* first record, when reading */
+    long count;     /* puzzles in the corpus, or added so far */
+    int box_size;
+    int bits;       /* per cell */
+    size_t record;  /* bytes per puzzle */
+    void *map;      /* mapped file, NULL for a view of a reader's text */
+    size_t map_len;
+    int *known;     /* cells of the last puzzle decoded */
+    FILE *file;     /* when writing */
+    char *path;     /* path.tmp while writing */
+    bool ok;        /* no write failed so far */
+} kd_corpus_t;
+
+/* Input being parsed for puzzles, see reader.c */
+typedef struct kd_reader {
+    const char *text;
+    size_t len;
+    size_t at;     /* next byte to parse */
+    void *map;     /* text when the file could be mapped */
+    char *buffer;  /* text when it was read instead */
+    int *known;    /* cells of the puzzle being parsed */
+    size_t known_size;
+    kd_corpus_t *corpus; /* when the input is a binary corpus */
+    long next;           /* its next puzzle */
+} kd_reader_t;
+
+/* Checkpoint file being written or read, see checkpoint.c */
+typedef struct kd_checkpoint {
+    FILE *file;
+    char *path; /* path.tmp while writing */
+    long count; /* subtrees written or in the file */
+    int pos_bytes;
+    int value_bytes;
+    bool ok; /* no write failed so far */
+} kd_checkpoint_t;
+
+/* Fixed-size object allocator. An arena is one size class; each thread
+ * allocates from its own pool of it and frees into whichever pool the
+ * object came from, through that pool's lock-free remote list if it is
+ * another thread's. */
+typedef struct kd_pool kd_pool_t;
+
+typedef struct kd_arena {
+    size_t size;
+    int per_slab;
+    _Atomic(kd_pool_t *) pools;
+} kd_arena_t;
+
+struct kd_pool {
+    _Alignas(KD_CACHE_LINE) _Atomic(void *) remote;
+    _Alignas(KD_CACHE_LINE) void *local;
+    void *slabs;
+    kd_arena_t *arena;
+    kd_pool_t *next;
+};
+
+/* puzzle.c */
+kd_puzzle_t *kd_new_puzzle(int box_size, const int *known);
+kd_puzzle_t *kd_read_file(const char *filename);
+void kd_free_puzzle(kd_puzzle_t *puzzle);
+
+/* batch.c */
+bool kd_solve(const kd_puzzle_t *puzzle, const kd_options_t *opts, int *cells,
+              long *nodes);
+long kd_count(const kd_puzzle_t *puzzle, const kd_options_t *opts,
+              long *nodes);
+void kd_print_line(int n, const int *cells);
+void kd_print_batch(const kd_options_t *opts, long puzzles, long solved,
+                    long nodes, double seconds);
+
+/* board.c */
+kd_board_t *kd_new_board(const kd_puzzle_t *puzzle);
+kd_board_t *kd_copy_board(const kd_board_t *board);
+void kd_copy_into(kd_board_t *dst, const kd_board_t *src);
+void kd_free_board(kd_board_t *board);
+void kd_print_board(const kd_board_t *board);
+
+/* checkpoint.c */
+kd_checkpoint_t *kd_checkpoint_create(const char *path,
+                                      const kd_puzzle_t *puzzle);
+void kd_checkpoint_add(kd_checkpoint_t *c, const kd_move_t *moves, int len);
+bool kd_checkpoint_commit(kd_checkpoint_t *c);
+kd_checkpoint_t *kd_checkpoint_open(const char *path,
+                                    const kd_puzzle_t *puzzle);
+int kd_checkpoint_next(kd_checkpoint_t *c, const kd_puzzle_t *puzzle,
+                       kd_move_t *moves);
+void kd_checkpoint_close(kd_checkpoint_t *c);
+
+/* corpus.c */
+kd_corpus_t *kd_corpus_create(const char *path, int box_size);
+bool kd_corpus_add(kd_corpus_t *c, const kd_puzzle_t *puzzle);
+bool kd_corpus_commit(kd_corpus_t *c);
+bool kd_is_corpus(const void *text, size_t len);
+kd_corpus_t *kd_corpus_view(const void *text, size_t len);
+kd_corpus_t *kd_open_corpus(const char *path);
+kd_puzzle_t *kd_corpus_puzzle(kd_corpus_t *c, long k);
+void kd_close_corpus(kd_corpus_t *c);
+
+/* deque.c */
+kd_deque_t *kd_new_deque(long capacity);
+void kd_free_deque(kd_deque_t *d);
+bool kd_deque_push(kd_deque_t *d, void *item);
+void *kd_deque_pop(kd_deque_t *d);
+void *kd_deque_steal(kd_deque_t *d);
+long kd_deque_size(kd_deque_t *d);
+void *kd_deque_peek(kd_deque_t *d, long i);
+
+/* pool.c */
+void kd_init_arena(kd_arena_t *arena, size_t size, int per_slab);
+void kd_free_arena(kd_arena_t *arena);
+kd_pool_t *kd_new_pool(kd_arena_t *arena);
+void *kd_pool_alloc(kd_pool_t *pool);
+void kd_pool_free(kd_pool_t *mine, void *obj);
+
+/* dlx.c */
+kd_dlx_t *kd_new_dlx(const kd_puzzle_t *puzzle);
+void kd_free_dlx(kd_dlx_t *d);
+int kd_dlx_run(kd_dlx_t *d, long budget);
+
+/* options.c */
+void kd_default_options(kd_options_t *opts);
+bool kd_parse_option(kd_options_t *opts, int opt, const char *arg);
+int kd_parse_engine(const char *name);
+const char *kd_engine_name(int engine);
+int kd_parse_order(const char *name);
+const char *kd_order_name(int order);
+void kd_print_nodes(const kd_options_t *opts, long nodes);
+void kd_print_count(const kd_options_t *opts, long count);
+
+/* simd.c */
+int kd_min_candidates(const kd_board_t *b, const kd_cell_t *cells,
+                      const int *pos, int count, int stop, int *min_count);
+bool kd_simd_select(const char *name);
+const char *kd_simd_name(void);
+
+/* reader.c */
+kd_reader_t *kd_open_reader(const char *filename);
+void kd_close_reader(kd_reader_t *r);
+int kd_reader_next(kd_reader_t *r, kd_puzzle_t **puzzle);
+
+/* search.c */
+kd_search_t *kd_new_search(const kd_puzzle_t *puzzle, const kd_options_t *opts);
+void kd_free_search(kd_search_t *s);
+void kd_search_reset(kd_search_t *s);
+bool kd_search_play(kd_search_t *s, int pos, int value);
+int kd_search_run(kd_search_t *s, long budget);
+int kd_search_moves(const kd_search_t *s, kd_move_t *moves);
+int kd_search_split(kd_search_t *s, int min_left, kd_move_t *moves);
+void kd_search_frontier(const kd_search_t *s, kd_move_t *moves,
+                        void (*open)(void *arg, const kd_move_t *moves, int len),
+                        void *arg);
+
+static inline kd_mask_t kd_mask_zero(void) {
+    kd_mask_t m = {{0}};
+    return m;
+}
+
+static inline kd_mask_t kd_bit(int v) {
+    kd_mask_t m = kd_mask_zero();
+    m.w[(v - 1) / 64] = (uint64_t)1 << ((v - 1) % 64);
+    return m;
+}
+
+/* Values lo to hi, empty if lo > hi */
+static inline kd_mask_t kd_range(int lo, int hi) {
+    kd_mask_t m;
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        /* Bits [a, b) of word k */
+        int a = lo - 1 - 64 * k, b = hi - 64 * k;
+        a = a < 0 ? 0 : a;
+        b = b > 64 ? 64 : b;
+        m.w[k] = a < b ? (~(uint64_t)0 >> (64 - (b - a))) << a : 0;
+    }
+    return m;
+}
+
+/* Every value allowed in a board of side n */
+static inline kd_mask_t kd_full_mask(int n) {
+    return kd_range(1, n);
+}
+
+static inline kd_mask_t kd_mask_or(kd_mask_t a, kd_mask_t b) {
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        a.w[k] |= b.w[k];
+    }
+    return a;
+}
+
+static inline kd_mask_t kd_mask_and(kd_mask_t a, kd_mask_t b) {
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        a.w[k] &= b.w[k];
+    }
+    return a;
+}
+
+/* a & ~b */
+static inline kd_mask_t kd_mask_andnot(kd_mask_t a, kd_mask_t b) {
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        a.w[k] &= ~b.w[k];
+    }
+    return a;
+}
+
+static inline bool kd_mask_empty(kd_mask_t m) {
+    uint64_t any = 0;
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        any |= m.w[k];
+    }
+    return any == 0;
+}
+
+/* Exactly one value set */
+static inline bool kd_mask_single(kd_mask_t m) {
+    int words = 0;
+    uint64_t many = 0;
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        words += m.w[k] != 0;
+        many |= m.w[k] & (m.w[k] - 1);
+    }
+    return words == 1 && many == 0;
+}
+
+static inline bool kd_mask_has(kd_mask_t m, int v) {
+    return (m.w[(v - 1) / 64] >> ((v - 1) % 64)) & 1;
+}
+
+static inline void kd_mask_add(kd_mask_t *m, int v) {
+    m->w[(v - 1) / 64] |= (uint64_t)1 << ((v - 1) % 64);
+}
+
+static inline void kd_mask_del(kd_mask_t *m, int v) {
+    m->w[(v - 1) / 64] &= ~((uint64_t)1 << ((v - 1) % 64));
+}
+
+static inline int kd_popcount(kd_mask_t m) {
+    int count = 0;
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        count += __builtin_popcountll(m.w[k]);
+    }
+    return count;
+}
+
+/* Smallest value in m, 0 if m is empty */
+static inline int kd_lowest(kd_mask_t m) {
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        if (m.w[k]) {
+            return 64 * k + __builtin_ctzll(m.w[k]) + 1;
+        }
+    }
+    return 0;
+}
+
+/* Largest value in m, 0 if m is empty */
+static inline int kd_highest(kd_mask_t m) {
+    for (int k = KD_MASK_WORDS - 1; k >= 0; k--) {
+        if (m.w[k]) {
+            return 64 * k + 64 - __builtin_clzll(m.w[k]);
+        }
+    }
+    return 0;
+}
+
+static inline int kd_square(const kd_board_t *b, int i, int j) {
+    return (i / b->box_size) * b->box_size + j / b->box_size;
+}
+
+static inline int kd_get_cell(const kd_board_t *b, int i, int j) {
+    return b->grid[i * b->n + j];
+}
+
+static inline void kd_set_cell(kd_board_t *b, int i, int j, int v) {
+    b->grid[i * b->n + j] = v;
+    kd_mask_add(&b->rows[i], v);
+    kd_mask_add(&b->cols[j], v);
+    kd_mask_add(&b->squares[kd_square(b, i, j)], v);
+}
+
+static inline int kd_clear_cell(kd_board_t *b, int i, int j) {
+    int v = b->grid[i * b->n + j];
+    b->grid[i * b->n + j] = KD_EMPTY;
+    kd_mask_del(&b->rows[i], v);
+    kd_mask_del(&b->cols[j], v);
+    kd_mask_del(&b->squares[kd_square(b, i, j)], v);
+    return v;
+}
+
+/* Values that can still be placed in (i, j) */
+static inline kd_mask_t kd_candidates(const kd_board_t *b, int i, int j) {
+    kd_mask_t m;
+    const kd_mask_t *r = &b->rows[i], *c = &b->cols[j],
+                     *s = &b->squares[kd_square(b, i, j)];
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        m.w[k] = b->full.w[k] & ~(r->w[k] | c->w[k] | s->w[k]);
+    }
+    return m;
+}
+
+static inline kd_mask_t kd_cell_candidates(const kd_board_t *b,
+        const kd_cell_t *c) {
+    kd_mask_t m;
+    const kd_mask_t *r = &b->rows[c->row], *l = &b->cols[c->col],
+                     *s = &b->squares[c->box];
+    for (int k = 0; k < KD_MASK_WORDS; k++) {
+        m.w[k] = b->full.w[k] & ~(r->w[k] | l->w[k] | s->w[k]);
+    }
+    return m;
+}
+
+static inline bool kd_is_available(const kd_board_t *b, int i, int j, int v) {
+    return !kd_mask_has(b->rows[i], v) && !kd_mask_has(b->cols[j], v) &&
+           !kd_mask_has(b->squares[kd_square(b, i, j)], v);
+}
+
+/* Smallest value greater than v that fits in (i, j), 0 if there is none */
+static inline int kd_next_candidate(const kd_board_t *b, int i, int j, int v) {
+    return kd_lowest(kd_mask_andnot(kd_candidates(b, i, j), kd_range(1, v)));
+}
+
+#endif
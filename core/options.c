@@ -0,0 +1,92 @@
+// vim:tabstop=4 shiftwidth=4
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+void kd_default_options(kd_options_t *opts) {
+    opts->engine = KD_ENGINE_MASK;
+    opts->order = KD_ORDER_STATIC;
+    opts->propagate = true;
+    opts->batch = false;
+    opts->count = 0;
+    opts->unique = false;
+}
+
+/* Handles one of the KD_OPTS options, false if its argument is invalid */
+bool kd_parse_option(kd_options_t *opts, int opt, const char *arg) {
+    switch (opt) {
+    case 'b':
+        opts->batch = true;
+        return true;
+    case 'c':
+        opts->count = strcmp(arg, "all") == 0 ? LONG_MAX : atol(arg);
+        opts->unique = false;
+        return opts->count > 0;
+    case 'e':
+        opts->engine = kd_parse_engine(arg);
+        return opts->engine >= 0;
+    case 'o':
+        opts->order = kd_parse_order(arg);
+        return opts->order >= 0;
+    case 'p':
+        opts->propagate = strcmp(arg, "on") == 0;
+        return opts->propagate || strcmp(arg, "off") == 0;
+    case 'u':
+        opts->count = 2;
+        opts->unique = true;
+        return true;
+    default:
+        return false;
+    }
+}
+
+int kd_parse_engine(const char *name) {
+    if (strcmp(name, "mask") == 0) {
+        return KD_ENGINE_MASK;
+    } else if (strcmp(name, "dlx") == 0) {
+        return KD_ENGINE_DLX;
+    }
+    return -1;
+}
+
+const char *kd_engine_name(int engine) {
+    return engine == KD_ENGINE_DLX ? "dlx" : "mask";
+}
+
+int kd_parse_order(const char *name) {
+    if (strcmp(name, "static") == 0) {
+        return KD_ORDER_STATIC;
+    } else if (strcmp(name, "mrv") == 0) {
+        return KD_ORDER_MRV;
+    }
+    return -1;
+}
+
+const char *kd_order_name(int order) {
+    return order == KD_ORDER_MRV ? "mrv" : "static";
+}
+
+void kd_print_nodes(const kd_options_t *opts, long nodes) {
+    if (opts->engine == KD_ENGINE_DLX) {
+        /* Always picks the column with fewest rows, never propagates */
+        printf("Nodes: %ld (dlx)\n", nodes);
+        return;
+    }
+    printf("Nodes: %ld (%s, propagation %s)\n", nodes,
+           kd_order_name(opts->order), opts->propagate ? "on" : "off");
+}
+
+/* Verdict of a count, which stops at opts->count */
+void kd_print_count(const kd_options_t *opts, long count) {
+    if (opts->unique) {
+        puts(count == 0 ? "No solution" : count == 1 ? "Unique solution" :
+             "Multiple solutions");
+    } else if (count >= opts->count) {
+        printf("At least %ld solutions\n", opts->count);
+    } else {
+        printf("%ld solution%s\n", count, count == 1 ? "" : "s");
+    }
+}
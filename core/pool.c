@@ -0,0 +1,149 @@
+// vim:tabstop=4 shiftwidth=4
+/* Slab pools
+ * ----------------
+ * Fixed-size object allocator for the objects solvers create and drop by
+ * the thousand (task descriptors, play stacks, boards, queue nodes).
+ *
+ * An arena is one size class. Every thread that allocates from it gets its
+ * own pool: objects are carved out of malloc'd slabs and recycled through a
+ * plain freelist only that thread touches. Each object remembers its pool,
+ * so a thread freeing an object it does not own (a stolen task, a queue
+ * node made elsewhere) pushes it on the owner's remote list instead, a
+ * lock-free stack the owner takes whole with one exchange when its own
+ * freelist runs dry. Only pushes race, so there is no ABA problem.
+ *
+ * Memory goes back to the system when the arena is freed.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kuduro.h"
+
+/* Sits right before every object */
+typedef union block_header {
+    kd_pool_t *pool;
+    max_align_t align;
+} block_header;
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+
+typedef struct slab {
+    struct slab *next;
+    max_align_t align[];
+} slab;
+
+static size_t stride(const kd_arena_t *arena) {
+    size_t align = sizeof(block_header);
+    return sizeof(block_header) + (arena->size + align - 1) / align * align;
+}
+
+void kd_init_arena(kd_arena_t *arena, size_t size, int per_slab) {
+    /* Free objects hold the freelist link */
+    arena->size = size < sizeof(free_block) ? sizeof(free_block) : size;
+    arena->per_slab = per_slab > 0 ? per_slab : 1;
+    atomic_init(&arena->pools, NULL);
+}
+
+/* Frees every pool of the arena, objects still out included */
+void kd_free_arena(kd_arena_t *arena) {
+    kd_pool_t *pool = atomic_exchange(&arena->pools, NULL);
+
+    while (pool != NULL) {
+        kd_pool_t *next = pool->next;
+        slab *s = (slab *)pool->slabs;
+        while (s != NULL) {
+            slab *next_slab = s->next;
+            free(s);
+            s = next_slab;
+        }
+        free(pool);
+        pool = next;
+    }
+}
+
+/* Pool of the calling thread, use it from that thread only */
+kd_pool_t *kd_new_pool(kd_arena_t *arena) {
+    kd_pool_t *pool = (kd_pool_t *)aligned_alloc(KD_CACHE_LINE,
+                      sizeof(kd_pool_t));
+    if (pool == NULL) {
+        fprintf(stderr, "Unable to init pool\n");
+        return NULL;
+    }
+
+    atomic_init(&pool->remote, NULL);
+    pool->local = NULL;
+    pool->slabs = NULL;
+    pool->arena = arena;
+
+    pool->next = atomic_load(&arena->pools);
+    while (!atomic_compare_exchange_weak(&arena->pools, &pool->next, pool)) {
+        /* Another thread registered first, retry on the new head */
+    }
+    return pool;
+}
+
+static bool grow(kd_pool_t *pool) {
+    size_t step = stride(pool->arena);
+    int count = pool->arena->per_slab;
+    slab *s = (slab *)malloc(sizeof(slab) + count * step);
+    char *at;
+
+    if (s == NULL) {
+        return false;
+    }
+    s->next = pool->slabs;
+    pool->slabs = s;
+
+    /* Thread the objects onto the freelist, first one on top */
+    at = (char *)s->align + (count - 1) * step;
+    for (int i = 0; i < count; i++, at -= step) {
+        free_block *b = (free_block *)(at + sizeof(block_header));
+        ((block_header *)at)->pool = pool;
+        b->next = pool->local;
+        pool->local = b;
+    }
+    return true;
+}
+
+void *kd_pool_alloc(kd_pool_t *pool) {
+    free_block *b = (free_block *)pool->local;
+
+    if (b == NULL) {
+        /* Take back whatever other threads freed */
+        b = atomic_exchange_explicit(&pool->remote, NULL, memory_order_acquire);
+        if (b == NULL) {
+            if (!grow(pool)) {
+                return NULL;
+            }
+            b = (free_block *)pool->local;
+        }
+    }
+    pool->local = b->next;
+    return b;
+}
+
+/* mine is the calling thread's pool for this arena, NULL if it has none */
+void kd_pool_free(kd_pool_t *mine, void *obj) {
+    kd_pool_t *owner;
+    free_block *b = (free_block *)obj;
+    void *head;
+
+    if (obj == NULL) {
+        return;
+    }
+    owner = ((block_header *)obj - 1)->pool;
+    if (owner == mine) {
+        b->next = owner->local;
+        owner->local = b;
+        return;
+    }
+
+    head = atomic_load_explicit(&owner->remote, memory_order_relaxed);
+    do {
+        b->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remote, &head, b,
+             memory_order_release, memory_order_relaxed));
+}
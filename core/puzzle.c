@@ -0,0 +1,82 @@
+// vim:tabstop=4 shiftwidth=4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+/* Builds a puzzle from the n * n known values (0 for empty cells) */
+kd_puzzle_t *kd_new_puzzle(int box_size, const int *known) {
+    kd_puzzle_t *puzzle;
+    int n = box_size * box_size, iter = 0;
+
+    /* Masks hold values 1 to KD_MAX_N */
+    if (box_size < 1 || n > KD_MAX_N) {
+        fprintf(stderr, "Unsupported box size %d, build with KD_MAX_N >= %d\n",
+                box_size, n);
+        return NULL;
+    }
+
+    puzzle = (kd_puzzle_t *)malloc(sizeof(kd_puzzle_t));
+    if (puzzle == NULL) {
+        fprintf(stderr, "Unable to init puzzle\n");
+        return NULL;
+    }
+
+    puzzle->box_size = box_size;
+    puzzle->n = n;
+    puzzle->n_empty = 0;
+    puzzle->known = (int *)malloc(n * n * sizeof(int));
+    puzzle->empty = (kd_cell_t *)malloc(n * n * sizeof(kd_cell_t));
+    if (puzzle->known == NULL || puzzle->empty == NULL) {
+        fprintf(stderr, "Unable to init puzzle\n");
+        kd_free_puzzle(puzzle);
+        return NULL;
+    }
+    memcpy(puzzle->known, known, n * n * sizeof(int));
+
+    /* Aux array of empty squares, in row-major order */
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (known[i * n + j] < 0 || known[i * n + j] > n) {
+                fprintf(stderr, "Invalid value %d at (%d, %d)\n",
+                        known[i * n + j], i, j);
+                kd_free_puzzle(puzzle);
+                return NULL;
+            }
+            if (known[i * n + j] == KD_EMPTY) {
+                puzzle->empty[iter].row = i;
+                puzzle->empty[iter].col = j;
+                puzzle->empty[iter].box = (i / box_size) * box_size + j / box_size;
+                iter++;
+            }
+        }
+    }
+    puzzle->n_empty = iter;
+
+    return puzzle;
+}
+
+/* First puzzle of the file, in either format of reader.c */
+kd_puzzle_t *kd_read_file(const char *filename) {
+    kd_reader_t *r = kd_open_reader(filename);
+    kd_puzzle_t *puzzle = NULL;
+
+    if (r == NULL) {
+        return NULL;
+    }
+    if (kd_reader_next(r, &puzzle) == 0) {
+        fprintf(stderr, "Could not read file\n");
+    }
+    kd_close_reader(r);
+    return puzzle;
+}
+
+void kd_free_puzzle(kd_puzzle_t *puzzle) {
+    if (puzzle == NULL) {
+        return;
+    }
+    free(puzzle->known);
+    free(puzzle->empty);
+    free(puzzle);
+}
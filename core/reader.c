@@ -0,0 +1,320 @@
+// vim:tabstop=4 shiftwidth=4
+/* Puzzle reader
+ * ----------------
+ * Puzzles are parsed straight out of memory with a hand-written scanner,
+ * instead of one fscanf call per cell: files are mapped with mmap, streams
+ * that cannot be mapped (stdin, pipes) are read whole in large blocks.
+ *
+ * Two formats are understood, and may be mixed in one input:
+ *
+ *   - the testfiles format, the box size and then the n * n cells as
+ *     numbers separated by any whitespace;
+ *   - one puzzle per line, n * n characters with '.' or '0' for an empty
+ *     cell, 1 to 9 and then A to Z (or a to z) for values 10 to 35, the
+ *     usual 81-character line for 9x9.
+ *
+ * A number of at most 3 digits starts the testfiles format, anything longer
+ * is a line. Blank lines and lines starting with '#' are skipped.
+ *
+ * An input that starts like a binary corpus (corpus.c) is read as one
+ * instead, puzzle after puzzle, so every batch mode takes either.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kuduro.h"
+
+#define READ_BLOCK (1 << 20)
+#define LINE_MAX_N 35
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+           c == '\f';
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int char_value(char c) {
+    if (c == '.' || c == '0') {
+        return KD_EMPTY;
+    } else if (c >= '1' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'A' && c <= 'Z') {
+        return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Whole contents of fd in one buffer, for inputs that cannot be mapped */
+static char *read_all(int fd, size_t *len) {
+    size_t size = READ_BLOCK;
+    char *text = (char *)malloc(size), *grown;
+    ssize_t got;
+
+    *len = 0;
+    while (text != NULL &&
+            (got = read(fd, text + *len, size - *len)) != 0) {
+        if (got < 0) {
+            free(text);
+            return NULL;
+        }
+        *len += (size_t)got;
+        if (*len == size) {
+            size *= 2;
+            grown = (char *)realloc(text, size);
+            if (grown == NULL) {
+                free(text);
+            }
+            text = grown;
+        }
+    }
+    return text;
+}
+
+/* Opens filename for reading puzzles, stdin if it is NULL or "-" */
+kd_reader_t *kd_open_reader(const char *filename) {
+    kd_reader_t *r = (kd_reader_t *)calloc(1, sizeof(kd_reader_t));
+    bool std = filename == NULL || strcmp(filename, "-") == 0;
+    struct stat st;
+    int fd;
+
+    if (r == NULL) {
+        fprintf(stderr, "Unable to init reader\n");
+        return NULL;
+    }
+    fd = std ? STDIN_FILENO : open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file\n");
+        free(r);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r->map != MAP_FAILED) {
+            madvise(r->map, st.st_size, MADV_SEQUENTIAL);
+            r->text = (const char *)r->map;
+            r->len = st.st_size;
+        } else {
+            r->map = NULL;
+        }
+    }
+    if (r->text == NULL) {
+        r->buffer = read_all(fd, &r->len);
+        r->text = r->buffer;
+    }
+    if (!std) {
+        close(fd);
+    }
+    if (r->text == NULL) {
+        fprintf(stderr, "Could not read file\n");
+        free(r);
+        return NULL;
+    }
+    if (kd_is_corpus(r->text, r->len)) {
+        r->corpus = kd_corpus_view(r->text, r->len);
+        if (r->corpus == NULL) {
+            kd_close_reader(r);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+void kd_close_reader(kd_reader_t *r) {
+    if (r == NULL) {
+        return;
+    }
+    kd_close_corpus(r->corpus);
+    if (r->map != NULL) {
+        munmap(r->map, r->len);
+    }
+    free(r->buffer);
+    free(r->known);
+    free(r);
+}
+
+/* Cells of a puzzle with box_size, in the reusable buffer of r */
+static int *known_cells(kd_reader_t *r, int box_size) {
+    size_t cells = (size_t)box_size * box_size * box_size * box_size;
+    int *grown;
+
+    if (cells > r->known_size) {
+        grown = (int *)realloc(r->known, cells * sizeof(int));
+        if (grown == NULL) {
+            return NULL;
+        }
+        r->known = grown;
+        r->known_size = cells;
+    }
+    return r->known;
+}
+
+/* Skips whitespace and comment lines */
+static void skip_blank(kd_reader_t *r) {
+    while (r->at < r->len) {
+        if (is_space(r->text[r->at])) {
+            r->at++;
+        } else if (r->text[r->at] == '#') {
+            while (r->at < r->len && r->text[r->at] != '\n') {
+                r->at++;
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+/* Next number after whitespace, -1 if there is none */
+static int scan_number(kd_reader_t *r) {
+    const char *text = r->text;
+    size_t at = r->at, len = r->len;
+    int value = 0;
+
+    while (at < len && is_space(text[at])) {
+        at++;
+    }
+    if (at == len || !is_digit(text[at])) {
+        r->at = at;
+        return -1;
+    }
+    while (at < len && is_digit(text[at]) && value < 1000000) {
+        value = value * 10 + (text[at++] - '0');
+    }
+    r->at = at;
+    return value;
+}
+
+/* Skips the rest of a puzzle that could not be read, up to the next line
+ * with a single token: a box size or a line-format puzzle. Rows of cells
+ * hold at least 4 numbers, so the next puzzle is answered on its own. */
+static void skip_puzzle(kd_reader_t *r) {
+    const char *text = r->text;
+    size_t at = r->at, len = r->len, line;
+    int tokens;
+
+    while (1) {
+        while (at < len && text[at] != '\n') {
+            at++;
+        }
+        if (at == len) {
+            break;
+        }
+        line = ++at;
+        tokens = 0;
+        while (at < len && text[at] != '\n' && text[at] != '#') {
+            if (!is_space(text[at]) && (at == line || is_space(text[at - 1]))) {
+                tokens++;
+            }
+            at++;
+        }
+        if (tokens <= 1) {
+            at = line;
+            break;
+        }
+    }
+    r->at = at;
+}
+
+static kd_puzzle_t *parse_cells(kd_reader_t *r, int box_size) {
+    int n = box_size * box_size, *known;
+
+    if (n > KD_MAX_N) {
+        fprintf(stderr, "Unsupported box size %d, build with KD_MAX_N >= %d\n",
+                box_size, n);
+        return NULL;
+    }
+    known = known_cells(r, box_size);
+    if (known == NULL) {
+        fprintf(stderr, "Unable to init puzzle\n");
+        return NULL;
+    }
+    for (int i = 0; i < n * n; i++) {
+        known[i] = scan_number(r);
+        if (known[i] < 0) {
+            fprintf(stderr, "Could not read file\n");
+            return NULL;
+        }
+    }
+    return kd_new_puzzle(box_size, known);
+}
+
+static kd_puzzle_t *parse_line(kd_reader_t *r, size_t start, size_t len) {
+    int box_size = 0, *known;
+
+    for (int b = 2; b * b <= LINE_MAX_N; b++) {
+        if ((size_t)(b * b * b * b) == len) {
+            box_size = b;
+        }
+    }
+    if (box_size == 0) {
+        fprintf(stderr, "Line of %zu cells is not a puzzle\n", len);
+        return NULL;
+    }
+    known = known_cells(r, box_size);
+    if (known == NULL) {
+        fprintf(stderr, "Unable to init puzzle\n");
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        known[i] = char_value(r->text[start + i]);
+        if (known[i] < 0) {
+            fprintf(stderr, "Invalid cell '%c'\n", r->text[start + i]);
+            return NULL;
+        }
+    }
+    return kd_new_puzzle(box_size, known);
+}
+
+/* Reads the next puzzle. Returns 1 with it in *puzzle, 0 at the end of the
+ * input, -1 if the entry was not a valid puzzle (reading can go on). */
+int kd_reader_next(kd_reader_t *r, kd_puzzle_t **puzzle) {
+    size_t start, end;
+
+    *puzzle = NULL;
+    if (r->corpus != NULL) {
+        if (r->next == r->corpus->count) {
+            return 0;
+        }
+        *puzzle = kd_corpus_puzzle(r->corpus, r->next++);
+        return *puzzle != NULL ? 1 : -1;
+    }
+    skip_blank(r);
+    if (r->at == r->len) {
+        return 0;
+    }
+
+    start = end = r->at;
+    while (end < r->len && !is_space(r->text[end])) {
+        end++;
+    }
+    r->at = end;
+    if (end - start <= 3) {
+        /* Box size of the testfiles format */
+        int box_size = 0;
+        for (size_t i = start; i < end; i++) {
+            if (!is_digit(r->text[i])) {
+                fprintf(stderr, "Invalid box size\n");
+                skip_puzzle(r);
+                return -1;
+            }
+            box_size = box_size * 10 + (r->text[i] - '0');
+        }
+        *puzzle = box_size > 0 ? parse_cells(r, box_size) : NULL;
+        if (*puzzle == NULL) {
+            skip_puzzle(r);
+        }
+    } else {
+        *puzzle = parse_line(r, start, end - start);
+    }
+    return *puzzle != NULL ? 1 : -1;
+}
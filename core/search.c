@@ -0,0 +1,408 @@
+// vim:tabstop=4 shiftwidth=4
+/* Search
+ * ----------------
+ * Iterative backtracking shared by every solver. Each frame of the stack is
+ * a cell the search branched on; all cells filled on top of the givens are
+ * kept in the trail, so going back to a frame is undoing the trail down to
+ * the mark it recorded.
+ *
+ * Cells are picked either in row-major order (static) or by minimum
+ * remaining values (MRV): the empty cell with fewest candidates, found by
+ * popcounting ~(rows | cols | squares) over the cells still empty (see
+ * simd.c). Those are kept in the free array, swapped out when filled and
+ * back in when undone, so MRV only ever looks at the cells left.
+ *
+ * With propagation on, every fill is followed by placing naked singles
+ * (cells with one candidate left) and hidden singles (values with one cell
+ * left in a row, column or square) until nothing changes. Forced cells go
+ * to the trail like any other, so backtracking undoes them for free.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+static bool propagate(kd_search_t *s);
+
+kd_search_t *kd_new_search(const kd_puzzle_t *puzzle,
+                           const kd_options_t *opts) {
+    kd_search_t *s = (kd_search_t *)calloc(1, sizeof(kd_search_t));
+    int n = puzzle->n;
+    if (s == NULL) {
+        fprintf(stderr, "Unable to init search\n");
+        return NULL;
+    }
+
+    s->puzzle = puzzle;
+    s->order = opts->order;
+    s->propagate = opts->propagate;
+    s->board = kd_new_board(puzzle);
+    s->given = kd_new_board(puzzle);
+    s->cells = (kd_cell_t *)malloc(n * n * sizeof(kd_cell_t));
+    s->units = (int *)malloc(3 * n * n * sizeof(int));
+    s->free = (int *)malloc((puzzle->n_empty + 1) * sizeof(int));
+    s->where = (int *)malloc(n * n * sizeof(int));
+    s->trail = (int *)malloc((puzzle->n_empty + 1) * sizeof(int));
+    s->stack = (kd_frame_t *)malloc((puzzle->n_empty + 1) * sizeof(kd_frame_t));
+    if (s->board == NULL || s->given == NULL || s->cells == NULL ||
+            s->units == NULL || s->free == NULL || s->where == NULL || s->trail == NULL ||
+            s->stack == NULL) {
+        fprintf(stderr, "Unable to init search\n");
+        kd_free_search(s);
+        return NULL;
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            s->cells[i * n + j].row = i;
+            s->cells[i * n + j].col = j;
+            s->cells[i * n + j].box = kd_square(s->board, i, j);
+        }
+    }
+
+    /* Unit u holds rows for u < n, then columns, then squares */
+    for (int u = 0; u < n; u++) {
+        for (int k = 0; k < n; k++) {
+            int box_i = (u / puzzle->box_size) * puzzle->box_size;
+            int box_j = (u % puzzle->box_size) * puzzle->box_size;
+            s->units[u * n + k] = u * n + k;
+            s->units[(n + u) * n + k] = k * n + u;
+            s->units[(2 * n + u) * n + k] =
+                (box_i + k / puzzle->box_size) * n + box_j + k % puzzle->box_size;
+        }
+    }
+
+    for (int k = 0; k < puzzle->n_empty; k++) {
+        int pos = puzzle->empty[k].row * n + puzzle->empty[k].col;
+        s->free[k] = pos;
+        s->where[pos] = k;
+    }
+    s->n_free = puzzle->n_empty;
+    s->forward = true;
+
+    /* Whatever the givens force is shared by every branch */
+    if (s->propagate && !propagate(s)) {
+        s->dead = true;
+        s->forward = false;
+    }
+    s->base = s->trail_len;
+
+    return s;
+}
+
+void kd_free_search(kd_search_t *s) {
+    if (s == NULL) {
+        return;
+    }
+    kd_free_board(s->board);
+    kd_free_board(s->given);
+    free(s->cells);
+    free(s->units);
+    free(s->free);
+    free(s->where);
+    free(s->trail);
+    free(s->stack);
+    free(s);
+}
+
+static void fill(kd_search_t *s, int pos, int value) {
+    kd_cell_t *c = &s->cells[pos];
+    int last = s->free[s->n_free - 1];
+    int k = s->where[pos];
+
+    kd_set_cell(s->board, c->row, c->col, value);
+
+    /* Swap it past the end of the free cells */
+    s->free[k] = last;
+    s->where[last] = k;
+    s->free[s->n_free - 1] = pos;
+    s->where[pos] = s->n_free - 1;
+    s->n_free--;
+
+    s->trail[s->trail_len++] = pos;
+}
+
+/* Empties every cell filled after the trail had length mark. Undoing in
+ * reverse order leaves each cell right past the end of the free cells. */
+static void undo(kd_search_t *s, int mark) {
+    while (s->trail_len > mark) {
+        kd_cell_t *c = &s->cells[s->trail[--s->trail_len]];
+        kd_clear_cell(s->board, c->row, c->col);
+        s->n_free++;
+    }
+}
+
+/* Places the cells a unit forces: values with a single cell left. False
+ * if some missing value has no cell left at all. */
+static bool hidden_singles(kd_search_t *s, const int *unit, bool *changed) {
+    int n = s->puzzle->n;
+    kd_mask_t once = kd_mask_zero(), twice = kd_mask_zero();
+    kd_mask_t placed = kd_mask_zero(), single;
+
+    for (int k = 0; k < n; k++) {
+        kd_cell_t *c = &s->cells[unit[k]];
+        int v = kd_get_cell(s->board, c->row, c->col);
+        if (v != KD_EMPTY) {
+            kd_mask_add(&placed, v);
+        } else {
+            kd_mask_t m = kd_cell_candidates(s->board, c);
+            twice = kd_mask_or(twice, kd_mask_and(once, m));
+            once = kd_mask_or(once, m);
+        }
+    }
+
+    if (!kd_mask_empty(kd_mask_andnot(s->board->full,
+                                      kd_mask_or(placed, once)))) {
+        return false;
+    }
+
+    single = kd_mask_andnot(once, twice);
+    while (!kd_mask_empty(single)) {
+        int v = kd_lowest(single);
+        kd_mask_del(&single, v);
+        for (int k = 0; k < n; k++) {
+            kd_cell_t *c = &s->cells[unit[k]];
+            if (kd_get_cell(s->board, c->row, c->col) == KD_EMPTY &&
+                    kd_mask_has(kd_cell_candidates(s->board, c), v)) {
+                fill(s, unit[k], v);
+                *changed = true;
+                break;
+            }
+            if (k == n - 1) {
+                /* Its only cell took another forced value */
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Naked and hidden singles until a fixpoint, false on a contradiction */
+static bool propagate(kd_search_t *s) {
+    int n = s->puzzle->n;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        /* Filling swaps the cell with the last free one, already seen */
+        for (int k = s->n_free - 1; k >= 0; k--) {
+            int pos = s->free[k];
+            kd_mask_t m = kd_cell_candidates(s->board, &s->cells[pos]);
+            if (kd_mask_empty(m)) {
+                return false;
+            }
+            if (kd_mask_single(m)) {
+                fill(s, pos, kd_lowest(m));
+                changed = true;
+            }
+        }
+
+        for (int u = 0; u < 3 * n && s->n_free > 0; u++) {
+            if (!hidden_singles(s, &s->units[u * n], &changed)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* First empty cell in row-major order */
+static int select_static(kd_search_t *s) {
+    const kd_cell_t *empty = s->puzzle->empty;
+    while (kd_get_cell(s->board, empty[s->scan].row, empty[s->scan].col)) {
+        s->scan++;
+    }
+    return empty[s->scan].row * s->puzzle->n + empty[s->scan].col;
+}
+
+/* Empty cell with fewest candidates, first found on ties */
+static int select_mrv(kd_search_t *s) {
+    int count;
+    return s->free[kd_min_candidates(s->board, s->cells, s->free, s->n_free, 1,
+                                     &count)];
+}
+
+static void push(kd_search_t *s, int pos, int value, int max) {
+    kd_frame_t *f = &s->stack[s->depth++];
+    f->pos = pos;
+    f->value = value;
+    f->max = max;
+    f->mark = s->trail_len;
+    f->scan = s->scan;
+}
+
+/* Back to the puzzle givens, with no fixed moves */
+void kd_search_reset(kd_search_t *s) {
+    undo(s, s->base);
+    s->depth = 0;
+    s->root = 0;
+    s->scan = 0;
+    s->forward = !s->dead;
+}
+
+/* Plays a fixed move, it becomes part of the root of the search. Only valid
+ * before running or right after a reset. Returns false if the value does
+ * not fit, the search is then exhausted. */
+bool kd_search_play(kd_search_t *s, int pos, int value) {
+    kd_cell_t *c;
+
+    if (!s->forward) {
+        /* A previous move already failed */
+        return false;
+    }
+
+    c = pos >= 0 && pos < s->puzzle->n * s->puzzle->n ? &s->cells[pos] : NULL;
+    if (c == NULL || value < 1 || value > s->puzzle->n ||
+            kd_get_cell(s->board, c->row, c->col) != KD_EMPTY ||
+            !kd_is_available(s->board, c->row, c->col, value)) {
+        s->root = s->depth;
+        s->forward = false;
+        return false;
+    }
+
+    push(s, pos, value, value);
+    fill(s, pos, value);
+    s->root = s->depth;
+
+    if (s->propagate && !propagate(s)) {
+        s->forward = false;
+        return false;
+    }
+    return true;
+}
+
+/* Runs until a solution, the end of the tree or about budget nodes (<= 0
+ * for no limit). After KD_SOLVED or KD_CUTOFF running again backtracks
+ * from there, so solutions can be enumerated. */
+int kd_search_run(kd_search_t *s, long budget) {
+    long stop = s->nodes + budget;
+    kd_frame_t *f;
+    kd_cell_t *c;
+    kd_mask_t m;
+    int value;
+
+    while (1) {
+        if (s->forward) {
+            s->forward = false;
+            if (s->n_free == 0) {
+                return KD_SOLVED;
+            }
+            if (s->max_depth > 0 && s->depth >= s->max_depth) {
+                return KD_CUTOFF;
+            }
+            push(s, s->order == KD_ORDER_MRV ? select_mrv(s) : select_static(s),
+                 0, s->puzzle->n);
+        }
+
+        if (s->depth == s->root) {
+            return KD_EXHAUSTED;
+        }
+
+        /* Next value of the deepest frame */
+        f = &s->stack[s->depth - 1];
+        c = &s->cells[f->pos];
+        undo(s, f->mark);
+        m = kd_mask_and(kd_cell_candidates(s->board, c),
+                        kd_range(f->value + 1, f->max));
+
+        if (kd_mask_empty(m)) {
+            /* Backtrack */
+            s->scan = f->scan;
+            s->depth--;
+            continue;
+        }
+
+        value = kd_lowest(m);
+        f->value = value;
+        /* Cells the previous value forced are empty again */
+        s->scan = f->scan;
+        fill(s, f->pos, value);
+        /* A contradiction sends the frame on to its next value */
+        s->forward = !s->propagate || propagate(s);
+
+        if (++s->nodes == stop) {
+            return KD_RUNNING;
+        }
+    }
+}
+
+/* Copies the branching path (fixed moves included) into moves, which must
+ * hold puzzle->n_empty entries. Returns its length. */
+int kd_search_moves(const kd_search_t *s, kd_move_t *moves) {
+    for (int d = 0; d < s->depth; d++) {
+        moves[d].pos = s->stack[d].pos;
+        moves[d].value = s->stack[d].value;
+    }
+    return s->depth;
+}
+
+/* Candidates the cell of frame f had when it was first played */
+static kd_mask_t frame_candidates(const kd_search_t *s, const kd_frame_t *f) {
+    const kd_cell_t *c = &s->cells[f->pos];
+    kd_mask_t m = kd_cell_candidates(s->given, c);
+
+    for (int t = 0; t < f->mark; t++) {
+        const kd_cell_t *o = &s->cells[s->trail[t]];
+        if (o->row == c->row || o->col == c->col || o->box == c->box) {
+            kd_mask_del(&m, kd_get_cell(s->board, o->row, o->col));
+        }
+    }
+    return m;
+}
+
+/* Gives away the highest untried value of the shallowest frame that still
+ * has one, as a list of fixed moves to replay with kd_search_play. Frames
+ * with fewer than min_left empty cells below are not worth the transfer.
+ * Returns the number of moves, 0 if there was nothing to give. */
+int kd_search_split(kd_search_t *s, int min_left, kd_move_t *moves) {
+    for (int d = s->root; d < s->depth; d++) {
+        kd_frame_t *f = &s->stack[d];
+        kd_mask_t m;
+
+        if (s->puzzle->n_empty - f->mark < min_left) {
+            break;
+        }
+
+        m = kd_mask_and(frame_candidates(s, f),
+                        kd_range(f->value + 1, f->max));
+        if (!kd_mask_empty(m)) {
+            for (int k = 0; k < d; k++) {
+                moves[k].pos = s->stack[k].pos;
+                moves[k].value = s->stack[k].value;
+            }
+            moves[d].pos = f->pos;
+            moves[d].value = kd_highest(m);
+            f->max = moves[d].value - 1;
+            return d + 1;
+        }
+    }
+    return 0;
+}
+
+/* Calls open with every subtree the search has left, as the list of fixed
+ * moves leading to it: the untried values of each frame, and the current
+ * node if the search has yet to go below it. Together they are exactly the
+ * rest of the search, which is left untouched. moves must hold
+ * puzzle->n_empty entries. */
+void kd_search_frontier(const kd_search_t *s, kd_move_t *moves,
+                        void (*open)(void *arg, const kd_move_t *moves, int len),
+                        void *arg) {
+    kd_search_moves(s, moves);
+    for (int d = s->root; d < s->depth; d++) {
+        const kd_frame_t *f = &s->stack[d];
+        kd_mask_t m = kd_mask_and(frame_candidates(s, f),
+                                  kd_range(f->value + 1, f->max));
+
+        while (!kd_mask_empty(m)) {
+            moves[d].value = kd_lowest(m);
+            kd_mask_del(&m, moves[d].value);
+            open(arg, moves, d + 1);
+        }
+        moves[d].value = f->value;
+    }
+    if (s->forward) {
+        open(arg, moves, s->depth);
+    }
+}
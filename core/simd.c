@@ -0,0 +1,226 @@
+// vim:tabstop=4 shiftwidth=4
+/* Candidate kernels
+ * ----------------
+ * MRV scans every empty cell, ORs its row, column and square masks and
+ * popcounts what is left. The AVX2 and AVX-512 kernels do 2 and 4 cells at
+ * a time: each 128-bit lane holds two mask words of one cell, loaded
+ * straight from the row/col/square arrays, and popcounting is the nibble
+ * lookup (vpshufb + vpsadbw), since vpopcntq is not on every AVX-512
+ * machine. They need an even number of mask words.
+ *
+ * The kernel is picked once at startup with cpuid: AVX2 when the CPU has
+ * it, scalar otherwise. AVX-512 only when asked for, it measured slower
+ * than AVX2 (see kuduro-bench). KD_SIMD=scalar|avx2|avx512 in the
+ * environment overrides the choice.
+ */
+#include <immintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kuduro.h"
+
+typedef int (*kernel_fn)(const kd_board_t *b, const kd_cell_t *cells,
+                         const int *pos, int count, int stop, int *min_count);
+
+/* Running minimum over counts, first found on ties. Returns true once a
+ * count <= stop was seen. */
+static inline bool take_min(int count, int k, int stop, int *best,
+                            int *best_count) {
+    if (count < *best_count) {
+        *best = k;
+        *best_count = count;
+        return count <= stop;
+    }
+    return false;
+}
+
+static int min_candidates_scalar(const kd_board_t *b, const kd_cell_t *cells,
+                                 const int *pos, int count, int stop,
+                                 int *min_count) {
+    int best = 0, best_count = b->n + 1;
+    for (int k = 0; k < count; k++) {
+        int c = kd_popcount(kd_cell_candidates(b, &cells[pos[k]]));
+        if (take_min(c, k, stop, &best, &best_count)) {
+            break;
+        }
+    }
+    *min_count = best_count;
+    return best;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i popcount_avx2(__m256i v) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                         2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(
+        lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+/* Mask words w and w + 1 of cells c0 and c1, ORed over their row, column
+ * and square */
+__attribute__((target("avx2")))
+static inline __m256i used_avx2(const kd_board_t *b, const kd_cell_t *c0,
+                                const kd_cell_t *c1, int w) {
+    __m128i u0 = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)&b->rows[c0->row].w[w]),
+                     _mm_loadu_si128((const __m128i *)&b->cols[c0->col].w[w])),
+        _mm_loadu_si128((const __m128i *)&b->squares[c0->box].w[w]));
+    __m128i u1 = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)&b->rows[c1->row].w[w]),
+                     _mm_loadu_si128((const __m128i *)&b->cols[c1->col].w[w])),
+        _mm_loadu_si128((const __m128i *)&b->squares[c1->box].w[w]));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(u0), u1, 1);
+}
+
+__attribute__((target("avx2")))
+static int min_candidates_avx2(const kd_board_t *b, const kd_cell_t *cells,
+                               const int *pos, int count, int stop,
+                               int *min_count) {
+    int best = 0, best_count = b->n + 1, k = 0;
+    long long counts[4];
+
+    for (; k + 2 <= count; k += 2) {
+        const kd_cell_t *c0 = &cells[pos[k]], *c1 = &cells[pos[k + 1]];
+        __m256i total = _mm256_setzero_si256();
+        for (int w = 0; w + 2 <= KD_MASK_WORDS; w += 2) {
+            __m256i full = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)&b->full.w[w]));
+            __m256i m = _mm256_andnot_si256(used_avx2(b, c0, c1, w), full);
+            total = _mm256_add_epi64(total, popcount_avx2(m));
+        }
+        /* One count per word, two words per cell */
+        _mm256_storeu_si256((__m256i *)counts, total);
+        if (take_min((int)(counts[0] + counts[1]), k, stop, &best,
+                     &best_count) ||
+                take_min((int)(counts[2] + counts[3]), k + 1, stop, &best,
+                         &best_count)) {
+            *min_count = best_count;
+            return best;
+        }
+    }
+
+    for (; k < count; k++) {
+        int c = kd_popcount(kd_cell_candidates(b, &cells[pos[k]]));
+        if (take_min(c, k, stop, &best, &best_count)) {
+            break;
+        }
+    }
+    *min_count = best_count;
+    return best;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i popcount_avx512(__m512i v) {
+    const __m512i lut = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low = _mm512_set1_epi8(0x0f);
+    __m512i lo = _mm512_shuffle_epi8(lut, _mm512_and_si512(v, low));
+    __m512i hi = _mm512_shuffle_epi8(
+        lut, _mm512_and_si512(_mm512_srli_epi16(v, 4), low));
+    return _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512());
+}
+
+__attribute__((target("avx2,avx512f,avx512bw")))
+static int min_candidates_avx512(const kd_board_t *b, const kd_cell_t *cells,
+                                 const int *pos, int count, int stop,
+                                 int *min_count) {
+    int best = 0, best_count = b->n + 1, k = 0;
+    long long counts[8];
+
+    for (; k + 4 <= count; k += 4) {
+        const kd_cell_t *c0 = &cells[pos[k]], *c1 = &cells[pos[k + 1]];
+        const kd_cell_t *c2 = &cells[pos[k + 2]], *c3 = &cells[pos[k + 3]];
+        __m512i total = _mm512_setzero_si512();
+        for (int w = 0; w + 2 <= KD_MASK_WORDS; w += 2) {
+            __m512i used = _mm512_inserti64x4(
+                _mm512_castsi256_si512(used_avx2(b, c0, c1, w)),
+                used_avx2(b, c2, c3, w), 1);
+            __m512i full = _mm512_broadcast_i32x4(
+                _mm_loadu_si128((const __m128i *)&b->full.w[w]));
+            __m512i m = _mm512_andnot_si512(used, full);
+            total = _mm512_add_epi64(total, popcount_avx512(m));
+        }
+        _mm512_storeu_si512((void *)counts, total);
+        for (int l = 0; l < 4; l++) {
+            if (take_min((int)(counts[2 * l] + counts[2 * l + 1]), k + l, stop,
+                         &best, &best_count)) {
+                *min_count = best_count;
+                return best;
+            }
+        }
+    }
+
+    for (; k < count; k++) {
+        int c = kd_popcount(kd_cell_candidates(b, &cells[pos[k]]));
+        if (take_min(c, k, stop, &best, &best_count)) {
+            break;
+        }
+    }
+    *min_count = best_count;
+    return best;
+}
+
+static const struct {
+    const char *name;
+    kernel_fn fn;
+} kernels[] = {
+    {"scalar", min_candidates_scalar},
+    {"avx2", min_candidates_avx2},
+    {"avx512", min_candidates_avx512},
+};
+
+#define N_KERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static int selected;
+
+static bool supported(int k) {
+    __builtin_cpu_init();
+    switch (k) {
+    case 1:
+        return KD_MASK_WORDS % 2 == 0 && __builtin_cpu_supports("avx2");
+    case 2:
+        return KD_MASK_WORDS % 2 == 0 && __builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+    default:
+        return true;
+    }
+}
+
+/* Runs before main, so threads never race on the choice */
+__attribute__((constructor))
+static void pick_kernel(void) {
+    const char *name = getenv("KD_SIMD");
+
+    selected = supported(1) ? 1 : 0;
+    if (name != NULL && !kd_simd_select(name)) {
+        fprintf(stderr, "KD_SIMD=%s is not supported here, using %s\n", name,
+                kd_simd_name());
+    }
+}
+
+bool kd_simd_select(const char *name) {
+    for (int k = 0; k < N_KERNELS; k++) {
+        if (strcmp(name, kernels[k].name) == 0 && supported(k)) {
+            selected = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *kd_simd_name(void) {
+    return kernels[selected].name;
+}
+
+/* Index in pos of the cell with fewest candidates, first found on ties.
+ * Stops early at the first cell with stop candidates or fewer. */
+int kd_min_candidates(const kd_board_t *b, const kd_cell_t *cells,
+                      const int *pos, int count, int stop, int *min_count) {
+    return kernels[selected].fn(b, cells, pos, count, stop, min_count);
+}
@@ -0,0 +1,64 @@
+// vim:tabstop=4 shiftwidth=4
+/* Corpus converter
+ * ----------------
+ * Packs the puzzles of a text input, in either format of reader.c, into a
+ * binary corpus (corpus.c). A corpus holds one box size, so the first
+ * puzzle sets it and puzzles of another size are skipped along with the
+ * invalid ones, with a count on stderr.
+ *
+ * Usage: kuduro-pack input output (input - for stdin)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kuduro.h"
+
+int main(int argc, char *argv[]) {
+    kd_reader_t *in;
+    kd_corpus_t *out = NULL;
+    kd_puzzle_t *puzzle;
+    long skipped = 0, count;
+    int got, bits;
+    size_t record;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s input output\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    in = kd_open_reader(argv[1]);
+    if (in == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    while ((got = kd_reader_next(in, &puzzle)) != 0) {
+        if (got > 0 && out == NULL) {
+            out = kd_corpus_create(argv[2], puzzle->box_size);
+            if (out == NULL) {
+                return EXIT_FAILURE;
+            }
+        }
+        if (got < 0 || !kd_corpus_add(out, puzzle)) {
+            skipped++;
+        }
+        kd_free_puzzle(puzzle);
+    }
+    kd_close_reader(in);
+    if (out == NULL) {
+        fprintf(stderr, "No puzzles to pack\n");
+        return EXIT_FAILURE;
+    }
+
+    count = out->count;
+    bits = out->bits;
+    record = out->record;
+    if (!kd_corpus_commit(out)) {
+        return EXIT_FAILURE;
+    }
+    printf("Packed %ld puzzles, %d bits per cell, %zu bytes each\n", count,
+           bits, record);
+    if (skipped > 0) {
+        fprintf(stderr, "Skipped %ld invalid or differently sized puzzles\n",
+                skipped);
+    }
+    return 0;
+}
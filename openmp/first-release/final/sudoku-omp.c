@@ -9,6 +9,7 @@
 #include <time.h>
 
 #define N_ARGS 2
+#define CACHE_LINE 64
 #define EMPTY 0
 
 #define FRAC_THRES 0.9
@@ -18,9 +19,11 @@ typedef struct square_struct {
     int_fast8_t row;
     int_fast8_t col;
     int_fast8_t box;
+    int_fast32_t pos; /* row * n + col */
 } square;
 
-typedef uint_fast8_t **sudoku;
+/* Row-major n * n cells in one cache-aligned block */
+typedef uint8_t *sudoku;
 
 // Mother of all sudokus
 typedef struct moas_t {
@@ -46,6 +49,17 @@ void print_error(char *error) {
     exit(EXIT_FAILURE);
 }
 
+// Empty grid, padded to whole cache lines
+sudoku new_sudoku() {
+    size_t bytes = gMOAS->n * gMOAS->n * sizeof(uint8_t);
+    sudoku new_state = (sudoku)aligned_alloc(
+                           CACHE_LINE, (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (new_state == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    return new_state;
+}
+
 int read_file(const char *filename) {
     FILE *sudoku_file;
     int box_size;
@@ -68,12 +82,7 @@ int read_file(const char *filename) {
 
     gMOAS->box_size = box_size;
     gMOAS->n = box_size * box_size;
-
-    gMOAS->to_solve = (sudoku)malloc(gMOAS->n * sizeof(uint_fast8_t *));
-    for (int i = 0; i < gMOAS->n; i++) {
-        gMOAS->to_solve[i] =
-            (uint_fast8_t *)malloc(gMOAS->n * sizeof(uint_fast8_t));
-    }
+    gMOAS->to_solve = new_sudoku();
 
     /* Read the file */
     iter = 0;
@@ -81,7 +90,7 @@ int read_file(const char *filename) {
         for (int j = 0; j < gMOAS->n; j++) {
             fscanf(sudoku_file, "%2" SCNu8, &num);
 
-            gMOAS->to_solve[i][j] = num;
+            gMOAS->to_solve[i * gMOAS->n + j] = num;
             if (num == 0) {
                 iter++;
             }
@@ -104,9 +113,10 @@ int read_file(const char *filename) {
     iter = 0;
     for (int i = 0; i < gMOAS->n; i++) {
         for (int j = 0; j < gMOAS->n; j++) {
-            if (gMOAS->to_solve[i][j] == 0) {
+            if (gMOAS->to_solve[i * gMOAS->n + j] == 0) {
                 gMOAS->empty_sq[iter]->row = i;
                 gMOAS->empty_sq[iter]->col = j;
+                gMOAS->empty_sq[iter]->pos = i * gMOAS->n + j;
                 gMOAS->empty_sq[iter]->box =
                     (i / gMOAS->box_size) * gMOAS->box_size + j / gMOAS->box_size;
 
@@ -121,9 +131,6 @@ int read_file(const char *filename) {
 
 // Free sudoku typedef
 void free_sudoku(sudoku to_free) {
-    for (int i = 0; i < gMOAS->n; i++) {
-        free(to_free[i]);
-    }
     free(to_free);
 }
 
@@ -149,7 +156,7 @@ void free_gMOAS() {
 void print_grid(sudoku to_print) {
     for (int row = 0; row < gMOAS->n; row++) {
         for (int col = 0; col < gMOAS->n; col++) {
-            printf("%2d ", to_print[row][col]);
+            printf("%2d ", to_print[row * gMOAS->n + col]);
         }
         printf("\n");
     }
@@ -160,16 +167,18 @@ void print_grid(sudoku to_print) {
 bool safe(sudoku to_check, square *to_test, int num) {
     uint_fast8_t row_start = to_test->row - to_test->row % gMOAS->box_size;
     uint_fast8_t col_start = to_test->col - to_test->col % gMOAS->box_size;
+    const uint8_t *row = to_check + to_test->row * gMOAS->n;
+    const uint8_t *box = to_check + row_start * gMOAS->n + col_start;
 
     for (int i = 0; i < gMOAS->n; i++) {
-        if (to_check[i][to_test->col] == num || to_check[to_test->row][i] == num) {
+        if (to_check[i * gMOAS->n + to_test->col] == num || row[i] == num) {
             return false;
         }
     }
 
     for (int i = 0; i < gMOAS->box_size; i++)
         for (int j = 0; j < gMOAS->box_size; j++)
-            if (to_check[i + row_start][j + col_start] == num) {
+            if (box[i * gMOAS->n + j] == num) {
                 return false;
             }
 
@@ -178,17 +187,14 @@ bool safe(sudoku to_check, square *to_test, int num) {
 
 void copy_to_gMOAS(sudoku solved) {
     for (int i = 0; i < gMOAS->n_empty_sq; i++) {
-        gMOAS->to_solve[gMOAS->empty_sq[i]->row][gMOAS->empty_sq[i]->col] =
-            solved[gMOAS->empty_sq[i]->row][gMOAS->empty_sq[i]->col];
+        gMOAS->to_solve[gMOAS->empty_sq[i]->pos] =
+            solved[gMOAS->empty_sq[i]->pos];
     }
 }
 
 sudoku new_state_copy(sudoku old_state) {
-    sudoku new_state = (sudoku)malloc(gMOAS->n * sizeof(uint_fast8_t *));
-    for (int i = 0; i < gMOAS->n; i++) {
-        new_state[i] = (uint_fast8_t *)malloc(gMOAS->n * sizeof(uint_fast8_t));
-        memcpy(new_state[i], old_state[i], gMOAS->n * sizeof(uint_fast8_t));
-    }
+    sudoku new_state = new_sudoku();
+    memcpy(new_state, old_state, gMOAS->n * gMOAS->n * sizeof(uint8_t));
     return new_state;
 }
 
@@ -244,8 +250,7 @@ void solve_task_sudoku(task_log *task_l) {
 
             /* Backtrack */
             ptr--;
-            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-            [gMOAS->empty_sq[ptr + base_ptr]->col] = 0;
+            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->pos] = 0;
 
             continue;
         }
@@ -261,10 +266,8 @@ void solve_task_sudoku(task_log *task_l) {
                     /* Branch top down in the branch currenlty being explored in this
                      * task. */
 
-                    task_top->state[gMOAS->empty_sq[top + base_ptr]->row]
-                    [gMOAS->empty_sq[top + base_ptr]->col] =
-                        task_l->state[gMOAS->empty_sq[top + base_ptr]->row]
-                        [gMOAS->empty_sq[top + base_ptr]->col];
+                    task_top->state[gMOAS->empty_sq[top + base_ptr]->pos] =
+                        task_l->state[gMOAS->empty_sq[top + base_ptr]->pos];
 
                     top++;
                 } else {
@@ -279,8 +282,7 @@ void solve_task_sudoku(task_log *task_l) {
                     new_task_l =
                         (task_log *)new_task_log(task_top->state, (base_ptr + top + 1));
 
-                    new_task_l->state[gMOAS->empty_sq[top + base_ptr]->row]
-                    [gMOAS->empty_sq[top + base_ptr]->col] =
+                    new_task_l->state[gMOAS->empty_sq[top + base_ptr]->pos] =
                         v_plays[top];
 
                     #pragma omp task firstprivate(new_task_l)
@@ -296,10 +298,8 @@ void solve_task_sudoku(task_log *task_l) {
                         /* Branch top down in the branch currenlty being explored in this
                          * task. */
 
-                        task_top->state[gMOAS->empty_sq[top + base_ptr]->row]
-                        [gMOAS->empty_sq[top + base_ptr]->col] =
-                            task_l->state[gMOAS->empty_sq[top + base_ptr]->row]
-                            [gMOAS->empty_sq[top + base_ptr]->col];
+                        task_top->state[gMOAS->empty_sq[top + base_ptr]->pos] =
+                            task_l->state[gMOAS->empty_sq[top + base_ptr]->pos];
 
                         top++;
                     }
@@ -313,13 +313,11 @@ void solve_task_sudoku(task_log *task_l) {
         if (safe(task_l->state, gMOAS->empty_sq[ptr + base_ptr], v_plays[ptr])) {
             // print_branch(ptr+base_ptr, v_plays[ptr]);
 
-            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-            [gMOAS->empty_sq[ptr + base_ptr]->col] = v_plays[ptr];
+            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->pos] = v_plays[ptr];
             v_plays[ptr]++; /* always to next */
 
             if (v_plays[ptr] > gMOAS->n && ptr == top) {
-                task_top->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-                [gMOAS->empty_sq[ptr + base_ptr]->col] = v_plays[ptr];
+                task_top->state[gMOAS->empty_sq[ptr + base_ptr]->pos] = v_plays[ptr];
 
                 top++;
             }
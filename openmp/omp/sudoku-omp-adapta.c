@@ -1,422 +1,669 @@
 #include <errno.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <omp.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "kuduro.h"
 
 #define N_ARGS 2
-#define EMPTY 0
 
 #define FRAC_THRES 0.9
-#define EXTRA_TASKS 10
-
-typedef struct square_struct {
-    int_fast8_t row;
-    int_fast8_t col;
-    int_fast8_t box;
-} square;
+#define DEQUE_SIZE 64
+#define DEQUE_SLACK 2
+#define TASK_SLAB 64
+#define CHECKPOINT_EVERY 60.0
+#define BATCH_CHUNK 1024
 
-typedef uint_fast8_t **sudoku;
+typedef kd_board_t *sudoku;
 
 // Mother of all sudokus
 typedef struct moas_t {
-    square **empty_sq;
+    kd_puzzle_t *puzzle;
     sudoku to_solve;
     int_fast32_t n;
     int_fast32_t box_size;
     int_fast32_t n_empty_sq;
 } moas;
 
+/* A task is the list of moves leading to its subtree, the moves are laid
+ * out right after it in the same pool object */
 typedef struct task_log_t {
-    sudoku state;
-    int next_ptr;
+    kd_move_t *moves;
+    int n_moves;
 } task_log;
 
+/* Each thread works off its own deque: it pops the subtrees it split last
+ * and keeps DEQUE_SLACK of them up for grabs, idle threads steal the
+ * oldest (shallowest) ones from the top. */
+typedef struct worker_t {
+    _Alignas(KD_CACHE_LINE) kd_deque_t *deque;
+    kd_search_t *search;
+    kd_pool_t *pool; /* its task logs, thieves free them back into it */
+    long tasks;   /* tasks run */
+    long spawned; /* tasks pushed on its deque */
+    long stolen;  /* tasks taken from other deques */
+    long solutions; /* found by it, -c and -u */
+    bool busy;    /* its search holds part of a task */
+} worker;
+
+/* Checkpoints (--checkpoint FILE): every `every` seconds the threads park
+ * at safe points, between search quanta or while looking for a task, and
+ * the last one to park writes the tasks on every deque plus the open
+ * subtrees of every busy search. --resume starts from the file instead of
+ * the whole tree. */
+typedef struct checkpoint_t {
+    const char *path;
+    double every;
+    bool resume;
+    int due;     /* threads are parking for a checkpoint */
+    int parked;
+    int present; /* threads still in work() */
+    long round;  /* checkpoints taken, parked threads wait for it to move */
+    double next; /* when the next one is due */
+} checkpoint;
+
 int gDONE;
-int idle;
+double solved_at; /* when gDONE was raised */
+long gCOUNT; /* solutions found so far by every thread, -c and -u */
+kd_options_t gOPTS;
+long gNODES;
+long pending; /* tasks pushed and not finished yet */
+int n_workers;
+worker *workers;
+kd_arena_t task_arena;
 moas *gMOAS;
 int treshold;
+checkpoint gCKPT;
 
 void print_error(char *error) {
-    fprintf(stderr, error);
+    fputs(error, stderr);
     exit(EXIT_FAILURE);
 }
 
 int read_file(const char *filename) {
-    FILE *sudoku_file;
-    int box_size;
-    uint_fast32_t iter;
-    uint8_t num;
-
-    /* Opens file */
-    sudoku_file = fopen(filename, "r");
-    if (sudoku_file == NULL)
-        print_error("Could not open file\n");
-
-    /* Scans first line (aka the square size) */
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF)
-        print_error("Could not read file\n");
+    kd_puzzle_t *puzzle = kd_read_file(filename);
+    if (puzzle == NULL) {
+        return 1;
+    }
+    if (puzzle->n_empty == 0) {
+        kd_free_puzzle(puzzle);
+        return 1;
+    }
 
     gMOAS = (moas *)malloc(sizeof(moas));
     if (gMOAS == NULL) {
         print_error("Unable to init MOAS");
     }
 
-    gMOAS->box_size = box_size;
-    gMOAS->n = box_size * box_size;
-
-    gMOAS->to_solve = (sudoku)malloc(gMOAS->n * sizeof(uint_fast8_t *));
-    for (int i = 0; i < gMOAS->n; i++) {
-        gMOAS->to_solve[i] =
-            (uint_fast8_t *)malloc(gMOAS->n * sizeof(uint_fast8_t));
+    gMOAS->puzzle = puzzle;
+    gMOAS->box_size = puzzle->box_size;
+    gMOAS->n = puzzle->n;
+    gMOAS->n_empty_sq = puzzle->n_empty;
+    gMOAS->to_solve = kd_new_board(puzzle);
+    if (gMOAS->to_solve == NULL) {
+        print_error("Unable to init MOAS");
     }
 
-    /* Read the file */
-    iter = 0;
-    for (int i = 0; i < gMOAS->n; i++) {
-        for (int j = 0; j < gMOAS->n; j++) {
-            fscanf(sudoku_file, "%2" SCNu8, &num);
+    return 0;
+}
 
-            gMOAS->to_solve[i][j] = num;
-            if (num == 0) {
-                iter++;
-            }
-        }
-    }
+// Free task log typedef
+void free_task_log(worker *self, task_log *to_free) {
+    kd_pool_free(self->pool, to_free);
+}
 
-    if (iter == 0) {
-        fclose(sudoku_file);
-        return 1;
-    }
+// Free global MOAS
+void free_gMOAS() {
+    kd_free_board(gMOAS->to_solve);
+    kd_free_puzzle(gMOAS->puzzle);
+    free(gMOAS);
+}
 
-    // Create aux array of empty squares
-    gMOAS->n_empty_sq = iter;
-    gMOAS->empty_sq = (square **)malloc(iter * sizeof(square *));
+// Print grid
+void print_grid(sudoku to_print) {
+    kd_print_board(to_print);
+}
 
-    for (uint_fast32_t i = 0; i < iter; i++) {
-        gMOAS->empty_sq[i] = (square *)malloc(sizeof(square));
-    }
+void copy_to_gMOAS(sudoku solved) {
+    kd_copy_into(gMOAS->to_solve, solved);
+}
 
-    iter = 0;
-    for (int i = 0; i < gMOAS->n; i++) {
-        for (int j = 0; j < gMOAS->n; j++) {
-            if (gMOAS->to_solve[i][j] == 0) {
-                gMOAS->empty_sq[iter]->row = i;
-                gMOAS->empty_sq[iter]->col = j;
-                gMOAS->empty_sq[iter]->box =
-                    (i / gMOAS->box_size) * gMOAS->box_size + j / gMOAS->box_size;
+task_log *new_task_log(worker *self) {
+    task_log *new = (task_log *)kd_pool_alloc(self->pool);
 
-                iter++;
-            }
-        }
+    if (new == NULL) {
+        print_error("Could not allocate space\n");
     }
+    new->moves = (kd_move_t *)(new + 1);
+    new->n_moves = 0;
 
-    fclose(sudoku_file);
-    return 0;
+    return new;
 }
 
-// Free sudoku typedef
-void free_sudoku(sudoku to_free) {
-    for (int i = 0; i < gMOAS->n; i++) {
-        free(to_free[i]);
+/* Deques hold at least capacity tasks */
+void init_workers(int count, long capacity) {
+    n_workers = count;
+    kd_init_arena(&task_arena, sizeof(task_log) +
+                  gMOAS->n_empty_sq * sizeof(kd_move_t), TASK_SLAB);
+    workers = (worker *)aligned_alloc(KD_CACHE_LINE, count * sizeof(worker));
+    if (workers == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    for (int i = 0; i < count; i++) {
+        workers[i].deque = kd_new_deque(capacity);
+        workers[i].search = kd_new_search(gMOAS->puzzle, &gOPTS);
+        workers[i].pool = kd_new_pool(&task_arena);
+        if (workers[i].deque == NULL || workers[i].search == NULL ||
+                workers[i].pool == NULL) {
+            print_error("Could not allocate space\n");
+        }
+        workers[i].tasks = workers[i].spawned = workers[i].stolen = 0;
+        workers[i].solutions = 0;
+        workers[i].busy = false;
     }
-    free(to_free);
 }
 
-// Free task log typedef
-void free_task_log(task_log *to_free) {
-    free(to_free->state);
-
-    free(to_free);
+/* Also frees the tasks left behind when a solution cut the search short */
+void free_workers() {
+    task_log *task;
+    for (int i = 0; i < n_workers; i++) {
+        while ((task = kd_deque_pop(workers[i].deque)) != NULL) {
+            free_task_log(&workers[i], task);
+        }
+        kd_free_deque(workers[i].deque);
+        kd_free_search(workers[i].search);
+    }
+    kd_free_arena(&task_arena);
+    free(workers);
 }
 
-// Free global MOAS
-void free_gMOAS() {
-    free_sudoku(gMOAS->to_solve);
-    for (int i = 0; i < gMOAS->n_empty_sq; ++i) {
-        free(gMOAS->empty_sq[i]);
-    }
+int done() {
+    int d;
+    #pragma omp atomic read
+    d = gDONE;
+    return d;
+}
 
-    free(gMOAS->empty_sq);
-    free(gMOAS);
+void add_subtree(void *c, const kd_move_t *moves, int len) {
+    kd_checkpoint_add((kd_checkpoint_t *)c, moves, len);
 }
 
-// Print grid
-void print_grid(sudoku to_print) {
-    for (int row = 0; row < gMOAS->n; row++) {
-        for (int col = 0; col < gMOAS->n; col++) {
-            printf("%2d ", to_print[row][col]);
+/* Called inside critical(checkpoint) once every thread left is parked */
+void write_checkpoint() {
+    kd_checkpoint_t *c = kd_checkpoint_create(gCKPT.path, gMOAS->puzzle);
+    kd_move_t *moves = (kd_move_t *)malloc(gMOAS->n_empty_sq *
+                                           sizeof(kd_move_t));
+    task_log *task;
+    long count;
+
+    if (moves == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    if (c != NULL) {
+        for (int i = 0; i < n_workers; i++) {
+            for (long j = 0; j < kd_deque_size(workers[i].deque); j++) {
+                task = (task_log *)kd_deque_peek(workers[i].deque, j);
+                kd_checkpoint_add(c, task->moves, task->n_moves);
+            }
+            if (workers[i].busy) {
+                kd_search_frontier(workers[i].search, moves, add_subtree, c);
+            }
+        }
+        count = c->count;
+        if (kd_checkpoint_commit(c)) {
+            printf("Checkpoint of %ld subtrees in %s\n", count, gCKPT.path);
+            fflush(stdout);
         }
-        printf("\n");
     }
-    printf("\n");
+    free(moves);
+
+    #pragma omp atomic write
+    gCKPT.next = omp_get_wtime() + gCKPT.every;
+    gCKPT.parked = 0;
+    #pragma omp atomic write
+    gCKPT.due = 0;
+    #pragma omp atomic update
+    gCKPT.round++;
 }
 
-// Check box, row and column for safety
-bool safe(sudoku to_check, square *to_test, int num) {
-    uint_fast8_t row_start = to_test->row - to_test->row % gMOAS->box_size;
-    uint_fast8_t col_start = to_test->col - to_test->col % gMOAS->box_size;
+/* Safe point: every subtree of the calling thread is on its deque or in
+ * its search. Waits there while a checkpoint is taken. */
+void park() {
+    long round = -1, now;
+    double next;
+    int due;
 
-    for (int i = 0; i < gMOAS->n; i++) {
-        if (to_check[i][to_test->col] == num || to_check[to_test->row][i] == num) {
-            return false;
-        }
+    if (gCKPT.path == NULL) {
+        return;
+    }
+    #pragma omp atomic read
+    due = gCKPT.due;
+    #pragma omp atomic read
+    next = gCKPT.next;
+    if (!due && omp_get_wtime() < next) {
+        return;
     }
 
-    for (int i = 0; i < gMOAS->box_size; i++)
-        for (int j = 0; j < gMOAS->box_size; j++)
-            if (to_check[i + row_start][j + col_start] == num) {
-                return false;
+    #pragma omp critical(checkpoint)
+    {
+        if (gCKPT.due || omp_get_wtime() >= gCKPT.next) {
+            #pragma omp atomic write
+            gCKPT.due = 1;
+            round = gCKPT.round;
+            if (++gCKPT.parked == gCKPT.present) {
+                write_checkpoint();
             }
+        }
+    }
 
-    return true;
-}
-
-void copy_to_gMOAS(sudoku solved) {
-    for (int i = 0; i < gMOAS->n_empty_sq; i++) {
-        gMOAS->to_solve[gMOAS->empty_sq[i]->row][gMOAS->empty_sq[i]->col] =
-            solved[gMOAS->empty_sq[i]->row][gMOAS->empty_sq[i]->col];
+    while (round >= 0) {
+        #pragma omp atomic read
+        now = gCKPT.round;
+        if (now != round) {
+            break;
+        }
+        sched_yield();
     }
 }
 
-sudoku new_state_copy(sudoku old_state) {
-    sudoku new_state = (sudoku)malloc(gMOAS->n * sizeof(uint_fast8_t *));
-    for (int i = 0; i < gMOAS->n; i++) {
-        new_state[i] = (uint_fast8_t *)malloc(gMOAS->n * sizeof(uint_fast8_t));
-        memcpy(new_state[i], old_state[i], gMOAS->n * sizeof(uint_fast8_t));
+/* The thread is done with work(), the others no longer wait for it */
+void leave() {
+    #pragma omp critical(checkpoint)
+    {
+        gCKPT.present--;
+        if (gCKPT.due && gCKPT.present > 0 &&
+                gCKPT.parked == gCKPT.present) {
+            write_checkpoint();
+        }
     }
-    return new_state;
 }
 
-task_log *new_task_log(sudoku old_state, int next_ptr) {
-    task_log *new = (task_log *)malloc(sizeof(task_log));
+/* Counting: each thread keeps its own count, the shared one only raises
+ * gDONE once the threads together reached the limit */
+void count_solution(worker *self) {
+    long total;
 
-    new->state = new_state_copy(old_state);
-    new->next_ptr = next_ptr;
+    self->solutions++;
+    #pragma omp atomic capture
+    total = ++gCOUNT;
 
-    return new;
+    if (total == 1) {
+        copy_to_gMOAS(self->search->board);
+    }
+    if (total == gOPTS.count) {
+        solved_at = omp_get_wtime();
+        #pragma omp atomic write
+        gDONE = 1;
+    }
 }
 
-void solve_task_sudoku(task_log *task_l) {
-    task_log *task_top, *new_task_l;
-    int nplays, *v_plays;
-    int ptr, base_ptr;
-    int top;
+void solve_task_sudoku(worker *self, task_log *task_l) {
+    task_log *new_task_l;
+    kd_search_t *search = self->search;
+    int res, i;
 
-    if (gDONE) {
-        free(task_l);
-
-        return;
+    /* Replay the moves of the task on a clean board */
+    kd_search_reset(search);
+    for (i = 0; i < task_l->n_moves; i++) {
+        kd_search_play(search, task_l->moves[i].pos, task_l->moves[i].value);
     }
+    self->busy = true;
+    free_task_log(self, task_l);
+    self->tasks++;
 
-    base_ptr = task_l->next_ptr;
-
-    nplays = gMOAS->n_empty_sq - base_ptr;
-
-    v_plays = (int *)malloc(nplays * sizeof(int));
-
-    task_top = (task_log *)new_task_log(task_l->state, base_ptr);
-
-    top = ptr = 0;
-    v_plays[0] = 1;
+    while (!done()) {
+        res = kd_search_run(search, gMOAS->n);
 
-    while (1) {
-        /* This square is empty. */
+        if (res == KD_SOLVED && gOPTS.count > 0) {
+            /* Running again backtracks to the next solution */
+            count_solution(self);
+            continue;
+        } else if (res == KD_SOLVED) {
+            /* Has solved all :) */
+
+            #pragma omp critical
+            {
+                if (!done()) {
+                    copy_to_gMOAS(search->board);
+                    solved_at = omp_get_wtime();
+                    #pragma omp atomic write
+                    gDONE = 1;
+                }
+            }
 
-        if (gDONE) {
-            free(task_l);
-            free(task_top);
+            break;
+        } else if (res == KD_EXHAUSTED) {
+            /* Task done */
 
-            return;
+            break;
         }
 
-        /* Check if branch options are emptied. */
-        if (v_plays[ptr] > gMOAS->n) {
-            if (ptr == top) {
-                /* Task done */
-
+        /* Split subtrees off the top while the deque runs low */
+        while (n_workers > 1 && kd_deque_size(self->deque) < DEQUE_SLACK) {
+            new_task_l = new_task_log(self);
+            new_task_l->n_moves = kd_search_split(
+                                      search, gMOAS->n_empty_sq - treshold, new_task_l->moves);
+            if (new_task_l->n_moves == 0) {
+                free_task_log(self, new_task_l);
                 break;
             }
 
-            /* Backtrack */
-            ptr--;
-            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-            [gMOAS->empty_sq[ptr + base_ptr]->col] = 0;
+            #pragma omp atomic
+            pending++;
 
-            continue;
+            if (!kd_deque_push(self->deque, new_task_l)) {
+                print_error("Deque overflow\n");
+            }
+            self->spawned++;
         }
+        park();
+    }
+    self->busy = false;
+}
 
-        /* Fork task workload from top if idle threads are detected. */
-        if ((base_ptr - top) < treshold && top < ptr && top < (nplays - 1) &&
-                idle > 0) {
-
-            if (safe(task_top->state, gMOAS->empty_sq[top + base_ptr],
-                     v_plays[top])) {
-
-                if (v_plays[top] > gMOAS->n) {
-                    /* Branch top down in the branch currenlty being explored in this
-                     * task. */
+/* Oldest task of some other thread, NULL if none was found */
+task_log *steal(worker *self, int id) {
+    task_log *task;
+    int k;
 
-                    task_top->state[gMOAS->empty_sq[top + base_ptr]->row]
-                    [gMOAS->empty_sq[top + base_ptr]->col] =
-                        task_l->state[gMOAS->empty_sq[top + base_ptr]->row]
-                        [gMOAS->empty_sq[top + base_ptr]->col];
+    for (k = 1; k < n_workers; k++) {
+        task = kd_deque_steal(workers[(id + k) % n_workers].deque);
+        if (task != NULL) {
+            self->stolen++;
+            return task;
+        }
+    }
+    return NULL;
+}
 
-                    top++;
-                } else {
+void work(int id) {
+    worker *self = &workers[id];
+    task_log *task;
+    long left;
 
-                    #pragma omp atomic
-                    idle--;
+    while (1) {
+        park();
+        task = kd_deque_pop(self->deque);
+        if (task == NULL) {
+            task = steal(self, id);
+        }
 
-                    // printf("Launch sub-task, level %d, option %d\n", top,
-                    // v_plays[top]);
+        if (task != NULL) {
+            if (done()) {
+                free_task_log(self, task);
+            } else {
+                solve_task_sudoku(self, task);
+            }
 
-                    /* Create new task */
-                    new_task_l =
-                        (task_log *)new_task_log(task_top->state, (base_ptr + top + 1));
+            #pragma omp atomic
+            pending--;
 
-                    new_task_l->state[gMOAS->empty_sq[top + base_ptr]->row]
-                    [gMOAS->empty_sq[top + base_ptr]->col] =
-                        v_plays[top];
+            continue;
+        }
 
-                    #pragma omp task firstprivate(new_task_l)
-                    {
-                        solve_task_sudoku(new_task_l);
-                    }
+        #pragma omp atomic read
+        left = pending;
 
-                    new_task_l = NULL;
+        if (left == 0 || done()) {
+            break;
+        }
+        /* Let the busy threads run when there are more threads than cores */
+        sched_yield();
+    }
+    leave();
+}
 
-                    v_plays[top]++; /* always to next */
+/* Deals the subtrees of a checkpoint round robin over the deques */
+long resume_tasks(kd_checkpoint_t *c) {
+    task_log *task;
+    long count = 0;
 
-                    if (v_plays[top] > gMOAS->n) {
-                        /* Branch top down in the branch currenlty being explored in this
-                         * task. */
+    while (1) {
+        task = new_task_log(&workers[0]);
+        task->n_moves = kd_checkpoint_next(c, gMOAS->puzzle, task->moves);
+        if (task->n_moves < 0) {
+            free_task_log(&workers[0], task);
+            break;
+        }
+        if (!kd_deque_push(workers[count % n_workers].deque, task)) {
+            print_error("Deque overflow\n");
+        }
+        count++;
+    }
+    if (count != c->count) {
+        print_error("Checkpoint is missing subtrees\n");
+    }
+    return count;
+}
 
-                        task_top->state[gMOAS->empty_sq[top + base_ptr]->row]
-                        [gMOAS->empty_sq[top + base_ptr]->col] =
-                            task_l->state[gMOAS->empty_sq[top + base_ptr]->row]
-                            [gMOAS->empty_sq[top + base_ptr]->col];
+/* -b: reads the stream BATCH_CHUNK puzzles at a time and solves each chunk
+ * across the team, one puzzle per thread, printing in input order */
+void batch(kd_reader_t *in) {
+    kd_puzzle_t **chunk = (kd_puzzle_t **)calloc(BATCH_CHUNK,
+                          sizeof(kd_puzzle_t *));
+    int **cells = (int **)calloc(BATCH_CHUNK, sizeof(int *));
+    bool *solved = (bool *)calloc(BATCH_CHUNK, sizeof(bool));
+    long *counts = (long *)calloc(BATCH_CHUNK, sizeof(long));
+    long puzzles = 0, n_solved = 0, nodes = 0;
+    double start = omp_get_wtime();
+    int count, got = 1, i;
 
-                        top++;
-                    }
-                }
-            } else {
-                v_plays[top]++;
+    if (chunk == NULL || cells == NULL || solved == NULL || counts == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    while (got != 0) {
+        for (count = 0; count < BATCH_CHUNK; count++) {
+            got = kd_reader_next(in, &chunk[count]);
+            if (got == 0) {
+                break;
             }
         }
 
-        /* Check if next play is valid. */
-        if (safe(task_l->state, gMOAS->empty_sq[ptr + base_ptr], v_plays[ptr])) {
-            // print_branch(ptr+base_ptr, v_plays[ptr]);
-
-            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-            [gMOAS->empty_sq[ptr + base_ptr]->col] = v_plays[ptr];
-            v_plays[ptr]++; /* always to next */
-
-            if (v_plays[ptr] > gMOAS->n && ptr == top) {
-                task_top->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-                [gMOAS->empty_sq[ptr + base_ptr]->col] = v_plays[ptr];
-
-                top++;
+        #pragma omp parallel for schedule(dynamic) reduction(+:nodes)
+        for (i = 0; i < count; i++) {
+            long searched = 0;
+            if (chunk[i] != NULL && gOPTS.count > 0) {
+                counts[i] = kd_count(chunk[i], &gOPTS, &searched);
+                nodes += searched;
+            } else if (chunk[i] != NULL) {
+                cells[i] = (int *)malloc(chunk[i]->n * chunk[i]->n * sizeof(int));
+                solved[i] = cells[i] != NULL &&
+                            kd_solve(chunk[i], &gOPTS, cells[i], &searched);
+                nodes += searched;
             }
+        }
 
-            ptr++;
-            if (ptr < nplays) {
-                /* Branch down */
-
-                v_plays[ptr] = 1;
+        for (i = 0; i < count; i++) {
+            if (chunk[i] == NULL) {
+                puts("Invalid puzzle");
+            } else if (gOPTS.count > 0) {
+                kd_print_count(&gOPTS, counts[i]);
+                n_solved += counts[i] > 0;
+            } else if (solved[i]) {
+                kd_print_line(chunk[i]->n, cells[i]);
+                n_solved++;
             } else {
-                /* Has solved all :) */
-
-                #pragma omp critical
-                {
-                    if (gDONE == 0) {
-                        gDONE = 1;
-                        copy_to_gMOAS(task_l->state);
-                    }
-                }
-
-                free(task_l);
-                return;
+                puts("No solution");
             }
-        } else {
-            /* Branch sideways */
-            v_plays[ptr]++;
+            free(cells[i]);
+            cells[i] = NULL;
+            kd_free_puzzle(chunk[i]);
         }
+        puzzles += count;
     }
+    kd_print_batch(&gOPTS, puzzles, n_solved, nodes, omp_get_wtime() - start);
+    free(chunk);
+    free(cells);
+    free(solved);
+    free(counts);
+}
 
-    // printf("*** Task: b:%d s:%d a:%d DONE ***\n", base_ptr, nplays, aim_ptr);
-
-    // printf("Level: %d, Branchs:%d\n", task_l->level, cnt);
-    free(task_l);
-    free(task_top);
-    free(v_plays);
+void usage(const char *prog) {
+    char error[256];
+    snprintf(error, sizeof(error),
+             "Usage: %s " KD_OPTS_USAGE " [--checkpoint FILE [--every SECONDS]"
+             " [--resume]] filename [threads]\n"
+             "       %s -b [filename|- [threads]], stdin by default\n", prog, prog);
+    print_error(error);
+}
 
-    // printf("*** Task: b:%d DONE ***\n", base_ptr);
+int main(int argc, char *argv[]) {
+    int thread_count = 4;
+    int opt;
+    kd_checkpoint_t *resume = NULL;
+    long capacity = DEQUE_SIZE;
+    static const struct option long_opts[] = {
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"every", required_argument, NULL, 'E'},
+        {"resume", no_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
 
-    #pragma omp atomic
-    idle++;
+    kd_default_options(&gOPTS);
+    gCKPT.every = CHECKPOINT_EVERY;
+    while ((opt = getopt_long(argc, argv, KD_OPTS, long_opts, NULL)) != -1) {
+        if (opt == 'C') {
+            gCKPT.path = optarg;
+        } else if (opt == 'E') {
+            gCKPT.every = atof(optarg);
+            if (gCKPT.every <= 0) {
+                usage(argv[0]);
+            }
+        } else if (opt == 'U') {
+            gCKPT.resume = true;
+        } else if (!kd_parse_option(&gOPTS, opt, optarg)) {
+            usage(argv[0]);
+        }
+    }
+    if (gCKPT.resume && gCKPT.path == NULL) {
+        usage(argv[0]);
+    }
+    if (gCKPT.path != NULL && gOPTS.count > 0) {
+        /* Checkpoints do not hold the solutions counted so far */
+        print_error("Counting runs cannot be checkpointed\n");
+    }
 
-    return;
-}
+    if (gOPTS.batch) {
+        kd_reader_t *in = kd_open_reader(argc - optind >= 1 ? argv[optind] :
+                                         NULL);
+        if (in == NULL) {
+            print_error("Could not open file\n");
+        }
+        if (argc - optind >= 2) {
+            omp_set_num_threads(atoi(argv[optind + 1]));
+        }
+        batch(in);
+        kd_close_reader(in);
+        return 0;
+    }
 
-int main(int argc, char const *argv[]) {
-    task_log *orig_task_l;
-    int thread_count = 4;
+    if (gOPTS.engine != KD_ENGINE_MASK) {
+        print_error("Tasks split the mask search, -e dlx is serial only\n");
+    }
 
-    if (argc < N_ARGS) {
-        char error[64];
-        sprintf(error, "Usage: %s filename\n", argv[0]);
-        print_error(error);
-    } else if (argc == 3) {
-        thread_count = atoi(argv[2]);
+    if (argc - optind < N_ARGS - 1) {
+        usage(argv[0]);
+    } else if (argc - optind >= N_ARGS) {
+        thread_count = atoi(argv[optind + 1]);
     }
 
-    if (read_file(argv[1]) != 0) {
+    if (read_file(argv[optind]) != 0) {
         char error[64];
-        sprintf(error, "Unable to read file %s\n", argv[1]);
+        snprintf(error, sizeof(error), "Unable to read file %s\n", argv[optind]);
         print_error(error);
     }
 
     treshold = (int)(FRAC_THRES * (double)gMOAS->n_empty_sq);
-    idle = EXTRA_TASKS;
     omp_set_num_threads(thread_count);
 
+    if (gCKPT.resume) {
+        resume = kd_checkpoint_open(gCKPT.path, gMOAS->puzzle);
+        if (resume == NULL) {
+            print_error("Nothing to resume\n");
+        }
+        printf("Resuming %ld subtrees from %s\n", resume->count, gCKPT.path);
+        fflush(stdout);
+    }
+
     puts("~~~ Input Sudoku ~~~");
     print_grid(gMOAS->to_solve);
 
     // Solve the puzzle
-    orig_task_l = new_task_log(new_state_copy(gMOAS->to_solve), 0);
     double start = omp_get_wtime();
     #pragma omp parallel
     {
-        #pragma omp atomic
-        idle++;
-
         #pragma omp single
         {
-            idle--;
-            solve_task_sudoku(orig_task_l);
+            // The team may be smaller than asked, resume_tasks deals the
+            // subtrees over the threads it really has
+            if (resume != NULL) {
+                capacity += resume->count / omp_get_num_threads() + 1;
+            }
+            init_workers(omp_get_num_threads(), capacity);
+            if (resume != NULL) {
+                pending = resume_tasks(resume);
+            } else {
+                kd_deque_push(workers[0].deque, new_task_log(&workers[0]));
+                pending = 1;
+            }
+            gCKPT.present = n_workers;
+            gCKPT.next = omp_get_wtime() + gCKPT.every;
         }
 
-        #pragma omp taskwait
+        work(omp_get_thread_num());
     }
 
     double finish = omp_get_wtime();
-    if (gDONE) {
+    kd_checkpoint_close(resume);
+    if (gCKPT.path != NULL) {
+        /* Nothing left to resume */
+        remove(gCKPT.path);
+    }
+    if (gOPTS.count > 0) {
+        long count = 0;
+        for (int i = 0; i < n_workers; i++) {
+            count += workers[i].solutions;
+        }
+        if (count > 0) {
+            puts("~~~ First Solution ~~~");
+            print_grid(gMOAS->to_solve);
+        }
+        kd_print_count(&gOPTS, count);
+        if (gDONE) {
+            printf("Stopped %.6fs after reaching the limit\n",
+                   finish - solved_at);
+        }
+    } else if (gDONE) {
         puts("~~~ Output Sudoku ~~~");
         print_grid(gMOAS->to_solve);
         printf("Solved Sudoku\n");
+        printf("Stopped %.6fs after the solution\n", finish - solved_at);
         // Solution found
     } else {
         printf("Did not solve Sudoku\n");
         // No solution
     };
 
+    for (int i = 0; i < n_workers; i++) {
+        printf("Thread %d: %ld tasks, %ld spawned, %ld stolen, %ld nodes", i,
+               workers[i].tasks, workers[i].spawned, workers[i].stolen,
+               workers[i].search->nodes);
+        if (gOPTS.count > 0) {
+            printf(", %ld solutions", workers[i].solutions);
+        }
+        printf("\n");
+        gNODES += workers[i].search->nodes;
+    }
+    kd_print_nodes(&gOPTS, gNODES);
+    free_workers();
     free_gMOAS();
     printf("%lf\n", (finish - start));
     return 0;
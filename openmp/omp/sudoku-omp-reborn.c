@@ -8,9 +8,12 @@
 #include <string.h>
 #include <time.h>
 
+#include "kuduro.h"
+
 #define N_ARGS 2
 #define EMPTY 0
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#define TASK_SLAB 64
 //#define SERIAL
 
 #ifndef SERIAL
@@ -27,9 +30,11 @@ typedef struct square_struct {
     int_fast8_t row;
     int_fast8_t col;
     int_fast8_t box;
+    int_fast32_t pos; /* row * n + col */
 } square;
 
-typedef uint_fast8_t **sudoku;
+/* Row-major n * n cells in one cache-aligned block */
+typedef kd_value_t *sudoku;
 
 // Mother of all sudokus
 typedef struct moas_t {
@@ -40,35 +45,50 @@ typedef struct moas_t {
     int_fast32_t n_empty_sq;
 } moas;
 
+/* A task is the values of empty_sq[0 .. next_ptr), replayed onto the board
+ * of the thread that runs it. The plays sit right after it in the same pool
+ * object. */
 typedef struct task_log_t {
-    sudoku state;
+    kd_value_t *plays;
     int next_ptr;
     int level;
     struct task_log_t *next;
 } task_log;
 
 int gDONE;
+double solved_at; /* when gDONE was raised */
 moas *gMOAS;
+sudoku board;
+/* Task logs and play stacks come from per-thread pools */
+kd_arena_t task_arena, plays_arena;
+kd_pool_t *task_pool, *plays_pool;
+#pragma omp threadprivate(board, task_pool, plays_pool)
 
 void print_error(char *error) {
     fprintf(stderr, error);
     exit(EXIT_FAILURE);
 }
 
+// Empty grid, padded to whole cache lines
+sudoku new_sudoku() {
+    size_t bytes = gMOAS->n * gMOAS->n * sizeof(kd_value_t);
+    sudoku new_state = (sudoku)aligned_alloc(
+                           KD_CACHE_LINE,
+                           (bytes + KD_CACHE_LINE - 1) / KD_CACHE_LINE * KD_CACHE_LINE);
+    if (new_state == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    return new_state;
+}
+
 int read_file(const char *filename) {
-    FILE *sudoku_file;
+    kd_puzzle_t *puzzle = kd_read_file(filename);
     int box_size;
     uint_fast32_t iter;
-    uint8_t num;
-
-    /* Opens file */
-    sudoku_file = fopen(filename, "r");
-    if (sudoku_file == NULL)
-        print_error("Could not open file\n");
 
-    /* Scans first line (aka the square size) */
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF)
-        print_error("Could not read file\n");
+    if (puzzle == NULL)
+        return 1;
+    box_size = puzzle->box_size;
 
     gMOAS = (moas *)malloc(sizeof(moas));
     if (gMOAS == NULL) {
@@ -77,28 +97,23 @@ int read_file(const char *filename) {
 
     gMOAS->box_size = box_size;
     gMOAS->n = box_size * box_size;
-
-    gMOAS->to_solve = (sudoku)malloc(gMOAS->n * sizeof(uint_fast8_t *));
-    for (int i = 0; i < gMOAS->n; i++) {
-        gMOAS->to_solve[i] =
-            (uint_fast8_t *)malloc(gMOAS->n * sizeof(uint_fast8_t));
+    if (gMOAS->n > KD_MAX_N) {
+        print_error("Sudoku too big, rebuild with a larger KD_MAX_N\n");
     }
 
-    /* Read the file */
-    iter = 0;
-    for (int i = 0; i < gMOAS->n; i++) {
-        for (int j = 0; j < gMOAS->n; j++) {
-            fscanf(sudoku_file, "%2" SCNu8, &num);
+    gMOAS->to_solve = new_sudoku();
 
-            gMOAS->to_solve[i][j] = num;
-            if (num == 0) {
-                iter++;
-            }
+    /* Copy the givens */
+    iter = 0;
+    for (int i = 0; i < gMOAS->n * gMOAS->n; i++) {
+        gMOAS->to_solve[i] = puzzle->known[i];
+        if (puzzle->known[i] == 0) {
+            iter++;
         }
     }
+    kd_free_puzzle(puzzle);
 
     if (iter == 0) {
-        fclose(sudoku_file);
         return 1;
     }
 
@@ -113,9 +128,10 @@ int read_file(const char *filename) {
     iter = 0;
     for (int i = 0; i < gMOAS->n; i++) {
         for (int j = 0; j < gMOAS->n; j++) {
-            if (gMOAS->to_solve[i][j] == 0) {
+            if (gMOAS->to_solve[i * gMOAS->n + j] == 0) {
                 gMOAS->empty_sq[iter]->row = i;
                 gMOAS->empty_sq[iter]->col = j;
+                gMOAS->empty_sq[iter]->pos = i * gMOAS->n + j;
                 gMOAS->empty_sq[iter]->box =
                     (i / gMOAS->box_size) * gMOAS->box_size + j / gMOAS->box_size;
 
@@ -124,23 +140,24 @@ int read_file(const char *filename) {
         }
     }
 
-    fclose(sudoku_file);
     return 0;
 }
 
 // Free sudoku typedef
 void free_sudoku(sudoku to_free) {
-    for (int i = 0; i < gMOAS->n; i++) {
-        free(to_free[i]);
-    }
     free(to_free);
 }
 
 // Free task log typedef
-void free_task_log(task_log *to_free) {
-    free(to_free->state);
+int done() {
+    int d;
+    #pragma omp atomic read
+    d = gDONE;
+    return d;
+}
 
-    free(to_free);
+void free_task_log(task_log *to_free) {
+    kd_pool_free(task_pool, to_free);
 }
 
 // Free global MOAS
@@ -158,7 +175,7 @@ void free_gMOAS() {
 void print_grid(sudoku to_print) {
     for (int row = 0; row < gMOAS->n; row++) {
         for (int col = 0; col < gMOAS->n; col++) {
-            printf("%2d ", to_print[row][col]);
+            printf("%2d ", to_print[row * gMOAS->n + col]);
         }
         printf("\n");
     }
@@ -169,15 +186,18 @@ void print_grid(sudoku to_print) {
 bool safe(sudoku to_check, square *to_test, uint_fast8_t num,
           uint_fast8_t *row_start, uint_fast8_t *col_start) {
 
+    const kd_value_t *row = to_check + to_test->row * gMOAS->n;
+    const kd_value_t *box = to_check + *row_start * gMOAS->n + *col_start;
+
     for (uint_fast8_t i = 0; i < gMOAS->n; i++) {
-        if (to_check[i][to_test->col] == num || to_check[to_test->row][i] == num) {
+        if (to_check[i * gMOAS->n + to_test->col] == num || row[i] == num) {
             return false;
         }
     }
 
     for (uint_fast8_t i = 0; i < gMOAS->box_size; i++)
         for (uint_fast8_t j = 0; j < gMOAS->box_size; j++)
-            if (to_check[i + *row_start][j + *col_start] == num) {
+            if (box[i * gMOAS->n + j] == num) {
                 return false;
             }
 
@@ -186,24 +206,41 @@ bool safe(sudoku to_check, square *to_test, uint_fast8_t num,
 
 void copy_to_gMOAS(sudoku solved) {
     for (int i = 0; i < gMOAS->n_empty_sq; i++) {
-        gMOAS->to_solve[gMOAS->empty_sq[i]->row][gMOAS->empty_sq[i]->col] =
-            solved[gMOAS->empty_sq[i]->row][gMOAS->empty_sq[i]->col];
+        gMOAS->to_solve[gMOAS->empty_sq[i]->pos] =
+            solved[gMOAS->empty_sq[i]->pos];
     }
 }
 
 sudoku new_state_copy(sudoku old_state) {
-    sudoku new_state = (sudoku)malloc(gMOAS->n * sizeof(uint_fast8_t *));
-    for (int_fast32_t i = 0; i < gMOAS->n; i++) {
-        new_state[i] = (uint_fast8_t *)malloc(gMOAS->n * sizeof(uint_fast8_t));
-        memcpy(new_state[i], old_state[i], gMOAS->n * sizeof(uint_fast8_t));
-    }
+    sudoku new_state = new_sudoku();
+    memcpy(new_state, old_state, gMOAS->n * gMOAS->n * sizeof(kd_value_t));
     return new_state;
 }
 
-task_log *new_task_log(sudoku old_state, int next_ptr, int level) {
-    task_log *new = (task_log *)malloc(sizeof(task_log));
+// The thread's pools, made on its first allocation
+void init_pools() {
+    if (task_pool == NULL) {
+        task_pool = kd_new_pool(&task_arena);
+        plays_pool = kd_new_pool(&plays_arena);
+        if (task_pool == NULL || plays_pool == NULL) {
+            print_error("Could not allocate space\n");
+        }
+    }
+}
 
-    new->state = new_state_copy(old_state);
+// Task for the subtree below the first next_ptr plays of state
+task_log *new_task_log(sudoku state, int next_ptr, int level) {
+    task_log *new;
+
+    init_pools();
+    new = (task_log *)kd_pool_alloc(task_pool);
+    if (new == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    new->plays = (kd_value_t *)(new + 1);
+    for (int i = 0; i < next_ptr; i++) {
+        new->plays[i] = state[gMOAS->empty_sq[i]->pos];
+    }
     new->next_ptr = next_ptr;
     new->level = level;
     new->next = NULL;
@@ -211,6 +248,35 @@ task_log *new_task_log(sudoku old_state, int next_ptr, int level) {
     return new;
 }
 
+// Puts the plays of a task on the thread's board, the rest left empty
+void load_task(task_log *task_l) {
+    int i;
+
+    if (board == NULL) {
+        board = new_state_copy(gMOAS->to_solve);
+    }
+    for (i = 0; i < task_l->next_ptr; i++) {
+        board[gMOAS->empty_sq[i]->pos] = task_l->plays[i];
+    }
+    for (; i < gMOAS->n_empty_sq; i++) {
+        board[gMOAS->empty_sq[i]->pos] = 0;
+    }
+}
+
+/* Spawning a task may run other tasks on this thread right away, puts back
+ * the plays of the task and the n_plays made on top of them */
+void restore_task(task_log *task_l, uint_fast8_t *v_plays, int n_plays) {
+    int i, base_ptr = task_l->next_ptr;
+
+    for (i = 0; i < base_ptr; i++) {
+        board[gMOAS->empty_sq[i]->pos] = task_l->plays[i];
+    }
+    for (i = 0; i < n_plays; i++) {
+        /* v_plays was moved past the value played */
+        board[gMOAS->empty_sq[base_ptr + i]->pos] = v_plays[i] - 1;
+    }
+}
+
 void print_branch(int level, int try) {
     int i;
 
@@ -237,19 +303,24 @@ void solve_task_sudoku(task_log *task_l) {
     int_fast32_t ptr, base_ptr;
     int_fast32_t cnt = 0;
 
-    if (gDONE) {
-        free(task_l);
+    if (done()) {
+        free_task_log(task_l);
 
         return;
     }
 
     base_ptr = task_l->next_ptr;
+    load_task(task_l);
 
     nplays = steps[task_l->level];
 
     // printf("*** Task: b:%d s:%d a:%d INIT ***\n", base_ptr, nplays, aim_ptr);
 
-    v_plays = (uint_fast8_t *)malloc(nplays * sizeof(uint_fast8_t));
+    init_pools();
+    v_plays = (uint_fast8_t *)kd_pool_alloc(plays_pool);
+    if (v_plays == NULL) {
+        print_error("Could not allocate space\n");
+    }
 
     ptr = 0;
     v_plays[0] = 1;
@@ -257,8 +328,9 @@ void solve_task_sudoku(task_log *task_l) {
     while (1) {
         /* This square is empty. */
 
-        if (gDONE) {
-            free(task_l);
+        if (done()) {
+            free_task_log(task_l);
+            kd_pool_free(plays_pool, v_plays);
             return;
         }
 
@@ -272,8 +344,7 @@ void solve_task_sudoku(task_log *task_l) {
 
             /* Backtrack */
             ptr--;
-            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-            [gMOAS->empty_sq[ptr + base_ptr]->col] = 0;
+            board[gMOAS->empty_sq[ptr + base_ptr]->pos] = 0;
 
             continue;
         }
@@ -285,13 +356,12 @@ void solve_task_sudoku(task_log *task_l) {
             gMOAS->empty_sq[ptr + base_ptr]->col -
             gMOAS->empty_sq[ptr + base_ptr]->col % gMOAS->box_size;
         /* Check if next play is valid. */
-        if (safe(task_l->state, gMOAS->empty_sq[ptr + base_ptr], v_plays[ptr],
+        if (safe(board, gMOAS->empty_sq[ptr + base_ptr], v_plays[ptr],
                  &row_start, &col_start)) {
 
             // print_branch(ptr+base_ptr, v_plays[ptr]);
 
-            task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-            [gMOAS->empty_sq[ptr + base_ptr]->col] = v_plays[ptr];
+            board[gMOAS->empty_sq[ptr + base_ptr]->pos] = v_plays[ptr];
             v_plays[ptr]++; /* always to next */
 
             ptr++;
@@ -304,13 +374,16 @@ void solve_task_sudoku(task_log *task_l) {
 
                 #pragma omp critical
                 {
-                    if (gDONE == 0) {
+                    if (!done()) {
+                        copy_to_gMOAS(board);
+                        solved_at = omp_get_wtime();
+                        #pragma omp atomic write
                         gDONE = 1;
-                        copy_to_gMOAS(task_l->state);
                     }
                 }
 
-                free(task_l);
+                free_task_log(task_l);
+                kd_pool_free(plays_pool, v_plays);
                 return;
             } else {
                 /* Fork */
@@ -318,7 +391,7 @@ void solve_task_sudoku(task_log *task_l) {
                 cnt++;
                 /* Create new task */
                 new_task_l = (task_log *)new_task_log(
-                                 task_l->state, (base_ptr + nplays), (task_l->level + 1));
+                                 board, (base_ptr + nplays), (task_l->level + 1));
 
                 #pragma omp task firstprivate(new_task_l)
                 {
@@ -326,11 +399,11 @@ void solve_task_sudoku(task_log *task_l) {
                 }
 
                 new_task_l = NULL;
+                restore_task(task_l, v_plays, nplays);
 
                 /* Backtrack */
                 ptr--;
-                task_l->state[gMOAS->empty_sq[ptr + base_ptr]->row]
-                [gMOAS->empty_sq[ptr + base_ptr]->col] = 0;
+                board[gMOAS->empty_sq[ptr + base_ptr]->pos] = 0;
             }
         } else {
             /* Branch sideways */
@@ -342,8 +415,8 @@ void solve_task_sudoku(task_log *task_l) {
     // printf("*** Task: b:%d s:%d a:%d DONE ***\n", base_ptr, nplays, aim_ptr);
 
     // printf("Level: %d, Branchs:%d\n", task_l->level, cnt);
-    free(task_l);
-    free(v_plays);
+    free_task_log(task_l);
+    kd_pool_free(plays_pool, v_plays);
 
     return;
 }
@@ -397,9 +470,13 @@ int main(int argc, char const *argv[]) {
     print_grid(gMOAS->to_solve);
 
     create_steps();
+    kd_init_arena(&task_arena, sizeof(task_log) +
+                  (gMOAS->n_empty_sq + 1) * sizeof(kd_value_t), TASK_SLAB);
+    kd_init_arena(&plays_arena, gMOAS->n_empty_sq * sizeof(uint_fast8_t),
+                  TASK_SLAB);
 
     // Solve the puzzle
-    orig_task_l = new_task_log(new_state_copy(gMOAS->to_solve), 0, 0);
+    orig_task_l = new_task_log(gMOAS->to_solve, 0, 0);
     double start = omp_get_wtime();
     #pragma omp parallel
     {
@@ -407,18 +484,26 @@ int main(int argc, char const *argv[]) {
         solve_task_sudoku(orig_task_l);
 
         #pragma omp taskwait
+
+        if (board != NULL) {
+            free_sudoku(board);
+            board = NULL;
+        }
     }
     double finish = omp_get_wtime();
     if (gDONE) {
         puts("~~~ Output Sudoku ~~~");
         print_grid(gMOAS->to_solve);
         printf("Solved Sudoku\n");
+        printf("Stopped %.6fs after the solution\n", finish - solved_at);
         // Solution found
     } else {
         printf("Did not solve Sudoku\n");
         // No solution
     };
 
+    kd_free_arena(&task_arena);
+    kd_free_arena(&plays_arena);
     free_gMOAS();
     printf("%lf\n", (finish - start));
     return 0;
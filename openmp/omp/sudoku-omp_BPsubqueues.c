@@ -9,26 +9,33 @@
 #include <string.h>
 #include <time.h>
 
+#include "kuduro.h"
+
 #define N_ARGS 2
 #define EMPTY 0
 #define MAX_LEVELS 30
+#define NODE_SLAB 64
 
 typedef struct square_struct {
     int_fast32_t row;
     int_fast32_t col;
     int_fast32_t box;
+    int_fast32_t pos; /* row * n + col */
 } square;
 
 typedef struct sudoku_struct {
     int_fast32_t n;
     int_fast32_t box_size;
-    uint_fast8_t **grid;
+    kd_value_t *grid; /* row-major, cell (i, j) at i * n + j */
     int_fast32_t n_plays;
     square **empty_sq;
 } sudoku;
 
+/* Subproblem: the values of empty_sq[0 .. next_ptr), replayed onto the
+ * board of the thread that takes it. The prefix sits right after it in the
+ * same pool object. */
 typedef struct node_struct {
-    sudoku *plays;
+    kd_value_t *prefix;
     struct node_struct *prev;
     int next_ptr;
 } node;
@@ -41,10 +48,36 @@ typedef struct queue_struct {
 
 sudoku *to_solve;
 queue *q;
+sudoku *board;
+/* Nodes, queues and play stacks come from per-thread pools */
+kd_arena_t node_arena, queue_arena, plays_arena;
+kd_pool_t *node_pool, *queue_pool, *plays_pool;
+#pragma omp threadprivate(board, node_pool, queue_pool, plays_pool)
+
+void print_error(char *error) {
+    fprintf(stderr, error);
+    exit(EXIT_FAILURE);
+}
+
+// The thread's pools, made on its first allocation
+void init_pools() {
+    if (node_pool == NULL) {
+        node_pool = kd_new_pool(&node_arena);
+        queue_pool = kd_new_pool(&queue_arena);
+        plays_pool = kd_new_pool(&plays_arena);
+        if (node_pool == NULL || queue_pool == NULL || plays_pool == NULL)
+            print_error("Could not allocate space\n");
+    }
+}
 
 queue *init_queue() {
 
-    queue *new_queue = (queue *)malloc(sizeof(queue));
+    queue *new_queue;
+
+    init_pools();
+    new_queue = (queue *)kd_pool_alloc(queue_pool);
+    if (new_queue == NULL)
+        print_error("Could not allocate space\n");
 
     new_queue->size = 0;
     new_queue->head = NULL;
@@ -81,21 +114,13 @@ int enqueue(node *item, queue *to_enqueue) {
     return true;
 }
 
-void print_error(char *error) {
-    fprintf(stderr, error);
-    exit(EXIT_FAILURE);
-}
-
 void free_sudoku(sudoku *plays) {
-    for (int i = 0; i < to_solve->n; i++) {
-        free(plays->grid[i]);
-    }
+    free(plays->grid);
     free(plays);
 }
 
 void free_node(node *item) {
-    free_sudoku(item->plays);
-    free(item);
+    kd_pool_free(node_pool, item);
 }
 
 void free_queue(queue *to_free) {
@@ -105,26 +130,25 @@ void free_queue(queue *to_free) {
         item = dequeue(to_free);
         free_node(item);
     }
-    free(to_free);
+    kd_pool_free(queue_pool, to_free);
 }
 
 sudoku *init_sudoku(int box_size) {
     sudoku *new_sudoku = (sudoku *)malloc(sizeof(sudoku));
+    size_t bytes;
 
     new_sudoku->box_size = box_size;
     new_sudoku->n = box_size * box_size;
     new_sudoku->n_plays = 0;
     new_sudoku->empty_sq = NULL;
 
-    // Allocate matrix
-    new_sudoku->grid = (uint8_t **)malloc(new_sudoku->n * sizeof(uint8_t *));
+    // Allocate matrix, padded to whole cache lines
+    bytes = new_sudoku->n * new_sudoku->n * sizeof(kd_value_t);
+    new_sudoku->grid = (kd_value_t *)aligned_alloc(
+                           KD_CACHE_LINE,
+                           (bytes + KD_CACHE_LINE - 1) / KD_CACHE_LINE * KD_CACHE_LINE);
     if (new_sudoku->grid == NULL)
         print_error("Could not allocate space\n");
-    for (int i = 0; i < new_sudoku->n; i++) {
-        new_sudoku->grid[i] = (uint8_t *)malloc(new_sudoku->n * sizeof(uint8_t));
-        if (new_sudoku->grid[i] == NULL)
-            print_error("Could not allocate space\n");
-    }
     return new_sudoku;
 }
 
@@ -132,7 +156,7 @@ sudoku *init_sudoku(int box_size) {
 void print_grid(sudoku *plays) {
     for (int row = 0; row < to_solve->n; row++) {
         for (int col = 0; col < to_solve->n; col++)
-            printf("%2d ", plays->grid[row][col]);
+            printf("%2d ", plays->grid[row * to_solve->n + col]);
         printf("\n");
     }
     printf("\n");
@@ -144,7 +168,8 @@ void print_queue(queue *to_print) {
     item = to_print->head;
     printf("Queue state\n");
     while (item != NULL) {
-        print_grid(item->plays);
+        for (int i = 0; i < item->next_ptr; i++)
+            printf("%d ", item->prefix[i]);
         item = item->prev;
         printf("\n");
     }
@@ -154,18 +179,22 @@ void print_queue(queue *to_print) {
 bool valid_in_box(sudoku *plays, int row, int col, int num) {
     uint8_t row_start = row - row % to_solve->box_size;
     uint8_t col_start = col - col % to_solve->box_size;
+    const kd_value_t *box =
+        plays->grid + row_start * to_solve->n + col_start;
 
     for (int i = 0; i < to_solve->box_size; i++)
         for (int j = 0; j < to_solve->box_size; j++)
-            if (plays->grid[i + row_start][j + col_start] == num) {
+            if (box[i * to_solve->n + j] == num) {
                 return false;
             }
     return true;
 }
 
 bool valid_in_row_and_col(sudoku *plays, int row, int col, int num) {
+    const kd_value_t *cells = plays->grid + row * to_solve->n;
+
     for (int i = 0; i < to_solve->n; i++) {
-        if (plays->grid[i][col] == num || plays->grid[row][i] == num) {
+        if (plays->grid[i * to_solve->n + col] == num || cells[i] == num) {
             return false;
         }
     }
@@ -184,29 +213,51 @@ bool safe_by_square(sudoku *plays, square *to_test, int num) {
 }
 
 void set_by_ptr(sudoku *plays, int ptr, uint_fast8_t val) {
-    plays->grid[to_solve->empty_sq[ptr]->row][to_solve->empty_sq[ptr]->col] = val;
+    plays->grid[to_solve->empty_sq[ptr]->pos] = val;
 }
 
 square *get_square_by_ptr(int ptr) {
     return to_solve->empty_sq[ptr];
 }
 
-node *create_node(sudoku *to_copy) {
+// Node holding the first next_ptr plays of from
+node *create_node(sudoku *from, int next_ptr) {
+
+    node *new_node;
 
-    node *new_node = (node *)malloc(sizeof(node));
+    init_pools();
+    new_node = (node *)kd_pool_alloc(node_pool);
+    if (new_node == NULL)
+        print_error("Could not allocate space\n");
 
     new_node->prev = NULL;
-    new_node->plays = init_sudoku(to_solve->box_size);
+    new_node->next_ptr = next_ptr;
+    new_node->prefix = (kd_value_t *)(new_node + 1);
 
-    for (int i = 0; i < to_solve->n; i++) {
-        for (int j = 0; j < to_solve->n; j++) {
-            (new_node->plays)->grid[i][j] = to_copy->grid[i][j];
-        }
+    for (int i = 0; i < next_ptr; i++) {
+        new_node->prefix[i] = from->grid[to_solve->empty_sq[i]->pos];
     }
 
     return new_node;
 }
 
+// Puts the plays of a node on the thread's board, the rest left empty
+void load_node(node *item) {
+    int i;
+
+    if (board == NULL) {
+        board = init_sudoku(to_solve->box_size);
+        memcpy(board->grid, to_solve->grid,
+               to_solve->n * to_solve->n * sizeof(kd_value_t));
+    }
+    for (i = 0; i < item->next_ptr; i++) {
+        set_by_ptr(board, i, item->prefix[i]);
+    }
+    for (; i < to_solve->n_plays; i++) {
+        set_by_ptr(board, i, 0);
+    }
+}
+
 void merge_queues(queue *src, queue *dest) {
 
     (dest->tail)->prev = src->head;
@@ -218,8 +269,8 @@ void merge_queues(queue *src, queue *dest) {
 void cpy_final_plays(sudoku *plays) {
 
     for (int i = 0; i < to_solve->n_plays; ++i) {
-        to_solve->grid[to_solve->empty_sq[i]->row][to_solve->empty_sq[i]->col] =
-            plays->grid[to_solve->empty_sq[i]->row][to_solve->empty_sq[i]->col];
+        to_solve->grid[to_solve->empty_sq[i]->pos] =
+            plays->grid[to_solve->empty_sq[i]->pos];
     }
     return;
 }
@@ -236,9 +287,9 @@ int solve() {
         for (int i = 1; i <= to_solve->n; i++) {
             if (safe_by_square(to_solve, get_square_by_ptr(0), i)) {
                 node *new_node;
-                new_node = create_node(to_solve);
+                new_node = create_node(to_solve, 0);
                 new_node->next_ptr = 1;
-                set_by_ptr(new_node->plays, 0, i);
+                new_node->prefix[0] = i;
                 #pragma omp critical
                 enqueue(new_node, q);
             }
@@ -259,16 +310,19 @@ int solve() {
                 q_node = dequeue(q);
             }
 
-            // print_grid(q_node->plays);
+            // print_grid(board);
 
             if (q_node != NULL) {
+                load_node(q_node);
 
                 int n_levels = (to_solve->n_plays - q_node->next_ptr > MAX_LEVELS)
                                ? MAX_LEVELS
                                : to_solve->n_plays - q_node->next_ptr;
                 queue *priv_q = init_queue();
                 int ptr = 0;
-                uint8_t *plays = (uint8_t *)malloc(n_levels * sizeof(uint8_t));
+                uint8_t *plays = (uint8_t *)kd_pool_alloc(plays_pool);
+                if (plays == NULL)
+                    print_error("Could not allocate space\n");
                 plays[0] = 1;
 
                 while (1) {
@@ -280,23 +334,23 @@ int solve() {
                                     #pragma omp critical
                                     merge_queues(priv_q, q);
                                 }
-                                free(priv_q);
+                                kd_pool_free(queue_pool, priv_q);
                                 break;
                             } else {
                                 // Backtrack
                                 plays[ptr] = 1;
                                 ptr--;
-                                set_by_ptr(q_node->plays, q_node->next_ptr, 0);
+                                set_by_ptr(board, q_node->next_ptr, 0);
                                 q_node->next_ptr--;
-                                set_by_ptr(q_node->plays, q_node->next_ptr, 0);
+                                set_by_ptr(board, q_node->next_ptr, 0);
                                 continue;
                             }
                         }
 
-                        if (safe_by_square(q_node->plays,
+                        if (safe_by_square(board,
                                            get_square_by_ptr(q_node->next_ptr),
                                            plays[ptr])) {
-                            set_by_ptr(q_node->plays, q_node->next_ptr, plays[ptr]);
+                            set_by_ptr(board, q_node->next_ptr, plays[ptr]);
 
                             plays[ptr]++;
 
@@ -304,10 +358,10 @@ int solve() {
                                 if (q_node->next_ptr == to_solve->n_plays - 1) {
                                     #pragma omp atomic
                                     finish++;
-                                    cpy_final_plays(q_node->plays);
+                                    cpy_final_plays(board);
                                 } else {
-                                    node *new_node = create_node(q_node->plays);
-                                    new_node->next_ptr = q_node->next_ptr + 1;
+                                    node *new_node =
+                                        create_node(board, q_node->next_ptr + 1);
                                     enqueue(new_node, priv_q);
                                 }
                             } else {
@@ -324,6 +378,7 @@ int solve() {
                         break;
                     }
                 }
+                kd_pool_free(plays_pool, plays);
                 free_node(q_node);
             }
         }
@@ -331,42 +386,34 @@ int solve() {
 
     #pragma omp taskwait
     free_queue(q);
+    if (board != NULL) {
+        free_sudoku(board);
+        board = NULL;
+    }
     if (finish)
         return true;
     return false;
 }
 
 int read_file(const char *filename) {
-    FILE *sudoku_file;
-    int box_size;
+    kd_puzzle_t *puzzle = kd_read_file(filename);
     uint_fast32_t iter;
-    uint8_t num;
 
-    // Opens file
-    sudoku_file = fopen(filename, "r");
-    if (sudoku_file == NULL)
-        print_error("Could not open file\n");
-
-    // Scans first line (aka the square size)
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF)
-        print_error("Could not read file\n");
-    to_solve = init_sudoku(box_size);
+    if (puzzle == NULL)
+        return 1;
+    to_solve = init_sudoku(puzzle->box_size);
 
-    // Read the file
+    // Copy the givens
     iter = 0;
-    for (int i = 0; i < to_solve->n; i++) {
-        for (int j = 0; j < to_solve->n; j++) {
-            fscanf(sudoku_file, "%2" SCNu8, &num);
-
-            to_solve->grid[i][j] = num;
-            if (num == 0) {
-                iter++;
-            }
+    for (int i = 0; i < to_solve->n * to_solve->n; i++) {
+        to_solve->grid[i] = puzzle->known[i];
+        if (puzzle->known[i] == 0) {
+            iter++;
         }
     }
+    kd_free_puzzle(puzzle);
 
     if (iter == 0) {
-        fclose(sudoku_file);
         return 1;
     }
 
@@ -381,9 +428,10 @@ int read_file(const char *filename) {
     iter = 0;
     for (int i = 0; i < to_solve->n; i++) {
         for (int j = 0; j < to_solve->n; j++) {
-            if (to_solve->grid[i][j] == 0) {
+            if (to_solve->grid[i * to_solve->n + j] == 0) {
                 to_solve->empty_sq[iter]->row = i;
                 to_solve->empty_sq[iter]->col = j;
+                to_solve->empty_sq[iter]->pos = i * to_solve->n + j;
                 to_solve->empty_sq[iter]->box =
                     (i / to_solve->box_size) * to_solve->box_size +
                     j / to_solve->box_size;
@@ -393,7 +441,6 @@ int read_file(const char *filename) {
         }
     }
 
-    fclose(sudoku_file);
     return 0;
 }
 
@@ -415,6 +462,10 @@ int main(int argc, char const *argv[]) {
         print_error(error);
     }
     omp_set_num_threads(thread_count);
+    kd_init_arena(&node_arena, sizeof(node) +
+                  (to_solve->n_plays + 1) * sizeof(kd_value_t), NODE_SLAB);
+    kd_init_arena(&queue_arena, sizeof(queue), NODE_SLAB);
+    kd_init_arena(&plays_arena, MAX_LEVELS, NODE_SLAB);
 
     print_grid(to_solve);
     printf("\n");
@@ -432,6 +483,9 @@ int main(int argc, char const *argv[]) {
         // No solution
     };
 
+    kd_free_arena(&node_arena);
+    kd_free_arena(&queue_arena);
+    kd_free_arena(&plays_arena);
     free_sudoku(to_solve);
     printf("%lf\n", (end - begin));
     return 0;
@@ -30,23 +30,29 @@
 #include <string.h>
 #include <time.h>
 
+#include "kuduro.h"
+
 #define N_ARGS 2
 #define EMPTY 0
+#define NODE_SLAB 64
 
 typedef struct square_struct {
     int_fast32_t row;
     int_fast32_t col;
     int_fast32_t box;
+    int_fast32_t pos; /* row * n + col */
 } square;
 
 typedef struct sudoku_struct {
     int_fast32_t n;
     int_fast32_t box_size;
-    uint_fast8_t **grid;
+    kd_value_t *grid; /* row-major, cell (i, j) at i * n + j */
     int_fast32_t n_plays;
     square **empty_sq;
 } sudoku;
 
+/* A node is one pool object: the node, its sudoku and then the n * n
+ * cells, starting on a cache line */
 typedef struct node_struct {
     sudoku *plays;
     struct node_struct *prev;
@@ -61,6 +67,9 @@ typedef struct queue_struct {
 
 sudoku *to_solve;
 queue *q;
+kd_arena_t node_arena;
+kd_pool_t *node_pool;
+#pragma omp threadprivate(node_pool)
 
 queue *init_queue() {
 
@@ -108,15 +117,12 @@ void print_error(char *error) {
 }
 
 void free_sudoku(sudoku *plays) {
-    for (int i = 0; i < to_solve->n; i++) {
-        free(plays->grid[i]);
-    }
+    free(plays->grid);
     free(plays);
 }
 
 void free_node(node *item) {
-    free_sudoku(item->plays);
-    free(item);
+    kd_pool_free(node_pool, item);
 }
 
 void free_queue() {
@@ -129,6 +135,12 @@ void free_queue() {
     free(q);
 }
 
+// Bytes of an n * n grid, rounded up to whole cache lines
+size_t grid_bytes(int n) {
+    size_t bytes = n * n * sizeof(kd_value_t);
+    return (bytes + KD_CACHE_LINE - 1) / KD_CACHE_LINE * KD_CACHE_LINE;
+}
+
 sudoku *init_sudoku(int box_size) {
     sudoku *new_sudoku = (sudoku *)malloc(sizeof(sudoku));
 
@@ -137,15 +149,11 @@ sudoku *init_sudoku(int box_size) {
     new_sudoku->n_plays = 0;
     new_sudoku->empty_sq = NULL;
 
-    // Allocate matrix
-    new_sudoku->grid = (uint8_t **)malloc(new_sudoku->n * sizeof(uint8_t *));
+    // Allocate matrix, padded to whole cache lines
+    new_sudoku->grid = (kd_value_t *)aligned_alloc(
+                           KD_CACHE_LINE, grid_bytes(new_sudoku->n));
     if (new_sudoku->grid == NULL)
         print_error("Could not allocate space\n");
-    for (int i = 0; i < new_sudoku->n; i++) {
-        new_sudoku->grid[i] = (uint8_t *)malloc(new_sudoku->n * sizeof(uint8_t));
-        if (new_sudoku->grid[i] == NULL)
-            print_error("Could not allocate space\n");
-    }
     return new_sudoku;
 }
 
@@ -153,7 +161,7 @@ sudoku *init_sudoku(int box_size) {
 void print_grid(sudoku *plays) {
     for (int row = 0; row < to_solve->n; row++) {
         for (int col = 0; col < to_solve->n; col++)
-            printf("%2d ", plays->grid[row][col]);
+            printf("%2d ", plays->grid[row * to_solve->n + col]);
         printf("\n");
     }
 }
@@ -174,18 +182,22 @@ void print_queue() {
 bool valid_in_box(sudoku *plays, int row, int col, int num) {
     uint8_t row_start = row - row % to_solve->box_size;
     uint8_t col_start = col - col % to_solve->box_size;
+    const kd_value_t *box =
+        plays->grid + row_start * to_solve->n + col_start;
 
     for (int i = 0; i < to_solve->box_size; i++)
         for (int j = 0; j < to_solve->box_size; j++)
-            if (plays->grid[i + row_start][j + col_start] == num) {
+            if (box[i * to_solve->n + j] == num) {
                 return false;
             }
     return true;
 }
 
 bool valid_in_row_and_col(sudoku *plays, int row, int col, int num) {
+    const kd_value_t *cells = plays->grid + row * to_solve->n;
+
     for (int i = 0; i < to_solve->n; i++) {
-        if (plays->grid[i][col] == num || plays->grid[row][i] == num) {
+        if (plays->grid[i * to_solve->n + col] == num || cells[i] == num) {
             return false;
         }
     }
@@ -204,7 +216,7 @@ bool safe_by_square(sudoku *plays, square *to_test, int num) {
 }
 
 void set_by_ptr(sudoku *plays, int ptr, uint_fast8_t val) {
-    plays->grid[to_solve->empty_sq[ptr]->row][to_solve->empty_sq[ptr]->col] = val;
+    plays->grid[to_solve->empty_sq[ptr]->pos] = val;
 }
 
 square *get_square_by_ptr(int ptr) {
@@ -213,16 +225,31 @@ square *get_square_by_ptr(int ptr) {
 
 node *create_node(sudoku *to_copy, int ptr) {
 
-    node *new_node = (node *)malloc(sizeof(node));
-
-    new_node->prev = NULL;
-    new_node->plays = init_sudoku(to_solve->box_size);
+    node *new_node;
+    uintptr_t cells;
 
-    for (int i = 0; i < to_solve->n; i++) {
-        for (int j = 0; j < to_solve->n; j++) {
-            (new_node->plays)->grid[i][j] = to_copy->grid[i][j];
-        }
+    // The thread's pool, made on its first node
+    if (node_pool == NULL) {
+        node_pool = kd_new_pool(&node_arena);
+        if (node_pool == NULL)
+            print_error("Could not allocate space\n");
     }
+    new_node = (node *)kd_pool_alloc(node_pool);
+    if (new_node == NULL)
+        print_error("Could not allocate space\n");
+
+    new_node->prev = NULL;
+    new_node->plays = (sudoku *)(new_node + 1);
+    new_node->plays->box_size = to_solve->box_size;
+    new_node->plays->n = to_solve->n;
+    new_node->plays->n_plays = 0;
+    new_node->plays->empty_sq = NULL;
+
+    cells = (uintptr_t)(new_node->plays + 1);
+    cells = (cells + KD_CACHE_LINE - 1) / KD_CACHE_LINE * KD_CACHE_LINE;
+    new_node->plays->grid = (kd_value_t *)cells;
+    memcpy(new_node->plays->grid, to_copy->grid,
+           to_solve->n * to_solve->n * sizeof(kd_value_t));
 
     new_node->next_ptr = ptr + 1;
 
@@ -232,8 +259,8 @@ node *create_node(sudoku *to_copy, int ptr) {
 void cpy_final_plays(sudoku *plays) {
 
     for (int i = 0; i < to_solve->n_plays; ++i) {
-        to_solve->grid[to_solve->empty_sq[i]->row][to_solve->empty_sq[i]->col] =
-            plays->grid[to_solve->empty_sq[i]->row][to_solve->empty_sq[i]->col];
+        to_solve->grid[to_solve->empty_sq[i]->pos] =
+            plays->grid[to_solve->empty_sq[i]->pos];
     }
     return;
 }
@@ -317,6 +344,7 @@ int solve() {
         }
     }
 
+    free_queue();
     if (finish) {
         return true;
     }
@@ -324,36 +352,24 @@ int solve() {
 }
 
 int read_file(const char *filename) {
-    FILE *sudoku_file;
-    int box_size;
+    kd_puzzle_t *puzzle = kd_read_file(filename);
     uint_fast32_t iter;
-    uint8_t num;
-
-    // Opens file
-    sudoku_file = fopen(filename, "r");
-    if (sudoku_file == NULL)
-        print_error("Could not open file\n");
 
-    // Scans first line (aka the square size)
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF)
-        print_error("Could not read file\n");
-    to_solve = init_sudoku(box_size);
+    if (puzzle == NULL)
+        return 1;
+    to_solve = init_sudoku(puzzle->box_size);
 
-    // Read the file
+    // Copy the givens
     iter = 0;
-    for (int i = 0; i < to_solve->n; i++) {
-        for (int j = 0; j < to_solve->n; j++) {
-            fscanf(sudoku_file, "%2" SCNu8, &num);
-
-            to_solve->grid[i][j] = num;
-            if (num == 0) {
-                iter++;
-            }
+    for (int i = 0; i < to_solve->n * to_solve->n; i++) {
+        to_solve->grid[i] = puzzle->known[i];
+        if (puzzle->known[i] == 0) {
+            iter++;
         }
     }
+    kd_free_puzzle(puzzle);
 
     if (iter == 0) {
-        fclose(sudoku_file);
         return 1;
     }
 
@@ -368,9 +384,10 @@ int read_file(const char *filename) {
     iter = 0;
     for (int i = 0; i < to_solve->n; i++) {
         for (int j = 0; j < to_solve->n; j++) {
-            if (to_solve->grid[i][j] == 0) {
+            if (to_solve->grid[i * to_solve->n + j] == 0) {
                 to_solve->empty_sq[iter]->row = i;
                 to_solve->empty_sq[iter]->col = j;
+                to_solve->empty_sq[iter]->pos = i * to_solve->n + j;
                 to_solve->empty_sq[iter]->box =
                     (i / to_solve->box_size) * to_solve->box_size +
                     j / to_solve->box_size;
@@ -380,7 +397,6 @@ int read_file(const char *filename) {
         }
     }
 
-    fclose(sudoku_file);
     return 0;
 }
 
@@ -403,6 +419,8 @@ int main(int argc, char const *argv[]) {
     }
 
     omp_set_num_threads(thread_count);
+    kd_init_arena(&node_arena, sizeof(node) + sizeof(sudoku) + KD_CACHE_LINE +
+                  grid_bytes(to_solve->n), NODE_SLAB);
     print_grid(to_solve);
     printf("\n");
 
@@ -419,6 +437,7 @@ int main(int argc, char const *argv[]) {
         // No solution
     };
 
+    kd_free_arena(&node_arena);
     free_sudoku(to_solve);
     printf("%f\n", (double)(end - begin));
     return 0;
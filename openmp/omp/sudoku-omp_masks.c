@@ -190,8 +190,18 @@ void print_mask(uint_fast8_t *mask) {
     printf("\n");
 }
 
+int done() {
+    int d;
+    #pragma omp atomic read
+    d = gDONE;
+    return d;
+}
+
 void solve(int id, uint_fast8_t *mask) {
     /* print_mask(c_Hack.mask); */
+    if (done()) {
+        return;
+    }
     for (int i = 1; i <= gMOAS->n; i++) {
         #pragma omp task firstprivate(i, id, mask) untied
         {
@@ -201,10 +211,16 @@ void solve(int id, uint_fast8_t *mask) {
                 memcpy(new_mask, mask, gMOAS->n_empty_sq * sizeof(uint_fast8_t));
                 new_mask[id] = i;
                 if (id == gMOAS->n_empty_sq - 1) {
-                    for (int j = 0; j < gMOAS->n_empty_sq; j++) {
-                        gMOAS->to_solve[gMOAS->empty_sqs[j]] = new_mask[j];
+                    #pragma omp critical
+                    {
+                        if (!done()) {
+                            for (int j = 0; j < gMOAS->n_empty_sq; j++) {
+                                gMOAS->to_solve[gMOAS->empty_sqs[j]] = new_mask[j];
+                            }
+                            #pragma omp atomic write
+                            gDONE = true;
+                        }
                     }
-                    gDONE = true;
                 } else {
                     solve(id + 1, new_mask);
                 }
@@ -143,8 +143,15 @@ bool safe(sudoku to_check, int id, int num) {
     return true;
 }
 
+int done() {
+    int d;
+    #pragma omp atomic read
+    d = gDONE;
+    return d;
+}
+
 void solve(int id, sudoku state) {
-    if (gDONE == true) {
+    if (done()) {
         return;
     }
     /* try each son solution */
@@ -157,11 +164,17 @@ void solve(int id, sudoku state) {
                 memcpy(new_state, state, gMOAS->n * gMOAS->n * sizeof(uint_fast8_t));
                 new_state[gMOAS->empty_sqs[id]] = i;
                 if (id == gMOAS->n_empty_sq - 1) {
-                    for (int j = 0; j < gMOAS->n_empty_sq; j++) {
-                        gMOAS->to_solve[gMOAS->empty_sqs[j]] =
-                        new_state[gMOAS->empty_sqs[j]];
+                    #pragma omp critical
+                    {
+                        if (!done()) {
+                            for (int j = 0; j < gMOAS->n_empty_sq; j++) {
+                                gMOAS->to_solve[gMOAS->empty_sqs[j]] =
+                                new_state[gMOAS->empty_sqs[j]];
+                            }
+                            #pragma omp atomic write
+                            gDONE = true;
+                        }
                     }
-                    gDONE = true;
                 } else {
                     solve(id + 1, new_state);
                 }
@@ -215,16 +215,32 @@ void copy_to_gMOAS(uint_fast8_t *mask) {
     }
 }
 
+int done() {
+    int d;
+    #pragma omp atomic read
+    d = gDONE;
+    return d;
+}
+
 void solve(int id, c_hack c_Hack) {
     /* print_mask(c_Hack.mask); */
+    if (done()) {
+        return;
+    }
     for (int i = 1; i <= gMOAS->n; i++) {
         #pragma omp task firstprivate(i, id, c_Hack) untied
         {
             if (safe(c_Hack.mask, id, i)) {
                 c_Hack.mask[id] = i;
                 if (id == gMOAS->n_empty_sq - 1) {
-                    copy_to_gMOAS(c_Hack.mask);
-                    gDONE = true;
+                    #pragma omp critical
+                    {
+                        if (!done()) {
+                            copy_to_gMOAS(c_Hack.mask);
+                            #pragma omp atomic write
+                            gDONE = true;
+                        }
+                    }
                 } else {
                     solve(id + 1, c_Hack);
                 }
@@ -7,263 +7,148 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-#define N_ARGS 2
-#define EMPTY 0
-
-typedef struct square_struct {
-    int_fast32_t row;
-    int_fast32_t col;
-    int_fast32_t box;
-} square;
+#include "kuduro.h"
 
-typedef struct sudoku_struct {
-    int_fast32_t n;
-    int_fast32_t box_size;
-    uint_fast8_t **grid;
-    int_fast32_t n_plays;
-    uint_fast8_t *plays;
-    square **empty_sq;
-} sudoku;
+#define N_ARGS 2
 
-sudoku *to_solve;
+kd_puzzle_t *puzzle;
+kd_search_t *search;
+kd_dlx_t *dlx;
 
 void print_error(char *error) {
-    fprintf(stderr, error);
+    fputs(error, stderr);
     exit(EXIT_FAILURE);
 }
 
-void free_sudoku(sudoku *to_free) {
-    for (int i = 0; i < to_free->n; i++) {
-        free(to_free->grid[i]);
-    }
-    free(to_free);
+void usage(const char *prog) {
+    char error[128];
+    snprintf(error, sizeof(error), "Usage: %s " KD_OPTS_USAGE " filename\n"
+             "       %s -b [filename], stdin by default\n", prog, prog);
+    print_error(error);
 }
 
-sudoku *init_sudoku(int box_size) {
-    sudoku *new_sudoku = (sudoku *)malloc(sizeof(sudoku));
-
-    new_sudoku->box_size = box_size;
-    new_sudoku->n = box_size * box_size;
-    new_sudoku->n_plays = 0;
-    new_sudoku->empty_sq = NULL;
-
-    // Allocate matrix
-    new_sudoku->grid = (uint8_t **)malloc(new_sudoku->n * sizeof(uint8_t *));
-    if (new_sudoku->grid == NULL)
-        print_error("Could not allocate space\n");
-    for (int i = 0; i < new_sudoku->n; i++) {
-        new_sudoku->grid[i] = (uint8_t *)malloc(new_sudoku->n * sizeof(uint8_t));
-        if (new_sudoku->grid[i] == NULL)
-            print_error("Could not allocate space\n");
-    }
-    return new_sudoku;
-}
-
-// Print grid
-void print_grid() {
-    for (int row = 0; row < to_solve->n; row++) {
-        for (int col = 0; col < to_solve->n; col++)
-            printf("%2d ", to_solve->grid[row][col]);
-        printf("\n");
+int solve() {
+    if (dlx != NULL) {
+        return kd_dlx_run(dlx, 0) == KD_SOLVED;
     }
+    /* The search keeps the history of previous plays (for backtracking) */
+    return kd_search_run(search, 0) == KD_SOLVED;
 }
 
-// Check box
-bool valid_in_box(int row, int col, int num) {
-    uint8_t row_start = row - row % to_solve->box_size;
-    uint8_t col_start = col - col % to_solve->box_size;
-
-    for (int i = 0; i < to_solve->box_size; i++)
-        for (int j = 0; j < to_solve->box_size; j++)
-            if (to_solve->grid[i + row_start][j + col_start] == num) {
-                return false;
-            }
-    return true;
-}
+/* -c, -u: solves again from each solution until limit of them, prints the
+ * first one */
+long count_solutions(kd_board_t *board, long limit) {
+    long count = 0;
 
-bool valid_in_row_and_col(int row, int col, int num) {
-    for (int i = 0; i < to_solve->n; i++) {
-        if (to_solve->grid[i][col] == num || to_solve->grid[row][i] == num) {
-            return false;
+    while (count < limit && solve()) {
+        if (++count == 1) {
+            kd_print_board(board);
         }
     }
-    return true;
-}
-
-// Check if it is safe to put number in position
-bool safe(int row, int col, int num) {
-    return valid_in_box(row, col, num) && valid_in_row_and_col(row, col, num);
+    return count;
 }
 
-bool safe_by_square(square *to_test, int num) {
-    return valid_in_box(to_test->row, to_test->col, num) &&
-           valid_in_row_and_col(to_test->row, to_test->col, num);
-}
-
-void set_by_ptr(int ptr, uint_fast8_t val) {
-    to_solve->grid[to_solve->empty_sq[ptr]->row][to_solve->empty_sq[ptr]->col] =
-        val;
-}
-
-square *get_square_by_ptr(int ptr) {
-    return to_solve->empty_sq[ptr];
-}
-
-uint_fast8_t get_candidate(int ptr) {
-    return to_solve->plays[ptr];
-}
-
-void set_candidate(int ptr, int val) {
-    to_solve->plays[ptr] = val;
-}
-
-void increment_candidate(int ptr) {
-    to_solve->plays[ptr]++;
-}
-
-int solve() {
-    int ptr;
-
-    /* Array to keep history of previous plays (for backtracking) */
-    /* One for each empty square of the initial sudoku */
-    uint8_t *plays = to_solve->plays;
-
-    /* Next play to try. */
-    ptr = 0;
-    plays[0] = 1;
-
-    while (1) {
-        /* This square is empty. */
-        /*
-        printf("r: %ld ; c: %ld ; b: %ld ; play: %2" SCNu8 "\n",
-          to_solve->empty_sq[ptr].row, to_solve->empty_sq[ptr].col,
-          to_solve->empty_sq[ptr].box, plays[ptr]);
-        */
-
-        /* Check if branch options are emptied. */
-        if (plays[ptr] > to_solve->n) {
-            if (ptr == 0) {
-                /* No solution */
+/* -b: solves the puzzles of the stream one after the other */
+void batch(kd_reader_t *in, const kd_options_t *opts) {
+    clock_t begin = clock();
+    long puzzles = 0, solved = 0, nodes, total = 0;
+    int *cells, got;
 
-                free(plays);
-                return 0;
-            }
-            /* Backtrack */
-            ptr--;
-
-            set_by_ptr(ptr, 0);
+    while ((got = kd_reader_next(in, &puzzle)) != 0) {
+        puzzles++;
+        if (got < 0) {
+            puts("Invalid puzzle");
             continue;
         }
-
-        /* Check if next play is valid. */
-        if (safe_by_square(get_square_by_ptr(ptr), get_candidate(ptr))) {
-            set_by_ptr(ptr, get_candidate(ptr));
-            plays[ptr]++; /* always to next */
-
-            ptr++;
-            if (ptr < to_solve->n_plays) {
-                /* Branch */
-                set_candidate(ptr, 1);
-            } else {
-                /* Puzzle solved */
-                free(plays);
-                return 1;
-            }
+        cells = (int *)malloc(puzzle->n * puzzle->n * sizeof(int));
+        if (cells == NULL) {
+            print_error("Could not allocate space\n");
+        }
+        if (opts->count > 0) {
+            long count = kd_count(puzzle, opts, &nodes);
+            kd_print_count(opts, count);
+            solved += count > 0;
+        } else if (kd_solve(puzzle, opts, cells, &nodes)) {
+            kd_print_line(puzzle->n, cells);
+            solved++;
         } else {
-            /* Try again*/
-            increment_candidate(ptr);
+            puts("No solution");
         }
+        total += nodes;
+        free(cells);
+        kd_free_puzzle(puzzle);
     }
+    kd_print_batch(opts, puzzles, solved, total,
+                   (double)(clock() - begin) / CLOCKS_PER_SEC);
 }
 
-int read_file(const char *filename) {
-    FILE *sudoku_file;
-    int box_size;
-    uint_fast32_t iter;
-    uint8_t num;
+int main(int argc, char *argv[]) {
 
-    // Opens file
-    sudoku_file = fopen(filename, "r");
-    if (sudoku_file == NULL)
-        print_error("Could not open file\n");
-
-    // Scans first line (aka the square size)
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF)
-        print_error("Could not read file\n");
-    to_solve = init_sudoku(box_size);
-
-    // Read the file
-    iter = 0;
-    for (int i = 0; i < to_solve->n; i++) {
-        for (int j = 0; j < to_solve->n; j++) {
-            fscanf(sudoku_file, "%2" SCNu8, &num);
-
-            to_solve->grid[i][j] = num;
-            if (num == 0) {
-                iter++;
-            }
+    clock_t begin, end;
+    kd_options_t opts;
+    kd_board_t *board;
+    int opt;
+
+    kd_default_options(&opts);
+    while ((opt = getopt(argc, argv, KD_OPTS)) != -1) {
+        if (!kd_parse_option(&opts, opt, optarg)) {
+            usage(argv[0]);
         }
     }
 
-    if (iter == 0) {
-        fclose(sudoku_file);
-        return 1;
-    }
-
-    // Create aux array of empty squares
-    to_solve->n_plays = iter;
-    to_solve->empty_sq = (square **)malloc(iter * sizeof(square *));
-
-    for (uint_fast32_t i = 0; i < iter; i++) {
-        to_solve->empty_sq[i] = (square *)malloc(iter * sizeof(square));
-    }
-
-    to_solve->plays = (uint8_t *)malloc(to_solve->n_plays * sizeof(uint8_t));
-
-    iter = 0;
-    for (int i = 0; i < to_solve->n; i++) {
-        for (int j = 0; j < to_solve->n; j++) {
-            if (to_solve->grid[i][j] == 0) {
-                to_solve->empty_sq[iter]->row = i;
-                to_solve->empty_sq[iter]->col = j;
-                to_solve->empty_sq[iter]->box =
-                    (i / to_solve->box_size) * to_solve->box_size +
-                    j / to_solve->box_size;
-
-                iter++;
-            }
+    if (opts.batch) {
+        kd_reader_t *in = kd_open_reader(optind < argc ? argv[optind] : NULL);
+        if (in == NULL) {
+            print_error("Could not open file\n");
         }
+        batch(in, &opts);
+        kd_close_reader(in);
+        return 0;
     }
 
-    fclose(sudoku_file);
-    return 0;
-}
-
-int main(int argc, char const *argv[]) {
-
-    clock_t begin, end;
-
-    if (argc < N_ARGS) {
-        char error[64];
-        sprintf(error, "Usage: %s filename\n", argv[0]);
-        print_error(error);
+    if (argc - optind < N_ARGS - 1) {
+        usage(argv[0]);
     }
 
-    if (read_file(argv[1]) != 0) {
+    puzzle = kd_read_file(argv[optind]);
+    if (puzzle == NULL) {
         char error[64];
-        sprintf(error, "Unable to read file %s\n", argv[1]);
+        snprintf(error, sizeof(error), "Unable to read file %s\n", argv[optind]);
         print_error(error);
     }
 
-    print_grid();
-    printf("\n");
+    // The givens, the engines propagate them as they are built
+    board = kd_new_board(puzzle);
+    if (board == NULL) {
+        print_error("Could not allocate space\n");
+    }
+    kd_print_board(board);
+    kd_free_board(board);
 
     begin = clock();
-    // Solve the puzzle
-    if (solve()) {
+    if (opts.engine == KD_ENGINE_DLX) {
+        dlx = kd_new_dlx(puzzle);
+        if (dlx == NULL) {
+            print_error("Could not allocate space\n");
+        }
+        board = dlx->board;
+    } else {
+        search = kd_new_search(puzzle, &opts);
+        if (search == NULL) {
+            print_error("Could not allocate space\n");
+        }
+        board = search->board;
+    }
+    // Solve the puzzle, or count its solutions
+    if (opts.count > 0) {
+        long count = count_solutions(board, opts.count);
+        end = clock();
+        kd_print_count(&opts, count);
+    } else if (solve()) {
         end = clock();
-        print_grid();
+        kd_print_board(board);
         printf("Solved Sudoku\n");
         // Solution found
     } else {
@@ -272,7 +157,10 @@ int main(int argc, char const *argv[]) {
         // No solution
     };
 
-    free_sudoku(to_solve);
+    kd_print_nodes(&opts, dlx != NULL ? dlx->nodes : search->nodes);
+    kd_free_dlx(dlx);
+    kd_free_search(search);
+    kd_free_puzzle(puzzle);
     printf("%f\n", (double)(end - begin) / CLOCKS_PER_SEC);
     return 0;
 }
@@ -1,781 +1,2065 @@
 #include <assert.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <mpi.h>
+#include <omp.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define REDIST_OFF
+#include "kuduro.h"
 
 #define INIT_BUFF 3
 #define WORK_TRESH 1
-
-enum tags { DIE_TAG = 1, RED_TAG, WORK_TAG, NO_WORK_TAG, SOLUTION_TAG };
-enum slave_st { IDLE = 100, WORKING, REQUEST };
-
-typedef unsigned __int128 uint128_t;
-
-typedef struct info {
-    int x;
-    int y;
-    int v;
-} info_t;
-
-typedef struct mask {
-    __uint128_t *rows;
-    __uint128_t *cols;
-    __uint128_t *squares;
-    __uint128_t *bits;
-    info_t *history;
-    int history_len;
-    int **grid;
-} mask_t;
+#define SPLIT_LEFT 5 /* times box_size */
+#define QUANTUM_MAX (1L << 16) /* search nodes between polls */
+#define DEQUE_SIZE 64
+#define DEQUE_SLACK 2
+#define WORK_SLAB 64
+#define POOL_SLOTS 16
+#define POOL_SLACK 2
+#define CHECKPOINT_EVERY 60.0
+#define BATCH_CHUNK 256 /* puzzles per slave in each round */
+
+enum tags {
+    DIE_TAG = 1,
+    STEAL_TAG,
+    WORK_TAG,
+    NO_WORK_TAG,
+    SOLUTION_TAG,
+    TOKEN_TAG,
+    CHECKPOINT_TAG,
+    COUNT_TAG
+};
+enum colors { WHITE = 0, BLACK };
 
 typedef struct moas {
     int n;
     int box_size;
     int n_empty;
-    int **known;
-    mask_t *mask;
+    int *known;
+    kd_puzzle_t *puzzle;
+    kd_search_t *search;
 } moas_t;
 
+/* On slaves the moves are laid out right after it in the same pool object */
 typedef struct work_type {
-    info_t *history;
+    kd_move_t *history;
     int history_len;
 } work_t;
 
+/* Threads of a rank share its work like the OpenMP solver does: each one
+ * pops from its own deque and steals from the others. Thread 0 is also the
+ * only one that talks to the other ranks. */
+typedef struct worker {
+    _Alignas(KD_CACHE_LINE) kd_deque_t *deque;
+    kd_search_t *search;
+    kd_pool_t *pool; /* its work, thieves free it back into it */
+    long tasks;   /* pieces of work searched */
+    long spawned; /* pieces pushed on its deque */
+    long stolen;  /* pieces taken from other deques */
+    long solutions; /* found by it, -c and -u */
+    bool busy;    /* its search holds part of a piece */
+} worker_t;
+
+/* A piece of work goes out as one message of bytes: the cell positions
+ * of its moves, then their values */
+#if KD_MAX_N * KD_MAX_N <= UINT16_MAX
+typedef uint16_t wire_pos_t;
+#else
+typedef uint32_t wire_pos_t;
+#endif
+#define MOVE_BYTES ((int)(sizeof(wire_pos_t) + sizeof(kd_value_t)))
+
+/* Work sent and maybe not received yet. The block is sized for the longest
+ * history and goes back to the spares once the send completes. */
+typedef struct outbox {
+    MPI_Request req;
+    uint8_t *block;
+    struct outbox *next;
+} outbox_t;
+
+/* Dijkstra-Safra termination detection. Pieces of work are the basic
+ * messages: count is how many this rank sent minus how many it received,
+ * and receiving one turns it black. Rank 0 declares the end when the token
+ * comes back white with the counts of every rank adding up to zero. */
+typedef struct safra {
+    long count;
+    int color;
+    bool has_token;
+    long token_count;
+    int token_color;
+} safra_t;
+
+/* What a rank knows of the colony */
+typedef struct self {
+    int id;
+    int ntasks;
+    unsigned seed;
+    work_t **stack; /* work waiting to be searched */
+    int top;
+    int size;
+    int victim;    /* rank asked for work, -1 if none */
+    long requests; /* steal requests sent */
+    long answered; /* steal requests answered */
+    long stolen;
+    long given;
+    outbox_t *outbox; /* sends in flight */
+    outbox_t *spare;  /* sends completed, blocks ready for reuse */
+    uint8_t *inbox;   /* every piece of work is received here */
+    kd_pool_t *pool;  /* work of thread 0 */
+    MPI_Request *dies; /* DIE_TAG sends of rank 0 */
+    bool died;        /* DIE_TAG was received */
+    bool frozen;      /* taking a checkpoint, steals are refused */
+    long tail;        /* pieces put in the RMA pool of this rank */
+    uint8_t *slot;    /* one piece of the RMA pool on its way */
+    long quantum;     /* search nodes between polls */
+    long solutions;   /* found on this rank, -c and -u */
+    long counted;     /* on rank 0, solutions reported by the slaves */
+    double search_time;
+    double mpi_time;  /* polling, answering and sending */
+    double idle_time; /* blocked waiting for messages */
+    safra_t safra;
+} self_t;
+
+/* Work stealing, off unless --redistribute */
+typedef struct redist {
+    bool on;
+    bool rma;       /* through the RMA pools instead of steal requests */
+    int work_tresh; /* ask for work while holding fewer pieces than this */
+    int split_left; /* only split off branches with this many cells left */
+} redist_t;
+
+/* Checkpoints (--checkpoint FILE). Every `every` seconds rank 0 has the
+ * colony take one: each rank parks its other threads, refuses steals and
+ * answers until no work is in flight anywhere, then packs what it holds in
+ * the deal layout and rank 0 gathers it into the file. --resume deals the
+ * subtrees of the file out instead of the initial partition. */
+typedef struct checkpoint {
+    const char *path;
+    double every;
+    bool resume;
+    double next; /* on rank 0, when the next one is due */
+    int pausing; /* thread 0 is taking one, the others park */
+    int parked;
+} checkpoint_t;
+
+/* Pieces of work in the deal layout, packed one after the other */
+typedef struct pack {
+    uint8_t *bytes;
+    int len;
+    int size;
+} pack_t;
+
 moas_t *gMOAS;
+self_t gSELF;
+checkpoint_t gCKPT = {NULL, CHECKPOINT_EVERY, false, 0, 0, 0};
+redist_t gREDIST = {false, false, WORK_TRESH, 0};
 int gDONE;
+kd_options_t gOPTS;
 int init_buff;
+int n_threads = 1;
+worker_t *workers;
+kd_arena_t work_arena;
+long pending;  /* work on the deques or being searched, on this rank */
+int found;     /* some thread of this rank solved the puzzle */
+work_t *solution;
+long unreported; /* solutions counted here and not reported to rank 0 */
+int *gSTOP;    /* raised by rank 0 with a one-sided put */
+MPI_Win stop_win;
+MPI_Win pool_win;
+int slot_bytes;
+
+/* Every rank exposes its stop flag, rank 0 may raise it at any time */
+void init_stop() {
+    MPI_Win_allocate(sizeof(int), sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD,
+                     &gSTOP, &stop_win);
+    *gSTOP = 0;
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, stop_win);
+    // No put before every flag is down
+    MPI_Barrier(MPI_COMM_WORLD);
+}
 
-int square(int i, int j) {
-    return (i / gMOAS->box_size) * gMOAS->box_size + j / gMOAS->box_size;
+void free_stop() {
+    MPI_Win_unlock_all(stop_win);
+    MPI_Win_free(&stop_win);
 }
 
-void set_cell(int i, int j, int n) {
-    mask_t *mask = gMOAS->mask;
-    mask->grid[i][j] = n;
-    mask->rows[i] |= mask->bits[n];
-    mask->cols[j] |= mask->bits[n];
-    mask->squares[square(i, j)] |= mask->bits[n];
+/* Flag raised, threads that make no MPI calls may read it too */
+bool stop_raised() {
+    int stop;
+    #pragma omp atomic read
+    stop = *gSTOP;
+    return stop;
 }
 
-void clear_cell(int i, int j) {
-    mask_t *mask = gMOAS->mask;
-    int n = mask->grid[i][j];
-    mask->grid[i][j] = 0;
-    mask->rows[i] &= ~mask->bits[n];
-    mask->cols[j] &= ~mask->bits[n];
-    mask->squares[square(i, j)] &= ~mask->bits[n];
+/* Raises the stop flag of every slave, busy threads notice it within one
+ * search quantum without any message to receive. Slaves blocked waiting
+ * for messages are woken by DIE_TAG, sent without blocking. */
+void exit_colony(int ntasks) {
+    int id, stop = 1;
+
+    for (id = 1; id < ntasks; ++id) {
+        MPI_Put(&stop, 1, MPI_INT, id, 0, 1, MPI_INT, stop_win);
+    }
+    MPI_Win_flush_all(stop_win);
+
+    gSELF.dies = (MPI_Request *)malloc(ntasks * sizeof(MPI_Request));
+    gSELF.dies[0] = MPI_REQUEST_NULL;
+    for (id = 1; id < ntasks; ++id) {
+        MPI_Isend(0, 0, MPI_INT, id, DIE_TAG, MPI_COMM_WORLD, &gSELF.dies[id]);
+    }
 }
 
-bool is_available(int i, int j, int n) {
-    mask_t *mask = gMOAS->mask;
-    return (mask->rows[i] & mask->bits[n]) == 0 &&
-           (mask->cols[j] & mask->bits[n]) == 0 &&
-           (mask->squares[square(i, j)] & mask->bits[n]) == 0;
+/* Replays the moves of some work on a clean board, they become its root */
+bool restore_from_history(kd_search_t *search, kd_move_t *history,
+                          int history_len) {
+    int i;
+    kd_search_reset(search);
+    for (i = 0; i < history_len; i++) {
+        if (!kd_search_play(search, history[i].pos, history[i].value)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void exit_colony(int ntasks) {
-    int id;
-    for (id = 1; id < ntasks; ++id) {
-        MPI_Send(0, 0, MPI_INT, id, DIE_TAG, MPI_COMM_WORLD);
+/* Allocations the run cannot go on without abort every rank */
+void *check_alloc(void *ptr) {
+    if (ptr == NULL) {
+        fprintf(stderr, "Could not allocate space\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    return ptr;
 }
 
-void add_to_history(int i, int j, int value) {
-    mask_t *mask = gMOAS->mask;
-    mask->history[mask->history_len].x = i;
-    mask->history[mask->history_len].y = j;
-    mask->history[mask->history_len].v = value;
-    mask->history_len++;
+void copy_history(work_t *work, int history_len) {
+    work->history = (kd_move_t *)check_alloc(calloc(gMOAS->n_empty + 1,
+                                                    sizeof(kd_move_t)));
+    kd_search_moves(gMOAS->search, work->history);
+    work->history_len = history_len;
 }
 
-info_t get_history_head(info_t *history, int history_len) {
-    assert(history_len != 0);
-    return history[history_len - 1];
+void print_grid() {
+    kd_print_board(gMOAS->search->board);
 }
 
-int get_history_head_pos(info_t *history, int history_len) {
-    assert(history_len != 0);
-    return history[history_len - 1].x * gMOAS->n + history[history_len - 1].y;
+void free_gMOAS() {
+    if (gREDIST.rma) {
+        MPI_Win_unlock_all(pool_win);
+        MPI_Win_free(&pool_win);
+        free(gSELF.slot);
+    }
+    kd_free_search(gMOAS->search);
+    kd_free_arena(&work_arena);
+    kd_free_puzzle(gMOAS->puzzle);
+    free(gMOAS);
 }
 
-int remove_last_from_history() {
-    mask_t *mask = gMOAS->mask;
-    int n;
+void print_history(kd_move_t *history, int length) {
+    int i = 0;
+    printf("History length %d\n", length);
+    for (i = 0; i < length; i++) {
+        printf("map[%d][%d] = %d\n", history[i].pos / gMOAS->n,
+               history[i].pos % gMOAS->n, history[i].value);
+    }
+}
 
-    info_t head = get_history_head(mask->history, mask->history_len);
-    clear_cell(head.x, head.y);
-    n = head.v;
+void print_work_stack(int top, work_t *stack) {
+    int i;
+    for (i = 0; i < top; i++) {
+        printf("Element %d\n", i);
+        print_history(stack[i].history, stack[i].history_len);
+        printf("\n\n");
+    }
+}
 
-    mask->history_len = (mask->history_len == 0) ? 0 : mask->history_len - 1;
+/* Expands the tree breadth first, one branching level at a time, until
+ * there are target subtrees or none left. The children of a subtree are the
+ * values that survive propagation, not a guess from the number of empty
+ * cells. */
+work_t *initial_work(int target, int *top, bool *solved) {
+    kd_search_t *search = gMOAS->search;
+    work_t *level, *next;
+    int size, next_top, i, res, depth = 0;
+
+    level = (work_t *)check_alloc(calloc(1, sizeof(work_t)));
+    level[0].history = (kd_move_t *)check_alloc(calloc(gMOAS->n_empty + 1,
+                                                       sizeof(kd_move_t)));
+    *top = 1;
+    *solved = false;
+
+    while (*top > 0 && *top < target && !*solved) {
+        size = *top * 2;
+        next = (work_t *)check_alloc(calloc(size, sizeof(work_t)));
+        next_top = 0;
+        for (i = 0; i < *top; i++) {
+            // Every cut branch one level below is a child
+            if (!*solved && restore_from_history(search, level[i].history,
+                                                 level[i].history_len)) {
+                search->max_depth = search->depth + 1;
+                while ((res = kd_search_run(search, 0)) != KD_EXHAUSTED) {
+                    if (res == KD_SOLVED && gOPTS.count > 0) {
+                        // Counted here, stop once the limit is reached
+                        *solved = ++gSELF.solutions >= gOPTS.count;
+                        if (*solved) {
+                            break;
+                        }
+                        continue;
+                    } else if (res == KD_SOLVED) {
+                        // Propagation finished the puzzle before the cutoff
+                        print_grid();
+                        *solved = true;
+                        break;
+                    }
+                    if (next_top == size) {
+                        size *= 2;
+                        next = (work_t *)check_alloc(
+                                   realloc(next, size * sizeof(work_t)));
+                    }
+                    copy_history(&next[next_top++], search->depth);
+                }
+            }
+            free(level[i].history);
+        }
+        free(level);
+        level = next;
+        *top = next_top;
+        depth++;
+    }
+    search->max_depth = 0;
+    kd_search_reset(search);
 
-    return n;
+    printf("Got %d subtrees for %d wanted, Working until depth %d\n", *top,
+           target, depth);
+    return level;
 }
 
-void clear_history() {
-    mask_t *mask = gMOAS->mask;
+/* Bytes of the longest history on the wire */
+int wire_size() {
+    return (gMOAS->n_empty + 1) * MOVE_BYTES;
+}
 
-    while (mask->history_len > 0) {
-        remove_last_from_history();
+/* Wraps the puzzle into the global MOAS, with a search over it */
+void init_gMOAS(kd_puzzle_t *puzzle) {
+    gMOAS = (moas_t *)malloc(sizeof(moas_t));
+    gMOAS->puzzle = puzzle;
+    gMOAS->box_size = puzzle->box_size;
+    gMOAS->n = puzzle->n;
+    gMOAS->n_empty = puzzle->n_empty;
+    gMOAS->known = puzzle->known;
+    gMOAS->search = kd_new_search(puzzle, &gOPTS);
+    gSELF.inbox = (uint8_t *)malloc(wire_size());
+    kd_init_arena(&work_arena, sizeof(work_t) +
+                  (gMOAS->n_empty + 1) * sizeof(kd_move_t), WORK_SLAB);
+    gSELF.pool = kd_new_pool(&work_arena);
+    if (gREDIST.split_left <= 0) {
+        gREDIST.split_left = gMOAS->box_size * SPLIT_LEFT;
     }
 }
 
-void restore_from_history(info_t *history, int history_len) {
-    int i;
-    for (i = 0; i < history_len; i++) {
-        clear_cell(history[i].x, history[i].y);
-        set_cell(history[i].x, history[i].y, history[i].v);
-        add_to_history(history[i].x, history[i].y, history[i].v);
+/* Rank 0 shares the puzzle as its box size and then every cell packed in
+ * one buffer, two collectives whatever the size of the board. known is
+ * only read on rank 0 and filled everywhere else. */
+void share_board(int box_size, int *known) {
+    int n = box_size * box_size, i;
+    kd_value_t *cells = (kd_value_t *)malloc(n * n * sizeof(kd_value_t));
+
+    if (gSELF.id == 0) {
+        for (i = 0; i < n * n; i++) {
+            cells[i] = (kd_value_t)known[i];
+        }
     }
+    MPI_Bcast(cells, n * n * sizeof(kd_value_t), MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (gSELF.id != 0) {
+        for (i = 0; i < n * n; i++) {
+            known[i] = cells[i];
+        }
+    }
+    free(cells);
 }
 
-void copy_history(work_t *work, int history_len) {
-    int i = 0, len = history_len;
-    work->history = calloc(len, sizeof(info_t));
-    for (i = 0; i < len; i++) {
-        work->history[i].v = gMOAS->mask->history[i].v;
-        work->history[i].x = gMOAS->mask->history[i].x;
-        work->history[i].y = gMOAS->mask->history[i].y;
+int build_map() {
+    int box_size, n, *known;
+    kd_puzzle_t *puzzle;
+
+    MPI_Bcast(&box_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (box_size == 0) {
+        // Master could not read the puzzle
+        return -1;
     }
-    work->history_len = len;
+
+    n = box_size * box_size;
+    known = (int *)calloc(n * n, sizeof(int));
+    share_board(box_size, known);
+
+    puzzle = kd_new_puzzle(box_size, known);
+    free(known);
+    init_gMOAS(puzzle);
+    return 0;
 }
 
-void rewrite_history(int index) {
-    mask_t *mask = gMOAS->mask;
-    if (index > mask->history_len) {
-        printf("Invalid index to rewrite");
+int read_file(const char *filename) {
+    int box_size = 0;
+    kd_puzzle_t *puzzle;
+
+    puzzle = kd_read_file(filename);
+    if (puzzle != NULL) {
+        box_size = puzzle->box_size;
     }
-    if (mask->history[index].x + mask->history[index].y >= gMOAS->n) {
-        printf("No fork space in history rewrite");
+    MPI_Bcast(&box_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (puzzle == NULL) {
+        return -1;
     }
 
-    (mask->history[index].v)++;
+    share_board(box_size, puzzle->known);
+    init_gMOAS(puzzle);
+    return 0;
+}
+
+/* Rank that work is asked from, any worker but this one */
+int pick_victim() {
+    int victim = 1 + rand_r(&gSELF.seed) % (gSELF.ntasks - 2);
+    return victim >= gSELF.id ? victim + 1 : victim;
 }
 
-int root_history(int root) {
+/* Lays the moves out for the wire, the positions and then the values */
+void pack_moves(uint8_t *block, kd_move_t *history, int len) {
+    wire_pos_t *pos = (wire_pos_t *)block;
+    kd_value_t *value = (kd_value_t *)(pos + len);
     int i;
-    mask_t *mask = gMOAS->mask;
-    /* gets first history whose value is not the last possible */
-    for (i = root + 1; i < mask->history_len; i++) {
 
-        if (mask->history[i].v != gMOAS->n)
-            return i;
+    for (i = 0; i < len; i++) {
+        pos[i] = history[i].pos;
+        value[i] = history[i].value;
     }
+}
+
+/* Fills the history of work, its length must be set */
+void unpack_moves(const uint8_t *block, work_t *work) {
+    const wire_pos_t *pos = (const wire_pos_t *)block;
+    const kd_value_t *value = (const kd_value_t *)(pos + work->history_len);
+    int i;
 
-    return -1;
+    for (i = 0; i < work->history_len; i++) {
+        work->history[i].pos = pos[i];
+        work->history[i].value = value[i];
+    }
 }
 
-bool advance_cell(int i, int j, int n) {
-    mask_t *mask = gMOAS->mask;
+/* Sends history as a single message without blocking, its block stays in
+ * the outbox until the send completes. Two ranks may be sending work to
+ * each other. */
+void send_work(kd_move_t *history, int size, int id, int tag) {
+    outbox_t *out = gSELF.spare;
 
-    while (++n <= gMOAS->n) {
-        if (is_available(i, j, n)) {
-            set_cell(i, j, n);
-            add_to_history(i, j, n);
-            return true;
-        }
+    assert(size >= 0);
+    if (out != NULL) {
+        gSELF.spare = out->next;
+    } else {
+        out = (outbox_t *)malloc(sizeof(outbox_t));
+        out->block = (uint8_t *)malloc(wire_size());
     }
-    return false;
+
+    pack_moves(out->block, history, size);
+    MPI_Isend(out->block, size * MOVE_BYTES, MPI_BYTE, id, tag, MPI_COMM_WORLD,
+              &out->req);
+    out->next = gSELF.outbox;
+    gSELF.outbox = out;
 }
 
-void print_grid() {
-    int i, j;
-    mask_t *mask = gMOAS->mask;
-    for (i = 0; i < gMOAS->n; i++) {
-        for (j = 0; j < gMOAS->n; j++) {
-            if (gMOAS->known[i][j]) {
-                printf("%2d ", gMOAS->known[i][j]);
-            } else {
-                printf("%2d ", mask->grid[i][j]);
-            }
+/* Moves the sends that completed to the spares, true once none is left */
+bool flush_outbox() {
+    outbox_t **at = &gSELF.outbox, *out;
+    int flag;
+
+    while (*at != NULL) {
+        out = *at;
+        MPI_Test(&out->req, &flag, MPI_STATUS_IGNORE);
+        if (flag) {
+            *at = out->next;
+            out->next = gSELF.spare;
+            gSELF.spare = out;
+        } else {
+            at = &out->next;
         }
-        printf("\n");
     }
-    printf("\n");
+    return gSELF.outbox == NULL;
 }
 
-void free_gMOAS() {
-    int i;
-    for (i = 0; i < gMOAS->n; i++) {
-        free(gMOAS->known[i]);
-        free(gMOAS->mask->grid[i]);
-    }
-    free(gMOAS->known);
-    free(gMOAS->mask->grid);
-    free(gMOAS->mask->rows);
-    free(gMOAS->mask->cols);
-    free(gMOAS->mask->squares);
-    free(gMOAS->mask->bits);
-    free(gMOAS->mask->history);
-    free(gMOAS->mask);
-    free(gMOAS);
+/* Receives the work probed in status, its length comes from the size of
+ * the message */
+work_t *new_work(kd_pool_t *pool) {
+    work_t *work = (work_t *)kd_pool_alloc(pool);
+
+    if (work == NULL) {
+        fprintf(stderr, "Could not allocate space\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    work->history = (kd_move_t *)(work + 1);
+    work->history_len = 0;
+    return work;
 }
 
-int solve_nsteps(int root, int *pos, int *n, int total, int nsteps) {
-    int i;
-    mask_t *mask = gMOAS->mask;
-    for (i = 0; i < nsteps; i++) {
-        while (*pos < total && gMOAS->known[*pos / gMOAS->n][*pos % gMOAS->n]) {
-            ++(*pos);
-            *n = 0;
+/* pool is the one of the calling thread */
+void free_work(kd_pool_t *pool, work_t *work) {
+    kd_pool_free(pool, work);
+}
+
+work_t *receive_work(MPI_Status *status) {
+    work_t *work;
+    int bytes;
+
+    MPI_Get_count(status, MPI_BYTE, &bytes);
+    MPI_Recv(gSELF.inbox, bytes, MPI_BYTE, status->MPI_SOURCE,
+             status->MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    work = new_work(gSELF.pool);
+    work->history_len = bytes / MOVE_BYTES;
+    unpack_moves(gSELF.inbox, work);
+    return work;
+}
+
+void push_work(work_t *work) {
+    if (gSELF.top == gSELF.size) {
+        gSELF.size = gSELF.size > 0 ? 2 * gSELF.size : INIT_BUFF;
+        gSELF.stack = (work_t **)realloc(gSELF.stack,
+                                         gSELF.size * sizeof(work_t *));
+    }
+    gSELF.stack[gSELF.top++] = work;
+}
+
+/* Bytes of a piece of work in the initial deal: its length, then the moves
+ * as on the wire, padded so that the next length stays aligned */
+int deal_size(int len) {
+    int bytes = (int)sizeof(wire_pos_t) + len * MOVE_BYTES;
+    return (bytes + (int)sizeof(wire_pos_t) - 1) / (int)sizeof(wire_pos_t) *
+           (int)sizeof(wire_pos_t);
+}
+
+/* Rank 0 deals the top pieces of stack round-robin to the slaves with one
+ * MPI_Scatterv, the slaves push theirs on their stack. Work handed out by
+ * a collective is never in flight, so the termination counts leave it
+ * out. */
+void deal_work(work_t *stack, int top) {
+    int ntasks = gSELF.ntasks, *counts = NULL, *displs = NULL, *fill = NULL;
+    int count, len, i, r;
+    uint8_t *block = NULL, *mine, *at;
+    work_t *work;
+
+    if (gSELF.id == 0) {
+        counts = (int *)calloc(ntasks, sizeof(int));
+        displs = (int *)calloc(ntasks, sizeof(int));
+        fill = (int *)calloc(ntasks, sizeof(int));
+        for (i = 0; i < top; i++) {
+            counts[1 + i % (ntasks - 1)] += deal_size(stack[i].history_len);
         }
-        if (*pos >= total) {
-            gDONE = true;
-            return 0;
+        for (r = 1; r < ntasks; r++) {
+            displs[r] = fill[r] = displs[r - 1] + counts[r - 1];
         }
-
-        if (advance_cell(*pos / gMOAS->n, *pos % gMOAS->n, *n)) {
-            ++(*pos);
-            *n = 0;
-        } else {
-            if (mask->history_len == root) {
-                return 0;
-            }
-            info_t head = get_history_head(mask->history, mask->history_len);
-            if (head.v != mask->grid[head.x][head.y]) {
-                // restore_from_history(mask->history, mask->history_len);
-            }
-            (*pos) = get_history_head_pos(mask->history, mask->history_len);
-            *n = remove_last_from_history();
+        block = (uint8_t *)malloc(displs[ntasks - 1] + counts[ntasks - 1] + 1);
+        for (i = 0; i < top; i++) {
+            r = 1 + i % (ntasks - 1);
+            at = block + fill[r];
+            *(wire_pos_t *)at = (wire_pos_t)stack[i].history_len;
+            pack_moves(at + sizeof(wire_pos_t), stack[i].history,
+                       stack[i].history_len);
+            fill[r] += deal_size(stack[i].history_len);
         }
     }
 
-    return 1;
+    MPI_Scatter(counts, 1, MPI_INT, &count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    mine = (uint8_t *)malloc(count + 1);
+    MPI_Scatterv(block, counts, displs, MPI_BYTE, mine, count, MPI_BYTE, 0,
+                 MPI_COMM_WORLD);
+
+    for (at = mine; at < mine + count; at += deal_size(len)) {
+        len = *(wire_pos_t *)at;
+        work = new_work(gSELF.pool);
+        work->history_len = len;
+        unpack_moves(at + sizeof(wire_pos_t), work);
+        push_work(work);
+    }
+
+    free(mine);
+    free(block);
+    free(counts);
+    free(displs);
+    free(fill);
 }
 
-void print_history(info_t *history, int length) {
-    int i = 0;
-    printf("History length %d\n", length);
-    for (i = 0; i < length; i++) {
-        printf("map[%d][%d] = %d\n", history[i].x, history[i].y, history[i].v);
-    }
+/* Token of the termination probe, goes around ranks 0, 1, ..., ntasks - 1 */
+void send_token(long count, int color) {
+    long token[2] = {count, color};
+    MPI_Send(token, 2, MPI_LONG, (gSELF.id + 1) % gSELF.ntasks, TOKEN_TAG,
+             MPI_COMM_WORLD);
 }
 
-void print_work_stack(int ntasks, work_t *stack) {
-    int i;
-    for (i = 0; i < ntasks * INIT_BUFF; i++) {
-        printf("Element %d\n", i);
-        print_history(stack[i].history, stack[i].history_len);
-        printf("\n\n");
-    }
+/* Passive workers hand the probe on with their count and color added */
+void pass_token() {
+    safra_t *safra = &gSELF.safra;
+    send_token(safra->token_count + safra->count,
+               safra->color == BLACK ? BLACK : safra->token_color);
+    safra->color = WHITE;
+    safra->has_token = false;
 }
 
-work_t *initial_work(int ntasks, int *top, int *size) {
-    int total = 0, acc = gMOAS->n;
-    work_t *stack;
-    int pos = 0;
-    int val = 0;
-    mask_t *mask = gMOAS->mask;
+/* Oldest piece on the deques of this rank, NULL if none was found */
+work_t *steal_local(int id) {
+    work_t *work;
+    int k;
 
-    while (1) {
-        if (gMOAS->known[total / gMOAS->n][total % gMOAS->n]) {
-            total++;
-        } else {
-            break;
+    for (k = 0; k < n_threads; k++) {
+        work = kd_deque_steal(workers[(id + k) % n_threads].deque);
+        if (work != NULL) {
+            return work;
         }
     }
-    total++;
+    return NULL;
+}
 
-    /* Calculate number of starter possibilities according to ntasks */
-    while (acc < (ntasks * INIT_BUFF) && total < gMOAS->n) {
-        if (!gMOAS->known[total / gMOAS->n][total % gMOAS->n]) {
-            acc *= (gMOAS->n - total);
+/* Gives a piece of work to thief: a waiting one, else the oldest one on the
+ * deques, else the shallowest open branch of the search of thread 0, else a
+ * refusal */
+void answer_steal(int thief, bool working) {
+    work_t *work = NULL;
+    int msg = 0;
+
+    gSELF.answered++;
+    if (gSELF.top > 0) {
+        work = gSELF.stack[--gSELF.top];
+    } else if (n_threads > 1 && (work = steal_local(0)) != NULL) {
+        #pragma omp atomic
+        pending--;
+    } else if (working) {
+        work = new_work(gSELF.pool);
+        work->history_len = kd_search_split(gMOAS->search, gREDIST.split_left,
+                                            work->history);
+        if (work->history_len == 0) {
+            // Nothing left to split off
+            free_work(gSELF.pool, work);
+            work = NULL;
         }
-        total++;
     }
 
-    while (1) {
-        if (gMOAS->known[total / gMOAS->n][total % gMOAS->n]) {
-            total++;
+    // A waiting piece without moves is a whole tree, a resumed root
+    if (work != NULL) {
+        send_work(work->history, work->history_len, thief, WORK_TAG);
+        gSELF.safra.count++;
+        gSELF.given++;
+    } else {
+        MPI_Send(&msg, 1, MPI_INT, thief, NO_WORK_TAG, MPI_COMM_WORLD);
+    }
+    if (work != NULL) {
+        free_work(gSELF.pool, work);
+    }
+}
+
+/* Work pools over RMA (--rma). Every rank keeps a few pieces of work in a
+ * window: a ring of POOL_SLOTS slots in the deal layout behind three
+ * counters. The owner appends at tail, any rank claims the piece at head
+ * with a compare-and-swap and bumps taken once it has read it, so the
+ * owner never reuses a slot that was not read yet. A piece in a pool
+ * counts for termination as work in flight from its owner. */
+enum pool_counters { POOL_HEAD = 0, POOL_TAIL, POOL_TAKEN };
+
+MPI_Aint pool_slot(long i) {
+    return 3 * sizeof(long) + (i % POOL_SLOTS) * slot_bytes;
+}
+
+long pool_read(int rank, int counter) {
+    long value;
+    MPI_Fetch_and_op(NULL, &value, MPI_LONG, rank, counter * sizeof(long),
+                     MPI_NO_OP, pool_win);
+    MPI_Win_flush(rank, pool_win);
+    return value;
+}
+
+void init_pool() {
+    long *counters;
+
+    if (!gREDIST.rma) {
+        return;
+    }
+    slot_bytes = deal_size(gMOAS->n_empty + 1);
+    gSELF.slot = (uint8_t *)malloc(slot_bytes);
+    MPI_Win_allocate(3 * sizeof(long) + POOL_SLOTS * slot_bytes, 1,
+                     MPI_INFO_NULL, MPI_COMM_WORLD, &counters, &pool_win);
+    counters[POOL_HEAD] = counters[POOL_TAIL] = counters[POOL_TAKEN] = 0;
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, pool_win);
+    // No claim before every pool is empty
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+/* Appends work to the pool of this rank, false if it is full */
+bool pool_put(work_t *work) {
+    int me = gSELF.id, bytes = deal_size(work->history_len);
+    long one = 1, old;
+
+    if (gSELF.tail - pool_read(me, POOL_TAKEN) >= POOL_SLOTS) {
+        return false;
+    }
+    *(wire_pos_t *)gSELF.slot = (wire_pos_t)work->history_len;
+    pack_moves(gSELF.slot + sizeof(wire_pos_t), work->history,
+               work->history_len);
+    MPI_Put(gSELF.slot, bytes, MPI_BYTE, me, pool_slot(gSELF.tail), bytes,
+            MPI_BYTE, pool_win);
+    MPI_Win_flush(me, pool_win);
+
+    // Publish it
+    MPI_Fetch_and_op(&one, &old, MPI_LONG, me, POOL_TAIL * sizeof(long),
+                     MPI_SUM, pool_win);
+    MPI_Win_flush(me, pool_win);
+    gSELF.tail++;
+    gSELF.safra.count++;
+    return true;
+}
+
+/* Claims the oldest piece in the pool of rank, NULL if there was none or
+ * another rank got it first */
+work_t *pool_take(int rank) {
+    long head = pool_read(rank, POOL_HEAD), next = head + 1, seen, one = 1;
+    work_t *work;
+
+    if (head >= pool_read(rank, POOL_TAIL)) {
+        return NULL;
+    }
+    MPI_Compare_and_swap(&next, &head, &seen, MPI_LONG, rank,
+                         POOL_HEAD * sizeof(long), pool_win);
+    MPI_Win_flush(rank, pool_win);
+    if (seen != head) {
+        return NULL;
+    }
+
+    MPI_Get(gSELF.slot, slot_bytes, MPI_BYTE, rank, pool_slot(head),
+            slot_bytes, MPI_BYTE, pool_win);
+    MPI_Win_flush(rank, pool_win);
+    MPI_Accumulate(&one, 1, MPI_LONG, rank, POOL_TAKEN * sizeof(long), 1,
+                   MPI_LONG, MPI_SUM, pool_win);
+    MPI_Win_flush(rank, pool_win);
+
+    work = new_work(gSELF.pool);
+    work->history_len = *(wire_pos_t *)gSELF.slot;
+    unpack_moves(gSELF.slot + sizeof(wire_pos_t), work);
+    gSELF.safra.count--;
+    gSELF.safra.color = BLACK;
+    return work;
+}
+
+/* Keeps POOL_SLACK pieces in the pool of this rank: waiting ones, else the
+ * oldest ones on the deques, else branches split off the search of thread
+ * 0 */
+void fill_pool(bool working) {
+    work_t *work;
+
+    while (gSELF.tail - pool_read(gSELF.id, POOL_HEAD) < POOL_SLACK) {
+        if (gSELF.top > 0) {
+            work = gSELF.stack[--gSELF.top];
+        } else if (n_threads > 1 && (work = steal_local(0)) != NULL) {
+            #pragma omp atomic
+            pending--;
+        } else if (working) {
+            work = new_work(gSELF.pool);
+            work->history_len = kd_search_split(gMOAS->search,
+                                                gREDIST.split_left,
+                                                work->history);
+            if (work->history_len == 0) {
+                free_work(gSELF.pool, work);
+                break;
+            }
         } else {
             break;
         }
+
+        if (!pool_put(work)) {
+            push_work(work);
+            break;
+        }
+        free_work(gSELF.pool, work);
+        gSELF.given++;
     }
+}
 
-    *size = acc * 2;
-    stack = (work_t *)calloc(*size, sizeof(work_t));
-    *top = 0;
-    printf("Got %d taskers, %d possibilities, Working until house %d\n", ntasks,
-           acc, total);
+/* Takes back a piece of this rank when it has nothing else to do, else
+ * claims one from a random peer */
+void claim_work(bool passive) {
+    work_t *work = passive ? pool_take(gSELF.id) : NULL;
 
-    // Explore to depth
-    while (1) {
-        while (pos < total && gMOAS->known[pos / gMOAS->n][pos % gMOAS->n]) {
-            ++pos;
-            val = 0;
+    if (work == NULL && gSELF.ntasks > 2) {
+        work = pool_take(pick_victim());
+        if (work != NULL) {
+            gSELF.stolen++;
         }
+    } else if (work != NULL) {
+        gSELF.given--;
+    }
+    if (work != NULL) {
+        push_work(work);
+    }
+}
 
-        if (pos >= total) {
-            // save this history
-            // print_history(mask->history, mask->history_len);
-            copy_history(&stack[*top], gMOAS->mask->history_len);
-            (*top)++;
+/* Takes the message probed in status. Returns its tag, after DIE_TAG every
+ * steal is refused and the work that still arrives is dropped. The caller
+ * takes the checkpoint CHECKPOINT_TAG asks for. */
+int handle_message(MPI_Status *status, bool working, bool dying) {
+    int msg, source = status->MPI_SOURCE, tag = status->MPI_TAG;
+    long token[2];
+    work_t *work;
 
-            // backtrack
-            if (mask->history_len != 0) {
+    if (tag == TOKEN_TAG) {
+        MPI_Recv(token, 2, MPI_LONG, source, tag, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+        gSELF.safra.has_token = true;
+        gSELF.safra.token_count = token[0];
+        gSELF.safra.token_color = (int)token[1];
+        return tag;
+    }
 
-                pos = get_history_head_pos(gMOAS->mask->history,
-                                           gMOAS->mask->history_len);
-                val = remove_last_from_history();
-            } else {
+    if (tag == COUNT_TAG) {
+        MPI_Recv(token, 1, MPI_LONG, source, tag, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+        gSELF.counted += token[0];
+        return tag;
+    }
 
-                break;
+    if (tag == WORK_TAG || tag == SOLUTION_TAG) {
+        work = receive_work(status);
+        if (tag == SOLUTION_TAG) {
+            // Master keeps the first solution
+            if (!dying && restore_from_history(gMOAS->search, work->history,
+                                               work->history_len) &&
+                    gMOAS->search->n_free == 0) {
+                print_grid();
+            }
+        } else {
+            gSELF.safra.count--;
+            gSELF.safra.color = BLACK;
+            if (source == gSELF.victim) {
+                gSELF.victim = -1;
+                gSELF.stolen++;
             }
+            if (!dying) {
+                push_work(work);
+                work = NULL;
+            }
+        }
+        if (work != NULL) {
+            free_work(gSELF.pool, work);
         }
+        return tag;
+    }
 
-        if (advance_cell(pos / gMOAS->n, pos % gMOAS->n, val)) {
-            ++pos;
-            val = 1;
+    MPI_Recv(&msg, 1, MPI_INT, source, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    switch (tag) {
+    case DIE_TAG:
+        gSELF.died = true;
+        break;
+    case NO_WORK_TAG:
+        gSELF.victim = -1;
+        break;
+    case STEAL_TAG:
+        if (dying || gSELF.frozen) {
+            gSELF.answered++;
+            MPI_Send(&msg, 1, MPI_INT, source, NO_WORK_TAG, MPI_COMM_WORLD);
         } else {
-            if (mask->history_len == 0) {
+            answer_steal(source, working);
+        }
+        break;
+    }
+    return tag;
+}
+
+/* Leaving with a steal request unanswered, or a reply unreceived, would
+ * hang a peer. Every rank keeps answering until the steal requests sent
+ * by all of them add up to the ones answered. Slaves also wait for the
+ * DIE_TAG that rank 0 sent them. */
+void drain() {
+    MPI_Request request;
+    MPI_Status status;
+    long left, all_left;
+    bool posted = false;
+    int flag, died = 1;
+
+    while (1) {
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (flag) {
+            handle_message(&status, false, true);
+            continue;
+        }
+        if (gSELF.dies != NULL) {
+            MPI_Testall(gSELF.ntasks, gSELF.dies, &died, MPI_STATUSES_IGNORE);
+        }
+        if (!flush_outbox() || gSELF.victim != -1 || !died ||
+                (gSELF.id != 0 && !gSELF.died)) {
+            continue;
+        }
+
+        if (!posted) {
+            left = gSELF.requests - gSELF.answered;
+            MPI_Iallreduce(&left, &all_left, 1, MPI_LONG, MPI_SUM,
+                           MPI_COMM_WORLD, &request);
+            posted = true;
+        }
+        MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+        if (flag) {
+            posted = false;
+            if (all_left == 0) {
                 break;
             }
-            pos =
-                get_history_head_pos(gMOAS->mask->history, gMOAS->mask->history_len);
-            val = remove_last_from_history();
         }
     }
+}
 
-    assert(*top > 0);
+/* Appends a piece of work to pack */
+void pack_work(pack_t *pack, const kd_move_t *history, int len) {
+    int bytes = deal_size(len);
 
-    return stack;
+    if (pack->len + bytes > pack->size) {
+        pack->size = 2 * pack->size + bytes;
+        pack->bytes = (uint8_t *)realloc(pack->bytes, pack->size);
+    }
+    *(wire_pos_t *)(pack->bytes + pack->len) = (wire_pos_t)len;
+    pack_moves(pack->bytes + pack->len + sizeof(wire_pos_t), (kd_move_t *)history,
+               len);
+    pack->len += bytes;
 }
 
-int round_robin(int *slaves_state, int ntasks, int state, int begin) {
-    int id, robin = begin;
-
-    for (id = 1; id < ntasks; ++id) {
-        robin = (robin == ntasks - 1) ? (1) : (robin + 1);
+void pack_subtree(void *pack, const kd_move_t *moves, int len) {
+    pack_work((pack_t *)pack, moves, len);
+}
 
-        if (slaves_state[robin] == state) {
+/* Other threads: waits here while thread 0 takes a checkpoint. Called where
+ * every piece of the thread is on its deque or in its search. */
+void park() {
+    int pausing;
 
-            return robin;
-        }
+    #pragma omp atomic read
+    pausing = gCKPT.pausing;
+    if (!pausing) {
+        return;
     }
-
-    return -1;
+    #pragma omp atomic update
+    gCKPT.parked++;
+    while (pausing) {
+        sched_yield();
+        #pragma omp atomic read
+        pausing = gCKPT.pausing;
+    }
+    #pragma omp atomic update
+    gCKPT.parked--;
 }
 
-void print_slaves_state(int *slave_state, int ntasks) {
-    int id;
-
-    printf("Slave state: ");
+void wait_parked(int want) {
+    int parked;
 
-    for (id = 1; id < ntasks; ++id) {
-        printf("(slave %d - %s)", id,
-               (slave_state[id] == IDLE)
-               ? "IDLE"
-               : ((slave_state[id] == WORKING) ? "WORKING" : "REQUEST"));
+    #pragma omp atomic read
+    parked = gCKPT.parked;
+    while (parked != want) {
+        sched_yield();
+        #pragma omp atomic read
+        parked = gCKPT.parked;
     }
+}
 
-    printf("\n");
+/* Thread 0: parks the other threads, or lets them go */
+void pause_threads(bool pause) {
+    if (pause) {
+        // The last ones may still be on their way out of the previous pause
+        wait_parked(0);
+        #pragma omp atomic write
+        gCKPT.pausing = 1;
+        wait_parked(n_threads - 1);
+    } else {
+        #pragma omp atomic write
+        gCKPT.pausing = 0;
+    }
 }
 
-void build_map() {
-    int box_size, num, i, j, n_empty;
+/* Packs everything this rank holds: the stack, the deques, the RMA pool and
+ * the open subtrees of every busy search */
+void pack_rank(pack_t *pack, bool working) {
+    work_t *work;
+    long i, head;
+    int t;
 
-    MPI_Bcast(&box_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    for (i = 0; i < gSELF.top; i++) {
+        pack_work(pack, gSELF.stack[i]->history, gSELF.stack[i]->history_len);
+    }
+    for (t = 0; t < n_threads; t++) {
+        for (i = 0; i < kd_deque_size(workers[t].deque); i++) {
+            work = (work_t *)kd_deque_peek(workers[t].deque, i);
+            pack_work(pack, work->history, work->history_len);
+        }
+        if (t == 0 ? working : workers[t].busy) {
+            work = new_work(gSELF.pool);
+            kd_search_frontier(workers[t].search, work->history, pack_subtree,
+                               pack);
+            free_work(gSELF.pool, work);
+        }
+    }
+    if (gREDIST.rma) {
+        // Pieces nobody claimed yet, in the deal layout already
+        for (head = pool_read(gSELF.id, POOL_HEAD); head < gSELF.tail; head++) {
+            MPI_Get(gSELF.slot, slot_bytes, MPI_BYTE, gSELF.id, pool_slot(head),
+                    slot_bytes, MPI_BYTE, pool_win);
+            MPI_Win_flush(gSELF.id, pool_win);
+            work = new_work(gSELF.pool);
+            work->history_len = *(wire_pos_t *)gSELF.slot;
+            unpack_moves(gSELF.slot + sizeof(wire_pos_t), work);
+            pack_work(pack, work->history, work->history_len);
+            free_work(gSELF.pool, work);
+        }
+    }
+}
 
-    gMOAS = (moas_t *)malloc(sizeof(moas_t));
-    gMOAS->box_size = box_size;
-    gMOAS->n = box_size * box_size;
-    gMOAS->known = (int **)calloc(gMOAS->n, sizeof(int *));
-    gMOAS->mask = (mask_t *)malloc(sizeof(mask_t));
-    gMOAS->mask->grid = (int **)calloc(gMOAS->n, sizeof(int *));
-    gMOAS->mask->rows = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    gMOAS->mask->cols = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    gMOAS->mask->squares = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    gMOAS->mask->bits = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    for (i = 1; i < gMOAS->n + 1; i++) {
-        gMOAS->mask->bits[i] = 1 << i;
-    }
-    for (i = 0; i < gMOAS->n; i++) {
-        gMOAS->known[i] = (int *)calloc(gMOAS->n, sizeof(int));
-        gMOAS->mask->grid[i] = (int *)calloc(gMOAS->n, sizeof(int));
-        for (j = 0; j < gMOAS->n; j++) {
-            MPI_Bcast(&num, 1, MPI_INT, 0, MPI_COMM_WORLD);
-            set_cell(i, j, num);
-            gMOAS->known[i][j] = num;
-        }
-    }
-
-    MPI_Bcast(&gMOAS->n_empty, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    gMOAS->mask->history = calloc(gMOAS->n_empty, sizeof(info_t));
-    gMOAS->mask->history_len = 0;
-}
-
-void read_file(const char *filename, int ntasks) {
-    FILE *sudoku_file;
-    int box_size, num, i, j;
-
-    sudoku_file = fopen(filename, "re");
-    if (sudoku_file == NULL) {
-        fprintf(stderr, "Could not open file\n");
-        exit_colony(ntasks);
+/* Rank 0 writes the pieces gathered from every rank */
+void write_checkpoint(const uint8_t *block, int bytes) {
+    kd_checkpoint_t *c = kd_checkpoint_create(gCKPT.path, gMOAS->puzzle);
+    work_t *work = new_work(gSELF.pool);
+    const uint8_t *at;
+    long count;
+
+    if (c == NULL) {
+        free_work(gSELF.pool, work);
+        return;
+    }
+    for (at = block; at < block + bytes; at += deal_size(work->history_len)) {
+        work->history_len = *(const wire_pos_t *)at;
+        unpack_moves(at + sizeof(wire_pos_t), work);
+        kd_checkpoint_add(c, work->history, work->history_len);
     }
+    count = c->count;
+    if (kd_checkpoint_commit(c)) {
+        printf("Checkpoint of %ld subtrees in %s\n", count, gCKPT.path);
+        fflush(stdout);
+    }
+    free_work(gSELF.pool, work);
+}
 
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF) {
-        fprintf(stderr, "Could not read file\n");
-        exit_colony(ntasks);
+/* Every rank takes part once rank 0 asked for a checkpoint. Work still
+ * arriving is kept, steals are refused until the steal requests sent by all
+ * ranks add up to the ones answered, as in drain: no piece is in flight then
+ * and each one is held by exactly one rank. held is false on ranks with
+ * nothing to add, rank 0 and a slave that found the solution. Returns true
+ * if a solution reached rank 0 meanwhile. */
+bool take_checkpoint(bool held, bool working) {
+    MPI_Request request;
+    MPI_Status status;
+    long left, all_left;
+    bool posted = false, reached = false;
+    int flag, bytes = 0, i, *counts = NULL, *displs = NULL;
+    uint8_t *block = NULL;
+    pack_t pack = {NULL, 0, 0};
+
+    if (held && n_threads > 1) {
+        pause_threads(true);
     }
-    MPI_Bcast(&box_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    gSELF.frozen = true;
+    while (1) {
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (flag) {
+            reached |= handle_message(&status, working, false) == SOLUTION_TAG;
+            continue;
+        }
+        if (!flush_outbox() || gSELF.victim != -1) {
+            continue;
+        }
 
-    gMOAS = (moas_t *)malloc(sizeof(moas_t));
-    gMOAS->box_size = box_size;
-    gMOAS->n = box_size * box_size;
-    gMOAS->n_empty = gMOAS->n * gMOAS->n;
-    gMOAS->known = (int **)calloc(gMOAS->n, sizeof(int *));
-    gMOAS->mask = (mask_t *)malloc(sizeof(mask_t));
-    gMOAS->mask->grid = (int **)calloc(gMOAS->n, sizeof(int *));
-    gMOAS->mask->rows = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    gMOAS->mask->cols = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    gMOAS->mask->squares = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    gMOAS->mask->bits = calloc(gMOAS->n + 1, sizeof(uint128_t));
-    for (i = 1; i < gMOAS->n + 1; i++) {
-        gMOAS->mask->bits[i] = 1 << i;
-    }
-    for (i = 0; i < gMOAS->n; i++) {
-        gMOAS->known[i] = (int *)calloc(gMOAS->n, sizeof(int));
-        gMOAS->mask->grid[i] = (int *)calloc(gMOAS->n, sizeof(int));
-        for (j = 0; j < gMOAS->n; j++) {
-            fscanf(sudoku_file, "%d", &num);
-            set_cell(i, j, num);
-            gMOAS->known[i][j] = num;
-            if (num != 0) {
-                gMOAS->n_empty--;
+        if (!posted) {
+            left = gSELF.requests - gSELF.answered;
+            MPI_Iallreduce(&left, &all_left, 1, MPI_LONG, MPI_SUM,
+                           MPI_COMM_WORLD, &request);
+            posted = true;
+        }
+        MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+        if (flag) {
+            posted = false;
+            if (all_left == 0) {
+                break;
             }
-            MPI_Bcast(&num, 1, MPI_INT, 0, MPI_COMM_WORLD);
         }
     }
 
-    MPI_Bcast(&gMOAS->n_empty, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    gMOAS->mask->history = calloc(gMOAS->n_empty, sizeof(info_t));
-    gMOAS->mask->history_len = 0;
-    fclose(sudoku_file);
-}
+    if (held) {
+        pack_rank(&pack, working);
+    }
+    if (gSELF.id == 0) {
+        counts = (int *)check_alloc(calloc(gSELF.ntasks, sizeof(int)));
+        displs = (int *)check_alloc(calloc(gSELF.ntasks, sizeof(int)));
+    }
+    MPI_Gather(&pack.len, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (gSELF.id == 0) {
+        for (i = 1; i < gSELF.ntasks; i++) {
+            displs[i] = displs[i - 1] + counts[i - 1];
+        }
+        bytes = displs[gSELF.ntasks - 1] + counts[gSELF.ntasks - 1];
+        block = (uint8_t *)check_alloc(malloc(bytes + 1));
+    }
+    MPI_Gatherv(pack.bytes, pack.len, MPI_BYTE, block, counts, displs, MPI_BYTE,
+                0, MPI_COMM_WORLD);
+    if (gSELF.id == 0) {
+        write_checkpoint(block, bytes);
+        gCKPT.next = MPI_Wtime() + gCKPT.every;
+    }
 
-void send_work(info_t *history, int size, int id, int tag) {
+    gSELF.frozen = false;
+    if (held && n_threads > 1) {
+        pause_threads(false);
+    }
+    free(pack.bytes);
+    free(block);
+    free(counts);
+    free(displs);
+    return reached;
+}
 
-    int i, *block, index = 0;
-    assert(size > 0);
-    MPI_Send(&size, 1, MPI_INT, id, tag, MPI_COMM_WORLD);
-    block = (int *)calloc(3 * size, sizeof(int));
+/* Rank 0 asks every slave for a checkpoint and takes part in it */
+bool checkpoint_colony() {
+    int id, msg = 0;
 
-    for (i = 0; i < size; i++) {
-        block[index++] = history[i].x;
-        block[index++] = history[i].y;
-        block[index++] = history[i].v;
+    for (id = 1; id < gSELF.ntasks; ++id) {
+        MPI_Send(&msg, 1, MPI_INT, id, CHECKPOINT_TAG, MPI_COMM_WORLD);
     }
-
-    MPI_Send(block, 3 * size, MPI_INT, id, tag, MPI_COMM_WORLD);
+    return take_checkpoint(false, false);
 }
 
-work_t *receive_work(int id, int size, int tag) {
-    work_t *work;
-    int i, index = 0, *block;
-    MPI_Status status;
+/* Reads the subtrees of the checkpoint as the initial work of rank 0 */
+work_t *resume_work(int *top) {
+    kd_checkpoint_t *c = kd_checkpoint_open(gCKPT.path, gMOAS->puzzle);
+    work_t *stack;
+    int len;
+
+    if (c == NULL) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    stack = (work_t *)calloc(c->count + 1, sizeof(work_t));
+    for (*top = 0; *top < c->count; (*top)++) {
+        stack[*top].history = (kd_move_t *)calloc(gMOAS->n_empty + 1,
+                              sizeof(kd_move_t));
+        len = kd_checkpoint_next(c, gMOAS->puzzle, stack[*top].history);
+        if (len < 0) {
+            fprintf(stderr, "Checkpoint is missing subtrees\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        stack[*top].history_len = len;
+    }
+    printf("Resuming %d subtrees from %s\n", *top, gCKPT.path);
+    kd_checkpoint_close(c);
+    return stack;
+}
 
-    block = (int *)calloc(3 * size, sizeof(int));
-    MPI_Recv(block, size * 3, MPI_INT, id, tag, MPI_COMM_WORLD, &status);
+void init_self(int ntasks, int my_id) {
+    gSELF.id = my_id;
+    gSELF.ntasks = ntasks;
+    gSELF.seed = my_id;
+    gSELF.victim = -1;
+    gSELF.safra.color = WHITE;
+}
 
-    work = (work_t *)malloc(sizeof(work_t));
-    work->history = (info_t *)calloc(size, sizeof(info_t));
-    work->history_len = size;
+/* Every send has completed by now */
+void free_self() {
+    outbox_t *out;
 
-    for (i = 0; i < size; i++) {
-        work->history[i].x = block[index++];
-        work->history[i].y = block[index++];
-        work->history[i].v = block[index++];
-        // printf("history[%d] = (%d, %d, %d)\n", i, work->history[i].x,
-        // work->history[i].y, work->history[i].v);
+    while (gSELF.top > 0) {
+        free_work(gSELF.pool, gSELF.stack[--gSELF.top]);
     }
-    return work;
+    free(gSELF.stack);
+    while (gSELF.spare != NULL) {
+        out = gSELF.spare;
+        gSELF.spare = out->next;
+        free(out->block);
+        free(out);
+    }
+    free(gSELF.inbox);
+    free(gSELF.dies);
 }
 
-void master(const char *filename) {
+/* Master hands the initial work out and then only waits, for a solution or
+ * for the probe to come back clean. Returns the nodes it searched splitting
+ * the tree, -1 if the puzzle could not be read. */
+long master(const char *filename) {
     MPI_Status status;
-    int ntasks, msg, slave;
-    int robin = 1;
+    int ntasks, flag, tag;
+    long nodes;
+    work_t *stack;
+    int i, top;
+    bool solved = false;
+    double stop_at;
+    safra_t *safra = &gSELF.safra;
+
     MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
-    int idle_slaves = 0;
-    int slaves_state[ntasks];
-    work_t *stack, *work;
-    int top, wk_size, lost_work = 0;
-
-    read_file(filename, ntasks);
-    // Prepare initial work pool
-    stack = initial_work(ntasks, &top, &wk_size);
+    init_self(ntasks, 0);
+    if (read_file(filename) != 0) {
+        return -1;
+    }
+    // Prepare initial work pool, a few subtrees for every slave thread
+    if (gCKPT.resume) {
+        stack = resume_work(&top);
+    } else {
+        stack = initial_work((ntasks - 1) * n_threads * INIT_BUFF, &top,
+                             &solved);
+    }
     assert(stack != NULL);
-    // print_work_stack(ntasks, stack);
+    deal_work(stack, solved ? 0 : top);
+    init_pool();
+    for (i = 0; i < top; i++) {
+        free(stack[i].history);
+    }
+    free(stack);
 
-    for (slave = 1; slave < ntasks; ++slave) {
-        slaves_state[slave] = IDLE;
-        idle_slaves++;
+    if (solved || top == 0) {
+        // Nothing left for the slaves
+        if (!solved && gOPTS.count == 0) {
+            printf("No solution\n");
+        }
+        stop_at = MPI_Wtime();
+        exit_colony(ntasks);
+        drain();
+        printf("Colony stopped in %.6fs\n", MPI_Wtime() - stop_at);
+        if (gCKPT.path != NULL) {
+            remove(gCKPT.path);
+        }
+        nodes = gMOAS->search->nodes;
+        free_self();
+        free_gMOAS();
+        return nodes;
     }
 
-    // Distribute initial work
-    for (slave = 1; slave < ntasks; ++slave) {
-        // get work from work pool
-        if (top == 0) {
-            break;
+    // Master is passive from here on, start probing
+    send_token(0, WHITE);
+    gCKPT.next = MPI_Wtime() + gCKPT.every;
+
+    while (1) {
+        if (gCKPT.path == NULL) {
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            flag = 1;
+        } else {
+            // Wake up for the next checkpoint
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag,
+                       &status);
+            if (!flag && MPI_Wtime() >= gCKPT.next) {
+                if (checkpoint_colony()) {
+                    break;
+                }
+            } else if (!flag) {
+                usleep(1000);
+            }
+        }
+        if (flag) {
+            tag = handle_message(&status, false, false);
+            if (tag == SOLUTION_TAG || (tag == COUNT_TAG &&
+                                        gSELF.solutions + gSELF.counted >= gOPTS.count)) {
+                break;
+            }
         }
-        work = &(stack[--top]);
 
-        // send work
-        send_work(work->history, work->history_len, slave, WORK_TAG);
+        if (safra->has_token) {
+            if (safra->token_color == WHITE && safra->color == WHITE &&
+                    safra->token_count + safra->count == 0) {
+                // No work anywhere nor on its way
+                if (gOPTS.count == 0) {
+                    printf("No solution\n");
+                }
+                break;
+            }
+            safra->color = WHITE;
+            safra->has_token = false;
+            send_token(0, WHITE);
+        }
+    }
 
-        slaves_state[slave] = WORKING;
-        idle_slaves--;
+    stop_at = MPI_Wtime();
+    exit_colony(ntasks);
+    drain();
+    printf("Colony stopped in %.6fs\n", MPI_Wtime() - stop_at);
+    if (gCKPT.path != NULL) {
+        // Nothing left to resume
+        remove(gCKPT.path);
     }
+    nodes = gMOAS->search->nodes;
+    free_self();
+    free_gMOAS();
+    return nodes;
+}
 
-    while (1) {
+int done() {
+    int d;
+    #pragma omp atomic read
+    d = gDONE;
+    return d;
+}
 
-        MPI_Recv(&msg, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-                 &status);
+/* Threads stop searching once one of them solved the puzzle or the colony
+ * is dying */
+bool stopped() {
+    int f;
+    #pragma omp atomic read
+    f = found;
+    return f || done() || stop_raised();
+}
 
-        slave = status.MPI_SOURCE;
-        // print_slaves_state(slaves_state, ntasks);
+void init_workers() {
+    int i;
+
+    workers = (worker_t *)aligned_alloc(KD_CACHE_LINE,
+                                        n_threads * sizeof(worker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Could not allocate space\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < n_threads; i++) {
+        workers[i].deque = kd_new_deque(DEQUE_SIZE);
+        // Thread 0 searches the MOAS and allocates its work from the pool
+        // of the rank, it receives the work of the other ranks
+        workers[i].search = i == 0 ? gMOAS->search :
+                            kd_new_search(gMOAS->puzzle, &gOPTS);
+        workers[i].pool = i == 0 ? gSELF.pool : kd_new_pool(&work_arena);
+        if (workers[i].deque == NULL || workers[i].search == NULL ||
+                workers[i].pool == NULL) {
+            fprintf(stderr, "Could not allocate space\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        workers[i].tasks = workers[i].spawned = workers[i].stolen = 0;
+        workers[i].solutions = 0;
+        workers[i].busy = false;
+    }
+}
 
-        if (status.MPI_TAG == NO_WORK_TAG) {
+/* Also frees the work left behind when the search was cut short */
+void free_workers() {
+    work_t *work;
+    int i;
 
-            if (top > 0) {
-                // There is available work
-                work = &stack[--top];
+    for (i = 0; i < n_threads; i++) {
+        while ((work = kd_deque_pop(workers[i].deque)) != NULL) {
+            free_work(workers[i].pool, work);
+        }
+        kd_free_deque(workers[i].deque);
+        if (i > 0) {
+            kd_free_search(workers[i].search);
+        }
+    }
+    free(workers);
+}
 
-                // Send work
-                send_work(work->history, work->history_len, slave, WORK_TAG);
+/* Pushes work where the other threads of the rank can steal it */
+void share_work(worker_t *self, work_t *work) {
+    #pragma omp atomic
+    pending++;
 
-// If Redistribute
-#ifdef REDIST_ON
-                if (top < WORK_TRESH) {
-                    robin = round_robin(slaves_state, ntasks, WORKING, slave);
+    if (!kd_deque_push(self->deque, work)) {
+        fprintf(stderr, "Deque overflow\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    self->spawned++;
+}
 
-                    if (robin != -1) {
+/* Splits subtrees off the top of the search while the deque runs low */
+void split_work(worker_t *self) {
+    work_t *work;
 
-                        MPI_Send(&msg, 1, MPI_INT, robin, RED_TAG, MPI_COMM_WORLD);
-                        slaves_state[robin] = REQUEST;
-                    } else {
+    while (n_threads > 1 && kd_deque_size(self->deque) < DEQUE_SLACK) {
+        work = new_work(self->pool);
+        work->history_len = kd_search_split(self->search, gREDIST.split_left,
+                                            work->history);
+        if (work->history_len == 0) {
+            free_work(self->pool, work);
+            break;
+        }
+        share_work(self, work);
+    }
+}
 
-                        lost_work++;
+/* The first solution found is kept for thread 0 to send. The work it came
+ * from stays pending, so thread 0 never blocks before seeing it. */
+void keep_solution(worker_t *self) {
+    #pragma omp critical
+    {
+        if (!found) {
+            solution = new_work(self->pool);
+            solution->history_len = kd_search_moves(self->search,
+                                                    solution->history);
+            #pragma omp atomic write
+            found = 1;
+        }
+    }
+}
 
-                        robin = 1;
-                    }
-                }
-#endif
+/* Counting: thread 0 reports the solutions of the rank to rank 0 between
+ * search quanta, rank 0 stops the colony once they reach the limit */
+void count_solution(worker_t *self) {
+    self->solutions++;
+    #pragma omp atomic
+    unreported++;
+}
 
-            } else {
-                // There is no work available
-                idle_slaves++;
-                slaves_state[slave] = IDLE;
+/* Thread 0 only */
+void report_count() {
+    long count;
 
-                if (idle_slaves == ntasks - 1) {
-                    // No work here, no slaves working, its vacation time!
-                    // No solution found
-                    printf("No solution\n");
-                    break;
-                }
-#ifdef REDIST_ON
-                // Redistribute (if has not passed threshold)
-                if (top < WORK_TRESH) {
-                    robin = round_robin(slaves_state, ntasks, WORKING, slave);
+    #pragma omp atomic capture
+    {
+        count = unreported;
+        unreported = 0;
+    }
+    if (count > 0) {
+        MPI_Send(&count, 1, MPI_LONG, 0, COUNT_TAG, MPI_COMM_WORLD);
+    }
+}
 
-                    if (robin != -1) {
+/* Searches a piece of work to the end, unless the rank stops first */
+void search_work(worker_t *self, work_t *work) {
+    int res;
+    bool valid = restore_from_history(self->search, work->history,
+                                      work->history_len);
+
+    free_work(self->pool, work);
+    self->tasks++;
+    self->busy = valid;
+    while (valid && !stopped()) {
+        res = kd_search_run(self->search, gMOAS->n);
+        if (res == KD_SOLVED && gOPTS.count > 0) {
+            // Running again backtracks to the next solution
+            count_solution(self);
+            continue;
+        } else if (res == KD_SOLVED) {
+            self->busy = false;
+            keep_solution(self);
+            return;
+        } else if (res == KD_EXHAUSTED) {
+            break;
+        }
+        split_work(self);
+        park();
+    }
+    self->busy = false;
 
-                        MPI_Send(&msg, 1, MPI_INT, robin, RED_TAG, MPI_COMM_WORLD);
-                        slaves_state[robin] = REQUEST;
-                    } else {
+    #pragma omp atomic
+    pending--;
+}
 
-                        lost_work++;
+/* Every thread but 0 only searches the work of its rank */
+void work(int id) {
+    worker_t *self = &workers[id];
+    work_t *work;
 
-                        robin = 1;
-                    }
-                }
-#endif
-            }
-        } else if (status.MPI_TAG == SOLUTION_TAG) {
+    while (!done()) {
+        park();
+        work = kd_deque_pop(self->deque);
+        if (work == NULL && (work = steal_local(id)) != NULL) {
+            self->stolen++;
+        }
 
-            work = receive_work(slave, msg, SOLUTION_TAG);
+        if (work != NULL) {
+            search_work(self, work);
+        } else {
+            // Let the busy threads run when there are more threads than cores
+            sched_yield();
+        }
+    }
+}
 
-            // Save to grid and print
-            if (work->history_len == gMOAS->n_empty) {
-                restore_from_history(work->history, work->history_len);
-                print_grid();
-            }
+/* Thread 0 searches like the others and, between search quanta, is the
+ * only one that talks to the other ranks. Once rank 0 tells the colony to
+ * die it stops the other threads. */
+void work_and_talk(int my_id) {
+    worker_t *self = &workers[0];
+    MPI_Status status;
+    int flag, res, tag, messages, thieves, solved, i, msg = 0;
+    bool working = false, dying = false, passive, checkpoint;
+    long left, queued;
+    double start;
+    work_t *work;
 
-            // Sends DIE_TAG by broadcast
+    while (1) {
+        #pragma omp atomic read
+        solved = found;
+        if (solved) {
+            // Send solution to master, then wait for DIE_TAG
+            printf("Process %d found solution\n", my_id);
+            send_work(solution->history, solution->history_len, 0,
+                      SOLUTION_TAG);
+            free_work(self->pool, solution);
+            do {
+                MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
+                          &status);
+                tag = handle_message(&status, false, true);
+                if (tag == CHECKPOINT_TAG) {
+                    // The run ends with this solution, nothing to add
+                    take_checkpoint(false, false);
+                }
+            } while (tag != DIE_TAG);
             break;
-        } else if (status.MPI_TAG == WORK_TAG) {
+        }
 
-            work = receive_work(slave, msg, WORK_TAG);
+        // Take in everything that arrived, wait for it when idle
+        #pragma omp atomic read
+        left = pending;
+        start = MPI_Wtime();
+        if (!working && gSELF.top == 0 && left == 0 && !gREDIST.rma) {
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            flag = 1;
+            gSELF.idle_time += MPI_Wtime() - start;
+            start = MPI_Wtime();
+        } else {
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag,
+                       &status);
+        }
+        messages = thieves = 0;
+        checkpoint = false;
+        while (flag) {
+            tag = handle_message(&status, working, false);
+            if (tag == DIE_TAG) {
+                dying = true;
+                break;
+            }
+            messages++;
+            thieves += tag == STEAL_TAG;
+            checkpoint = checkpoint || tag == CHECKPOINT_TAG;
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag,
+                       &status);
+        }
+        flush_outbox();
+        if (gOPTS.count > 0) {
+            report_count();
+        }
+        MPI_Win_sync(stop_win);
+        dying = dying || stop_raised();
+        if (checkpoint && !dying) {
+            take_checkpoint(true, working);
+        }
+        gSELF.mpi_time += MPI_Wtime() - start;
+        if (dying) {
+            break;
+        }
 
-            // Handle work redistributed
-            if (idle_slaves > 0) {
-                // Find one idle slave
-                robin = round_robin(slaves_state, ntasks, IDLE, slave);
+        // Poll less while nobody calls, answer thieves sooner once they do
+        if (thieves > 0) {
+            gSELF.quantum = gSELF.quantum / 4 > gMOAS->n ?
+                            gSELF.quantum / 4 : gMOAS->n;
+        } else if (messages == 0 && gSELF.quantum < QUANTUM_MAX) {
+            gSELF.quantum *= 2;
+        }
 
-                assert(robin != -1);
+        // Work from other ranks feeds the other threads first
+        while (n_threads > 1 && gSELF.top > 0 &&
+                kd_deque_size(self->deque) < DEQUE_SLACK) {
+            share_work(self, gSELF.stack[--gSELF.top]);
+        }
 
-                // Send work
-                send_work(work->history, work->history_len, robin, WORK_TAG);
+        if (!working) {
+            work = NULL;
+            if (gSELF.top > 0) {
+                work = gSELF.stack[--gSELF.top];
+                #pragma omp atomic
+                pending++;
+            } else if ((work = kd_deque_pop(self->deque)) == NULL &&
+                       n_threads > 1 && (work = steal_local(0)) != NULL) {
+                self->stolen++;
+            }
+            if (work != NULL) {
+                // Sets state to the end of history
+                working = restore_from_history(self->search, work->history,
+                                               work->history_len);
+                free_work(self->pool, work);
+                self->tasks++;
+                if (!working) {
+                    #pragma omp atomic
+                    pending--;
+                }
+            }
+        }
 
-                slaves_state[robin] = WORKING;
-                idle_slaves--;
+        if (working) {
+            // Do work
+            start = MPI_Wtime();
+            res = kd_search_run(self->search, gSELF.quantum);
+            gSELF.search_time += MPI_Wtime() - start;
+
+            if (res == KD_SOLVED && gOPTS.count > 0) {
+                count_solution(self);
+            } else if (res == KD_SOLVED) {
+                keep_solution(self);
+                continue;
+            } else if (res == KD_EXHAUSTED) {
+                working = false;
+                kd_search_reset(self->search);
+                #pragma omp atomic
+                pending--;
             } else {
-                // Add to work queue
+                split_work(self);
+            }
+        } else if (left > 0 || gREDIST.rma) {
+            // The other threads are busy, or work may show up in a pool
+            sched_yield();
+        }
 
-                stack[top++] = *work;
+        start = MPI_Wtime();
+        #pragma omp atomic read
+        left = pending;
+        passive = gSELF.top == 0 && left == 0;
+        queued = gSELF.top;
+        for (i = 0; i < n_threads; i++) {
+            queued += kd_deque_size(workers[i].deque);
+        }
+        if (passive && gSELF.safra.has_token) {
+            // Passive: hand the probe on
+            pass_token();
+        }
+        if (gREDIST.rma) {
+            // Offer work while busy, claim some once low
+            if (!passive && gSELF.ntasks > 2) {
+                fill_pool(working);
+            }
+            if (passive || queued < gREDIST.work_tresh) {
+                claim_work(passive);
             }
+        } else if (gREDIST.on && gSELF.victim == -1 && gSELF.ntasks > 2 &&
+                   (passive || queued < gREDIST.work_tresh)) {
+            // Look for work elsewhere, ahead of time if the stack runs low
+            gSELF.victim = pick_victim();
+            gSELF.requests++;
+            MPI_Send(&msg, 1, MPI_INT, gSELF.victim, STEAL_TAG, MPI_COMM_WORLD);
+        }
+        gSELF.mpi_time += MPI_Wtime() - start;
+    }
 
-            // Slave that shared work state.
-            if (lost_work > 0) {
-                lost_work--;
+    #pragma omp atomic write
+    gDONE = 1;
+}
 
-                MPI_Send(&msg, 1, MPI_INT, slave, RED_TAG, MPI_COMM_WORLD);
-                slaves_state[slave] = REQUEST;
-            } else {
+/* Slave is run by less fortunate nodes and does all of the heavy lifting using
+ * a bit mask method. Its threads work off the stack of the rank and, once it
+ * runs dry, thread 0 steals from a random peer. */
+long slave(int my_id) {
+    int ntasks, i;
+    long nodes = 0;
 
-                slaves_state[slave] = WORKING;
-            }
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    init_self(ntasks, my_id);
+
+    // Receive map
+    if (build_map() != 0) {
+        return 0;
+    }
+    deal_work(NULL, 0);
+    init_pool();
+    gSELF.quantum = gMOAS->n;
+    init_workers();
+
+    #pragma omp parallel num_threads(n_threads)
+    {
+        if (omp_get_thread_num() == 0) {
+            work_and_talk(my_id);
+        } else {
+            work(omp_get_thread_num());
         }
     }
 
-    exit_colony(ntasks);
+    drain();
+    printf("Process %d: %ld stolen, %ld given, %.3fs search, %.3fs mpi, "
+           "%.3fs idle\n", my_id, gSELF.stolen, gSELF.given, gSELF.search_time,
+           gSELF.mpi_time, gSELF.idle_time);
+    for (i = 0; i < n_threads; i++) {
+        if (n_threads > 1) {
+            printf("Process %d thread %d: %ld tasks, %ld spawned, %ld stolen, "
+                   "%ld nodes\n", my_id, i, workers[i].tasks,
+                   workers[i].spawned, workers[i].stolen,
+                   workers[i].search->nodes);
+        }
+        nodes += workers[i].search->nodes;
+        gSELF.solutions += workers[i].solutions;
+    }
+    free_workers();
+    free_self();
     free_gMOAS();
+    return nodes;
 }
 
-void redistribute(int init_root, int *state, int my_id) {
-    int root;
-    work_t work;
+/* Batch mode (-b). Rank 0 reads the stream a chunk at a time and deals the
+ * puzzles round-robin to the slaves with MPI_Scatterv, as their box size
+ * followed by the cells. Every slave solves its share across its threads,
+ * one puzzle per thread, and MPI_Gatherv brings back a solved flag and the
+ * cells of each one for rank 0 to print in input order. A round with no
+ * puzzles ends it.
+ *
+ * When the input is a binary corpus every rank can open, nothing is
+ * scattered: rank 0 only broadcasts how many puzzles the round has and
+ * each slave decodes its own share out of the corpus by index. */
+typedef struct batch {
+    kd_puzzle_t **puzzles;
+    int count;
+    int *ints; /* scattered, then gathered */
+    int *counts;
+    int *displs;
+    kd_corpus_t *corpus; /* read by every rank, NULL to scatter */
+    long first;          /* index of the round's first puzzle in it */
+} batch_t;
+
+/* Side of puzzle i of the round, 0 if rank 0 found it invalid */
+int batch_n(const batch_t *b, int i) {
+    if (b->corpus != NULL) {
+        return b->corpus->box_size * b->corpus->box_size;
+    }
+    return b->puzzles[i] != NULL ? b->puzzles[i]->n : 0;
+}
 
-    // Redistribute work and send to master
-    // find current root
-    root = root_history(init_root);
+/* Ints a puzzle of side n takes on the way out and its result on the way
+ * back */
+int batch_out(int n) {
+    return 1 + n * n;
+}
 
-    // printf("Current root of process %d is %d (base is %d)\n", my_id, root,
-    // init_root);
+/* Deals the puzzles of rank 0 to the slaves, puzzles and count are filled
+ * on the slaves */
+void scatter_batch(batch_t *b) {
+    int ntasks = gSELF.ntasks, mine, r, i, k, *at, *block = NULL;
 
-    if (((gMOAS->n) * (gMOAS->n) - root) < gMOAS->box_size * 5) {
+    if (gSELF.id == 0) {
+        memset(b->counts, 0, ntasks * sizeof(int));
+        for (i = k = 0; i < b->count; i++) {
+            if (batch_n(b, i) > 0) {
+                b->counts[1 + k++ % (ntasks - 1)] += batch_out(batch_n(b, i));
+            }
+        }
+        for (r = 1; r < ntasks; r++) {
+            b->displs[r] = b->displs[r - 1] + b->counts[r - 1];
+        }
+    }
 
-        *state = WORKING;
-    } else if (root == -1) {
+    if (b->corpus != NULL) {
+        /* Results only, the slaves take their puzzles themselves */
+        if (gSELF.id != 0) {
+            int n = batch_n(b, 0), count = b->count;
+            for (i = b->count = 0; i < count; i++) {
+                if (1 + i % (ntasks - 1) == gSELF.id) {
+                    b->puzzles[b->count++] = kd_corpus_puzzle(b->corpus,
+                                                              b->first + i);
+                }
+            }
+            b->ints = (int *)realloc(b->ints, (b->count * batch_out(n) + 1) *
+                                     sizeof(int));
+        }
+        return;
+    }
 
-        *state = REQUEST;
-    } else {
-        // make copy of history until root_history
-        // print_history(work->history, work->history_len);
-        // change history
-        rewrite_history(root);
-        copy_history(&work, root + 1);
+    if (gSELF.id == 0) {
+        block = (int *)malloc((b->displs[ntasks - 1] + b->counts[ntasks - 1] + 1) *
+                              sizeof(int));
+        for (r = 1; r < ntasks; r++) {
+            at = block + b->displs[r];
+            for (i = k = 0; i < b->count; i++) {
+                if (b->puzzles[i] != NULL && 1 + k++ % (ntasks - 1) == r) {
+                    *at++ = b->puzzles[i]->box_size;
+                    memcpy(at, b->puzzles[i]->known,
+                           (batch_out(b->puzzles[i]->n) - 1) * sizeof(int));
+                    at += batch_out(b->puzzles[i]->n) - 1;
+                }
+            }
+        }
+    }
 
-        // send work to master
-        send_work(work.history, work.history_len, 0, WORK_TAG);
+    MPI_Scatter(b->counts, 1, MPI_INT, &mine, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    b->ints = (int *)realloc(b->ints, (mine + 1) * sizeof(int));
+    MPI_Scatterv(block, b->counts, b->displs, MPI_INT, b->ints, mine, MPI_INT,
+                 0, MPI_COMM_WORLD);
+    free(block);
+
+    if (gSELF.id != 0) {
+        b->count = 0;
+        for (at = b->ints; at < b->ints + mine; at += 1 + k * k) {
+            k = *at * *at;
+            b->puzzles[b->count++] = kd_new_puzzle(*at, at + 1);
+        }
+    }
+}
 
-        // printf("Process %d redistributed work\n", my_id);
-        *state = WORKING;
+/* Slave: solves its puzzles and sends back their results in place of them,
+ * a flag of -1 for a corpus record that was not a valid puzzle. Counting,
+ * the flag is the count and the cells are left alone. */
+long solve_batch(batch_t *b) {
+    long nodes = 0;
+    int i, *at = b->ints, **cells;
+
+    cells = (int **)malloc((b->count + 1) * sizeof(int *));
+    for (i = 0; i < b->count; i++) {
+        // Same size as the puzzle that came in
+        cells[i] = at + 1;
+        at += batch_out(batch_n(b, i));
+    }
+    #pragma omp parallel for schedule(dynamic) num_threads(n_threads) \
+        reduction(+:nodes)
+    for (i = 0; i < b->count; i++) {
+        long searched = 0;
+        if (b->puzzles[i] == NULL) {
+            cells[i][-1] = -1;
+            continue;
+        }
+        if (gOPTS.count > 0) {
+            long count = kd_count(b->puzzles[i], &gOPTS, &searched);
+            cells[i][-1] = count < INT_MAX ? (int)count : INT_MAX;
+        } else {
+            cells[i][-1] = kd_solve(b->puzzles[i], &gOPTS, cells[i], &searched);
+        }
+        nodes += searched;
+    }
+    for (i = 0; i < b->count; i++) {
+        kd_free_puzzle(b->puzzles[i]);
+    }
+    free(cells);
+    MPI_Gatherv(b->ints, (int)(at - b->ints), MPI_INT, NULL, NULL, NULL,
+                MPI_INT, 0, MPI_COMM_WORLD);
+    return nodes;
+}
 
-        free(work.history);
+/* Rank 0: prints the results gathered into b->ints in input order */
+void print_batch(batch_t *b, long *solved) {
+    int ntasks = gSELF.ntasks, i, k, r, *at, **next;
+
+    b->ints = (int *)realloc(b->ints, (b->displs[ntasks - 1] +
+                                       b->counts[ntasks - 1] + 1) * sizeof(int));
+    MPI_Gatherv(NULL, 0, MPI_INT, b->ints, b->counts, b->displs, MPI_INT, 0,
+                MPI_COMM_WORLD);
+    next = (int **)malloc(ntasks * sizeof(int *));
+    for (r = 1; r < ntasks; r++) {
+        next[r] = b->ints + b->displs[r];
     }
+    for (i = k = 0; i < b->count; i++) {
+        if (batch_n(b, i) == 0) {
+            puts("Invalid puzzle");
+            continue;
+        }
+        r = 1 + k++ % (ntasks - 1);
+        at = next[r];
+        next[r] += batch_out(batch_n(b, i));
+        if (at[0] >= 0 && gOPTS.count > 0) {
+            kd_print_count(&gOPTS, at[0]);
+            *solved += at[0] > 0;
+        } else if (at[0] > 0) {
+            kd_print_line(batch_n(b, i), at + 1);
+            (*solved)++;
+        } else {
+            puts(at[0] < 0 ? "Invalid puzzle" : "No solution");
+        }
+        kd_free_puzzle(b->puzzles[i]);
+        b->puzzles[i] = NULL;
+    }
+    free(next);
 }
 
-/* Slave is run by less fortunate nodes and does all of the heavy lifting using
- * a bit mask method */
-void slave(int my_id) {
-    MPI_Status status;
-    MPI_Request request;
-    int msg = 0, top, *play;
-    int i, flag = -1, state = IDLE, size;
-    int init_root, init_pos, pos, n, res, history_len;
-    work_t *work;
+/* Every rank opens the corpus at filename, false (and none has it open) if
+ * any could not */
+bool open_batch_corpus(batch_t *b, const char *filename, kd_reader_t *in) {
+    int ok;
 
-    // Receive map
-    build_map();
-    // print_grid();
+    if (gSELF.id == 0) {
+        b->corpus = in->corpus;
+    } else {
+        b->corpus = kd_open_corpus(filename);
+    }
+    ok = b->corpus != NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (!ok) {
+        if (gSELF.id != 0) {
+            kd_close_corpus(b->corpus);
+        }
+        b->corpus = NULL;
+    }
+    return ok;
+}
 
-    while (1) {
+/* Every rank runs it, rank 0 reads filename (stdin if NULL or "-") */
+void batch(const char *filename) {
+    batch_t b = {NULL, 0, NULL, NULL, NULL, NULL, 0};
+    int ntasks, chunk, round, got = 1, direct = 0;
+    long nodes = 0, total_nodes = 0, puzzles = 0, solved = 0;
+    double start = MPI_Wtime();
+    kd_reader_t *in = NULL;
 
-        if (flag != 0) {
-            MPI_Irecv(&msg, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &request);
-            flag = 0;
-        }
-
-        MPI_Test(&request, &flag, &status);
-
-        if (flag == 1) {
-            if (status.MPI_TAG == WORK_TAG) {
-
-                // printf("Process %d got work of size %d\n", my_id, msg);
-                work = receive_work(0, msg, WORK_TAG);
-
-                // Sets state to the beggining of history
-                init_root = work->history_len - 1;
-                init_pos = work->history[init_root].x * gMOAS->n +
-                           work->history[init_root].y + 1;
-                pos = init_pos;
-                n = 0;
-                restore_from_history(work->history, work->history_len);
-
-                state = WORKING;
-            } else if (status.MPI_TAG == RED_TAG && state == WORKING) {
-                redistribute(init_root, &state, my_id);
-            } else if (status.MPI_TAG == SOLUTION_TAG) {
-                printf("Process %d found solution\n", my_id);
-                free_gMOAS();
-                return;
-            } else if (status.MPI_TAG == DIE_TAG) {
-                /* printf("Process %d DIED\n", my_id); */
-                free_gMOAS();
-                return;
-            }
-            flag = -1;
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    init_self(ntasks, gSELF.id);
+    chunk = (ntasks - 1) * BATCH_CHUNK;
+    b.puzzles = (kd_puzzle_t **)calloc(chunk, sizeof(kd_puzzle_t *));
+    if (gSELF.id == 0) {
+        b.counts = (int *)calloc(ntasks, sizeof(int));
+        b.displs = (int *)calloc(ntasks, sizeof(int));
+        in = kd_open_reader(filename);
+        if (in == NULL) {
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        /* The slaves can only open a named corpus themselves */
+        direct = in->corpus != NULL && filename != NULL &&
+                 strcmp(filename, "-") != 0;
+    }
+    MPI_Bcast(&direct, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (direct && !open_batch_corpus(&b, filename, in) && gSELF.id == 0) {
+        fprintf(stderr, "Corpus not readable by every rank, scattering it\n");
+    }
 
-        if (state != IDLE) {
-
-            // Do work
-            res = solve_nsteps(init_pos, &pos, &n, gMOAS->n * gMOAS->n, gMOAS->n);
-
-            if (res == 0) {
-                state = IDLE;
-
-                if (gDONE) {
-                    // Send solution to master
-                    send_work(gMOAS->mask->history, gMOAS->mask->history_len, 0,
-                              SOLUTION_TAG);
-                } else {
-                    // Send msg NO_WORK_TAG to master
-                    msg = 0;
-                    MPI_Send(&msg, 1, MPI_INT, 0, NO_WORK_TAG, MPI_COMM_WORLD);
+    while (1) {
+        if (gSELF.id == 0 && b.corpus != NULL) {
+            b.count = (int)(b.corpus->count - b.first < chunk ?
+                            b.corpus->count - b.first : chunk);
+            puzzles += b.count;
+        } else if (gSELF.id == 0) {
+            for (b.count = 0; got != 0 && b.count < chunk; b.count++) {
+                got = kd_reader_next(in, &b.puzzles[b.count]);
+                if (got == 0) {
+                    break;
                 }
-
-                clear_history();
             }
+            puzzles += b.count;
         }
-
-        if (state == REQUEST) {
-
-            redistribute(init_root, &state, my_id);
+        MPI_Bcast(&b.count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (b.count == 0) {
+            break;
         }
+        /* Slaves are left with their share in count */
+        round = b.count;
+        scatter_batch(&b);
+        if (gSELF.id == 0) {
+            print_batch(&b, &solved);
+        } else {
+            nodes += solve_batch(&b);
+        }
+        b.first += round;
+    }
+
+    MPI_Reduce(&nodes, &total_nodes, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (gSELF.id == 0) {
+        kd_print_batch(&gOPTS, puzzles, solved, total_nodes,
+                       MPI_Wtime() - start);
+        kd_close_reader(in);
+    } else {
+        kd_close_corpus(b.corpus);
     }
+    free(b.puzzles);
+    free(b.ints);
+    free(b.counts);
+    free(b.displs);
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s " KD_OPTS_USAGE " [--threads N] [--redistribute | --rma]"
+           " [--work-tresh N] [--split-left N] [--checkpoint FILE"
+           " [--every SECONDS] [--resume]] [filename]\n"
+           "       %s -b [--threads N] [filename], stdin by default\n", prog,
+           prog);
+    exit(-1);
 }
 
 int main(int argc, char *argv[]) {
 
-    int my_id;
-    if (argc < 2) {
-        printf("Usage: ./program [filename]\n");
-        exit(-1);
-    }
-    MPI_Init(&argc, &argv);
+    int my_id, ntasks, opt, provided;
+    long nodes = 0, total_nodes = 0, solutions = 0;
+    static const struct option long_opts[] = {
+        {"threads", required_argument, NULL, 'T'},
+        {"redistribute", no_argument, NULL, 'R'},
+        {"work-tresh", required_argument, NULL, 'W'},
+        {"split-left", required_argument, NULL, 'S'},
+        {"rma", no_argument, NULL, 'M'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"every", required_argument, NULL, 'E'},
+        {"resume", no_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Only thread 0 of each rank makes MPI calls
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &my_id);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+
+    kd_default_options(&gOPTS);
+    while ((opt = getopt_long(argc, argv, KD_OPTS, long_opts, NULL)) != -1) {
+        if (opt == 'T') {
+            n_threads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        } else if (opt == 'R') {
+            gREDIST.on = true;
+        } else if (opt == 'W') {
+            gREDIST.work_tresh = atoi(optarg);
+        } else if (opt == 'M') {
+            gREDIST.on = gREDIST.rma = true;
+        } else if (opt == 'S') {
+            gREDIST.split_left = atoi(optarg);
+        } else if (opt == 'C') {
+            gCKPT.path = optarg;
+        } else if (opt == 'E' && atof(optarg) > 0) {
+            gCKPT.every = atof(optarg);
+        } else if (opt == 'U') {
+            gCKPT.resume = true;
+        } else if (!kd_parse_option(&gOPTS, opt, optarg)) {
+            usage(argv[0]);
+        }
+    }
+    if ((optind >= argc && !gOPTS.batch) ||
+            (gCKPT.resume && gCKPT.path == NULL)) {
+        usage(argv[0]);
+    }
+    if (gCKPT.path != NULL && gOPTS.count > 0) {
+        // Checkpoints do not hold the solutions counted so far
+        if (my_id == 0) {
+            fprintf(stderr, "Counting runs cannot be checkpointed\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (gOPTS.engine != KD_ENGINE_MASK && !gOPTS.batch) {
+        // Work is split off the mask search
+        if (my_id == 0) {
+            fprintf(stderr, "-e dlx is serial only\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (provided < MPI_THREAD_FUNNELED && n_threads > 1) {
+        if (my_id == 0) {
+            fprintf(stderr, "MPI without thread support, running 1 thread\n");
+        }
+        n_threads = 1;
+    }
+    if (ntasks < 2) {
+        // Rank 0 only deals the work out
+        fprintf(stderr, "Run with at least 2 processes\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    gSELF.id = my_id;
+    if (gOPTS.batch) {
+        batch(optind < argc ? argv[optind] : NULL);
+        MPI_Finalize();
+        return 0;
+    }
+
+    init_stop();
     if (my_id == 0) {
-        master(argv[1]);
+        nodes = master(argv[optind]);
     } else {
-        slave(my_id);
+        nodes = slave(my_id);
+    }
+    free_stop();
+
+    // Solutions counted by every rank, with -c and -u
+    if (gOPTS.count > 0) {
+        MPI_Reduce(&gSELF.solutions, &solutions, 1, MPI_LONG, MPI_SUM, 0,
+                   MPI_COMM_WORLD);
+        if (my_id == 0) {
+            kd_print_count(&gOPTS, solutions);
+        }
     }
+
+    // Nodes searched by every rank, rank 0 splitting the tree included, to
+    // compare cell orderings. Negative if the puzzle could not be read.
+    MPI_Reduce(&nodes, &total_nodes, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (my_id == 0 && total_nodes >= 0) {
+        kd_print_nodes(&gOPTS, total_nodes);
+    }
+
     MPI_Finalize();
     return 0;
 }
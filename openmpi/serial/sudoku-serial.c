@@ -7,190 +7,154 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-#define N_ARGS 2
-#define EMPTY 0
-
-typedef struct moas {
-    int n;
-    int box_size;
-    int **grid;
-    int **known;
-    __uint128_t *rows;
-    __uint128_t *cols;
-    __uint128_t *squares;
-    __uint128_t *bits;
-} moas_t;
-
-moas_t *gMOAS;
-bool gDONE;
+#include "kuduro.h"
 
-int square(int i, int j) {
-    return (i / gMOAS->box_size) * gMOAS->box_size + j / gMOAS->box_size;
-}
+#define N_ARGS 2
 
-void set_cell(int i, int j, int n) {
-    gMOAS->grid[i][j] = n;
-    gMOAS->rows[i] |= gMOAS->bits[n];
-    gMOAS->cols[j] |= gMOAS->bits[n];
-    gMOAS->squares[square(i, j)] |= gMOAS->bits[n];
-}
+kd_puzzle_t *gPUZZLE;
+kd_search_t *gSEARCH;
+kd_dlx_t *gDLX;
+bool gDONE;
 
-int clear_cell(int i, int j) {
-    int n = gMOAS->grid[i][j];
-    gMOAS->grid[i][j] = 0;
-    gMOAS->rows[i] &= ~gMOAS->bits[n];
-    gMOAS->cols[j] &= ~gMOAS->bits[n];
-    gMOAS->squares[square(i, j)] &= ~gMOAS->bits[n];
-    return n;
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s " KD_OPTS_USAGE " filename\n"
+            "       %s -b [filename], stdin by default\n", prog, prog);
+    exit(1);
 }
 
-void print_grid() {
-    for (int x = 0; x < gMOAS->n; x++) {
-        for (int y = 0; y < gMOAS->n; y++) {
-            if (gMOAS->known[x][y]) {
-                printf("%2d ", gMOAS->known[x][y]);
-            } else {
-                printf("%2d ", gMOAS->grid[x][y]);
-            }
-        }
-        printf("\n");
+void solve() {
+    if (gDLX != NULL) {
+        gDONE = kd_dlx_run(gDLX, 0) == KD_SOLVED;
+    } else {
+        gDONE = kd_search_run(gSEARCH, 0) == KD_SOLVED;
     }
-    printf("\n");
 }
 
-bool is_available(int i, int j, int n) {
-    return (gMOAS->rows[i] & gMOAS->bits[n]) == 0 &&
-           (gMOAS->cols[j] & gMOAS->bits[n]) == 0 &&
-           (gMOAS->squares[square(i, j)] & gMOAS->bits[n]) == 0;
-}
+/* -c, -u: solves again from each solution until limit of them, prints the
+ * first one */
+long count_solutions(kd_board_t *board, long limit) {
+    long count = 0;
 
-bool advance_cell(int i, int j) {
-    int n = clear_cell(i, j);
-    while (++n <= gMOAS->n) {
-        if (is_available(i, j, n)) {
-            set_cell(i, j, n);
-            return true;
+    while (count < limit) {
+        solve();
+        if (!gDONE) {
+            break;
+        }
+        if (++count == 1) {
+            kd_print_board(board);
         }
     }
-    return false;
+    return count;
 }
 
-void solve() {
-    int pos = 0;
-    int total = gMOAS->n * gMOAS->n;
-    while (1) {
-        while (pos < total && gMOAS->known[pos / gMOAS->n][pos % gMOAS->n]) {
-            ++pos;
+/* -b: solves the puzzles of the stream one after the other */
+void batch(kd_reader_t *in, const kd_options_t *opts) {
+    clock_t begin = clock();
+    long puzzles = 0, solved = 0, nodes, total = 0;
+    int *cells, got;
+
+    while ((got = kd_reader_next(in, &gPUZZLE)) != 0) {
+        puzzles++;
+        if (got < 0) {
+            puts("Invalid puzzle");
+            continue;
         }
-        if (pos >= total) {
-            gDONE = true;
-            break;
+        cells = (int *)malloc(gPUZZLE->n * gPUZZLE->n * sizeof(int));
+        if (cells == NULL) {
+            exit(2);
         }
-        if (advance_cell(pos / gMOAS->n, pos % gMOAS->n)) {
-            ++pos;
+        if (opts->count > 0) {
+            long count = kd_count(gPUZZLE, opts, &nodes);
+            kd_print_count(opts, count);
+            solved += count > 0;
+        } else if (kd_solve(gPUZZLE, opts, cells, &nodes)) {
+            kd_print_line(gPUZZLE->n, cells);
+            solved++;
         } else {
-            do {
-                --pos;
-            } while (pos >= 0 && gMOAS->known[pos / gMOAS->n][pos % gMOAS->n]);
-            if (pos < 0) {
-                break;
-            }
+            puts("No solution");
         }
+        total += nodes;
+        free(cells);
+        kd_free_puzzle(gPUZZLE);
     }
+    kd_print_batch(opts, puzzles, solved, total,
+                   (double)(clock() - begin) / CLOCKS_PER_SEC);
 }
 
-int read_file(const char *filename) {
-    FILE *sudoku_file;
-    int box_size;
-    uint8_t num;
-
-    /* Opens file */
-    sudoku_file = fopen(filename, "re");
-    if (sudoku_file == NULL) {
-        fprintf(stderr, "Could not open file\n");
-        exit(2);
-    }
-
-    /* Scans first line (aka the square size) */
-    if (fscanf(sudoku_file, "%d", &box_size) == EOF) {
-        fprintf(stderr, "Could not read file\n");
-        exit(2);
-    }
+int main(int argc, char *argv[]) {
+    kd_options_t opts;
+    kd_board_t *board;
+    int opt;
 
-    gMOAS = (moas_t *)malloc(sizeof(moas_t));
-    if (gMOAS == NULL) {
-        fprintf(stderr, "Unable to init MOAS");
-        exit(2);
-    }
-
-    gMOAS->box_size = box_size;
-    gMOAS->n = box_size * box_size;
-    /* Init our bit mask */
-    gMOAS->bits = (__uint128_t *)calloc(gMOAS->n + 1, sizeof(__uint128_t));
-    for (__int128_t n = 1; n < gMOAS->n + 1; n++) {
-        gMOAS->bits[n] = (__uint128_t)1 << n;
+    kd_default_options(&opts);
+    while ((opt = getopt(argc, argv, KD_OPTS)) != -1) {
+        if (!kd_parse_option(&opts, opt, optarg)) {
+            usage(argv[0]);
+        }
     }
 
-    /* Read the file */
-    gMOAS->known = (int **)calloc(gMOAS->n, sizeof(int *));
-    gMOAS->grid = (int **)calloc(gMOAS->n, sizeof(int *));
-    gMOAS->rows = (__uint128_t *)calloc(gMOAS->n, sizeof(__uint128_t));
-    gMOAS->cols = (__uint128_t *)calloc(gMOAS->n, sizeof(__uint128_t));
-    gMOAS->squares = (__uint128_t *)calloc(gMOAS->n, sizeof(__uint128_t));
-    for (int x = 0; x < gMOAS->n; x++) {
-        gMOAS->known[x] = (int *)calloc(gMOAS->n, sizeof(int));
-        gMOAS->grid[x] = (int *)calloc(gMOAS->n, sizeof(int));
-        for (int y = 0; y < gMOAS->n; y++) {
-            fscanf(sudoku_file, "%2" SCNu8, &num);
-            set_cell(x, y, num);
-            gMOAS->known[x][y] = num;
+    if (opts.batch) {
+        kd_reader_t *in = kd_open_reader(optind < argc ? argv[optind] : NULL);
+        if (in == NULL) {
+            exit(1);
         }
+        batch(in, &opts);
+        kd_close_reader(in);
+        return 0;
     }
 
-    fclose(sudoku_file);
-    return 0;
-}
-
-void free_gMOAS() {
-    for (int x = 0; x < gMOAS->n; x++) {
-        free(gMOAS->known[x]);
-        free(gMOAS->grid[x]);
+    if (argc - optind < N_ARGS - 1) {
+        usage(argv[0]);
     }
 
-    free(gMOAS->known);
-    free(gMOAS->grid);
-    free(gMOAS->rows);
-    free(gMOAS->cols);
-    free(gMOAS->squares);
-    free(gMOAS);
-}
-
-int main(int argc, char const *argv[]) {
-    if (argc < N_ARGS) {
-        fprintf(stderr, "Usage: %s filename\n", argv[0]);
+    gPUZZLE = kd_read_file(argv[optind]);
+    if (gPUZZLE == NULL) {
+        fprintf(stderr, "Unable to read file %s\n", argv[optind]);
         exit(1);
     }
 
-    if (read_file(argv[1]) != 0) {
-        fprintf(stderr, "Unable to read file %s\n", argv[1]);
-        exit(1);
+    // The givens, the engines propagate them as they are built
+    board = kd_new_board(gPUZZLE);
+    if (board == NULL) {
+        exit(2);
     }
+    kd_print_board(board);
+    kd_free_board(board);
 
-    print_grid();
-
-    // Solve the puzzle
-    solve();
+    if (opts.engine == KD_ENGINE_DLX) {
+        gDLX = kd_new_dlx(gPUZZLE);
+        if (gDLX == NULL) {
+            exit(2);
+        }
+        board = gDLX->board;
+    } else {
+        gSEARCH = kd_new_search(gPUZZLE, &opts);
+        if (gSEARCH == NULL) {
+            exit(2);
+        }
+        board = gSEARCH->board;
+    }
 
-    if (gDONE == true) {
-        print_grid();
-        printf("Solved Sudoku\n");
-        // Solution found
+    // Solve the puzzle, or count its solutions
+    if (opts.count > 0) {
+        kd_print_count(&opts, count_solutions(board, opts.count));
     } else {
-        printf("Did not solve Sudoku\n");
-        // No solution
-    };
+        solve();
+        if (gDONE == true) {
+            kd_print_board(board);
+            printf("Solved Sudoku\n");
+            // Solution found
+        } else {
+            printf("Did not solve Sudoku\n");
+            // No solution
+        }
+    }
 
-    free_gMOAS();
+    kd_print_nodes(&opts, gDLX != NULL ? gDLX->nodes : gSEARCH->nodes);
+    kd_free_dlx(gDLX);
+    kd_free_search(gSEARCH);
+    kd_free_puzzle(gPUZZLE);
     return 0;
 }